@@ -32,8 +32,11 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <time.h>
+#include <signal.h>
 #include <sys/stat.h>
 #include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
 
 #include "quickjs/cutils.h"
 #include "quickjs/quickjs-libc.h"
@@ -42,6 +45,13 @@
 #define MODPATH "/usr/local/share/afb-jscli/modules"
 #endif
 
+#ifndef QJS_VERSION
+#define QJS_VERSION "unknown"
+#endif
+
+#define PROG      "afb-jscli"
+#define VERSION   "0.0.0"
+
 static const char *extensions[] = {
 	"",
 	".js",
@@ -52,14 +62,191 @@ static const char *extensions[] = {
 /* variable names for path search */
 static const char *varnames_for_path_search[] = { "JS_PATH", "AFB_JSCLI_PATH", NULL };
 
-static const char *currentdir;
+/* name of the optional manifest of MODPATH, lines of: specifier path-relative-to-MODPATH */
+#define MANIFEST  "afb-jscli.manifest"
+
+/* directory of the module being loaded, per thread for the workers */
+static __thread const char *currentdir;
+
+/*
+ * Resolution of modules is cached: the directories of the search path
+ * are computed once, the listing of each directory probed is read again
+ * only when its modification time changes and the modules found are
+ * recorded by working directory, importing directory and specifier.
+ * Failed resolutions are not recorded so that modules created later can
+ * be imported. Modules of MODPATH can also be given by a manifest.
+ */
+
+/* an entry of a directory listing */
+struct dirent_idx
+{
+	char *name;
+	unsigned char type;
+};
+
+/* listing of a directory sorted by name */
+struct dirindex
+{
+	struct dirindex *next;
+	int listed;             /* is the listing complete */
+	int count;
+	struct timespec mtime;  /* of the directory when listed */
+	struct dirent_idx *entries;
+	char path[];
+};
+
+/* result of a successful resolution */
+struct resolution
+{
+	struct resolution *next;
+	char *resolved;
+	char key[];
+};
+
+/* entry of the manifest */
+struct manifest
+{
+	struct manifest *next;
+	char *path;
+	char specifier[];
+};
+
+#define RESOLVE_BUCKETS 64
+
+static pthread_mutex_t resolve_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct dirindex *dirindexes;
+static struct resolution *resolutions[RESOLVE_BUCKETS];
+static char **search_dirs;
+static int search_dirs_count = -1;
+static struct manifest *manifest;
+static int manifest_loaded;
+
+static unsigned hash_str(unsigned h, const char *str)
+{
+	while (*str)
+		h = h * 31 + (unsigned char)*str++;
+	return h;
+}
+
+static int dirent_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct dirent_idx*)a)->name, ((const struct dirent_idx*)b)->name);
+}
+
+/* release the entries of the listing */
+static void dirindex_clear(struct dirindex *idx)
+{
+	while (idx->count)
+		free(idx->entries[--idx->count].name);
+	free(idx->entries);
+	idx->entries = NULL;
+	idx->listed = 0;
+}
+
+/* get the listing of the directory, read at first use and when modified */
+static struct dirindex *dirindex_get(const char *path)
+{
+	struct dirindex *idx;
+	struct dirent_idx *entries;
+	struct dirent *ent;
+	struct stat st;
+	DIR *dir;
+	int alloc;
+
+	if (stat(path, &st) < 0)
+		st.st_mtim.tv_sec = st.st_mtim.tv_nsec = -1;
+	for (idx = dirindexes ; idx ; idx = idx->next)
+		if (!strcmp(idx->path, path))
+			break;
+	if (idx) {
+		if (idx->mtime.tv_sec == st.st_mtim.tv_sec && idx->mtime.tv_nsec == st.st_mtim.tv_nsec)
+			return idx;
+		dirindex_clear(idx);
+	}
+	else {
+		idx = malloc(sizeof *idx + 1 + strlen(path));
+		if (!idx)
+			return NULL;
+		strcpy(idx->path, path);
+		idx->listed = 0;
+		idx->count = 0;
+		idx->entries = NULL;
+		idx->next = dirindexes;
+		dirindexes = idx;
+	}
+	idx->mtime = st.st_mtim;
+	dir = opendir(path);
+	if (dir) {
+		/* not listed on errors, as for directories not readable */
+		alloc = 0;
+		idx->listed = 1;
+		while ((ent = readdir(dir))) {
+			if (idx->count == alloc) {
+				alloc = alloc ? 2 * alloc : 32;
+				entries = realloc(idx->entries, alloc * sizeof *entries);
+				if (!entries) {
+					idx->listed = 0;
+					break;
+				}
+				idx->entries = entries;
+			}
+			idx->entries[idx->count].name = strdup(ent->d_name);
+			if (!idx->entries[idx->count].name) {
+				idx->listed = 0;
+				break;
+			}
+			idx->entries[idx->count++].type = ent->d_type;
+		}
+		closedir(dir);
+		qsort(idx->entries, idx->count, sizeof *idx->entries, dirent_cmp);
+	}
+	return idx;
+}
+
+/* check if path is a readable regular file using the listing of its directory,
+ * or the file system when the directory can not be listed */
+static int is_file(const char *path)
+{
+	char dir[PATH_MAX + 1];
+	const char *base;
+	struct dirindex *idx;
+	struct dirent_idx key, *ent;
+	struct stat st;
+	size_t length;
+
+	base = strrchr(path, '/');
+	if (!base) {
+		strcpy(dir, ".");
+		base = path;
+	}
+	else {
+		length = base == path ? 1 : (size_t)(base - path);
+		if (length > PATH_MAX)
+			return 0;
+		memcpy(dir, path, length);
+		dir[length] = 0;
+		base++;
+	}
+
+	idx = dirindex_get(dir);
+	if (idx && idx->listed) {
+		key.name = (char*)base;
+		ent = bsearch(&key, idx->entries, idx->count, sizeof *idx->entries, dirent_cmp);
+		if (!ent)
+			return 0;
+		if (ent->type == DT_REG)
+			return access(path, R_OK) == 0;
+		if (ent->type != DT_LNK && ent->type != DT_UNKNOWN)
+			return 0;
+	}
+	return access(path, R_OK) == 0 && stat(path, &st) == 0 && S_ISREG(st.st_mode);
+}
 
 static int try_path_of_required(char *path, size_t size, const char *fmt, ...)
 {
 	va_list ap;
 	size_t s;
-	int idx, rc;
-	struct stat st;
+	int idx;
 
 	/* get the base name */
 	va_start(ap, fmt);
@@ -70,7 +257,7 @@ static int try_path_of_required(char *path, size_t size, const char *fmt, ...)
 		for (idx = 0 ; idx < sizeof extensions / sizeof *extensions ; idx++) {
 			if (s + strlen(extensions[idx]) < size) {
 				strcpy(path + s, extensions[idx]);
-				if (access(path, R_OK) == 0 && stat(path, &st) == 0 && S_ISREG(st.st_mode))
+				if (is_file(path))
 					return 1;
 			}
 		}
@@ -89,32 +276,355 @@ static int path_search_enabled(const char *required)
 	return required[2] != '/';
 }
 
-static int search_path_of_required(char *path, size_t size, const char *required)
+/* compute once the directories of the variables of search */
+static void init_search_dirs()
 {
-	int ivar, iend, found;
+	int ivar, iend, count = 0;
 	const char *spat;
+	char **dirs = NULL, **ndirs, *dir;
+
+	for (ivar = 0 ; varnames_for_path_search[ivar] ; ivar++) {
+		spat = getenv(varnames_for_path_search[ivar]);
+		while (spat && *spat) {
+			for ( ; *spat && *spat == ':' ; spat++);
+			for (iend = 0 ; spat[iend] && spat[iend] != ':' ; iend++);
+			if (iend) {
+				dir = strndup(spat, iend);
+				ndirs = realloc(dirs, (count + 1) * sizeof *dirs);
+				if (!dir || !ndirs) {
+					free(dir);
+					if (ndirs)
+						dirs = ndirs;
+					break;
+				}
+				dirs = ndirs;
+				dirs[count++] = dir;
+				spat += iend;
+			}
+		}
+	}
+	search_dirs = dirs;
+	search_dirs_count = count;
+}
+
+/* read the manifest of MODPATH if any */
+static void load_manifest()
+{
+	char line[2 * PATH_MAX + 2], spec[PATH_MAX + 1], rel[PATH_MAX + 1];
+	struct manifest *m;
+	FILE *file;
+
+	manifest_loaded = 1;
+	file = fopen(MODPATH "/" MANIFEST, "r");
+	if (!file)
+		return;
+	while (fgets(line, sizeof line, file)) {
+		if (line[0] == '#' || sscanf(line, "%4096s %4096s", spec, rel) != 2)
+			continue;
+		m = malloc(sizeof *m + 1 + strlen(spec));
+		if (!m)
+			break;
+		m->path = malloc(sizeof MODPATH + 1 + strlen(rel));
+		if (!m->path) {
+			free(m);
+			break;
+		}
+		sprintf(m->path, "%s/%s", MODPATH, rel);
+		strcpy(m->specifier, spec);
+		m->next = manifest;
+		manifest = m;
+	}
+	fclose(file);
+}
+
+static int search_modpath(char *path, size_t size, const char *required)
+{
+	struct manifest *m;
+
+	if (!manifest_loaded)
+		load_manifest();
+	for (m = manifest ; m ; m = m->next)
+		if (!strcmp(m->specifier, required)) {
+			if (strlen(m->path) >= size)
+				return 0;
+			strcpy(path, m->path);
+			return 1;
+		}
+	return try_path_of_required(path, size, "%s/%s", MODPATH, required);
+}
+
+static int search_path_of_required_uncached(char *path, size_t size, const char *required)
+{
+	int idir, found;
 
 	found = try_path_of_required(path, size, "%s", required);
 	if (!found && path_search_enabled(required)) {
 		if (currentdir)
 			found = try_path_of_required(path, size, "%s/%s", currentdir, required);
-		for (ivar = 0 ; !found && varnames_for_path_search[ivar] ; ivar++) {
-			spat = getenv(varnames_for_path_search[ivar]);
-			while (spat && *spat && !found) {
-				for ( ; *spat && *spat == ':' ; spat++);
-				for (iend = 0 ; spat[iend] && spat[iend] != ':' ; iend++);
-				if (iend) {
-					found = try_path_of_required(path, size, "%s/%s", iend, spat, required);
-					spat += iend;
+		if (search_dirs_count < 0)
+			init_search_dirs();
+		for (idir = 0 ; !found && idir < search_dirs_count ; idir++)
+			found = try_path_of_required(path, size, "%s/%s", search_dirs[idir], required);
+		if (!found)
+			found = search_modpath(path, size, required);
+	}
+	return found;
+}
+
+static int search_path_of_required(char *path, size_t size, const char *required)
+{
+	char cwd[PATH_MAX + 1];
+	const char *dir = currentdir ? currentdir : "";
+	struct resolution *r, **bucket;
+	size_t clen, dlen = strlen(dir), rlen = strlen(required);
+	int found;
+
+	/* relative lookups depend on the working directory */
+	if (required[0] == '/')
+		cwd[0] = 0;
+	else if (!getcwd(cwd, sizeof cwd)) {
+		pthread_mutex_lock(&resolve_lock);
+		found = search_path_of_required_uncached(path, size, required);
+		pthread_mutex_unlock(&resolve_lock);
+		return found;
+	}
+	clen = strlen(cwd);
+
+	pthread_mutex_lock(&resolve_lock);
+	bucket = &resolutions[hash_str(hash_str(hash_str(0, cwd), dir), required) % RESOLVE_BUCKETS];
+	for (r = *bucket ; r ; r = r->next)
+		if (!memcmp(r->key, cwd, clen + 1)
+		 && !memcmp(&r->key[clen + 1], dir, dlen + 1)
+		 && !strcmp(&r->key[clen + dlen + 2], required))
+			break;
+	if (r) {
+		found = strlen(r->resolved) < size;
+		if (found)
+			strcpy(path, r->resolved);
+	}
+	else {
+		found = search_path_of_required_uncached(path, size, required);
+		if (found) {
+			r = malloc(sizeof *r + clen + dlen + rlen + 3);
+			if (r) {
+				r->resolved = strdup(path);
+				if (!r->resolved)
+					free(r);
+				else {
+					memcpy(r->key, cwd, clen + 1);
+					memcpy(&r->key[clen + 1], dir, dlen + 1);
+					memcpy(&r->key[clen + dlen + 2], required, rlen + 1);
+					r->next = *bucket;
+					*bucket = r;
 				}
 			}
 		}
-		if (!found)
-			found = try_path_of_required(path, size, "%s/%s", MODPATH, required);
 	}
+	pthread_mutex_unlock(&resolve_lock);
 	return found;
 }
 
+/*
+ * Bytecode cache: when enabled, the compiled form of each module is
+ * written by JS_WriteObject in a cache directory and is reused by later
+ * launches while the real path, the device and inode, the modification
+ * time and the size of the source and the version of QuickJS are unchanged.
+ */
+
+/* header of the files of the cache, followed by the path and the bytecode */
+struct cache_header
+{
+	char magic[32];
+	uint64_t dev;
+	uint64_t ino;
+	int64_t mtime;
+	int64_t mtime_nsec;
+	int64_t size;
+	uint32_t pathlen;
+	uint32_t codelen;
+};
+
+static char *cache_dir;
+static int cache_wanted; /* set by --cache, --cache-dir or AFB_JSCLI_CACHE */
+static int cache_state; /* 0: not initialized, 1: enabled, -1: disabled */
+
+/* create the directory path and its parents */
+static int mkdirs(char *path)
+{
+	char *iter;
+
+	for (iter = path + 1 ; *iter ; iter++) {
+		if (*iter == '/') {
+			*iter = 0;
+			if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+				*iter = '/';
+				return -1;
+			}
+			*iter = '/';
+		}
+	}
+	return mkdir(path, 0755) < 0 && errno != EEXIST ? -1 : 0;
+}
+
+/* compute once the cache directory: AFB_JSCLI_CACHE, XDG_CACHE_HOME or HOME */
+static int cache_enabled()
+{
+	const char *env, *fmt = "%s";
+	char *dir;
+
+	if (cache_state)
+		return cache_state > 0;
+	cache_state = -1;
+	dir = cache_dir;
+	env = getenv("AFB_JSCLI_CACHE");
+	if (!dir && !cache_wanted && (!env || !*env))
+		return 0;
+	if (!dir) {
+		if (!env || !*env) {
+			fmt = "%s/" PROG;
+			env = getenv("XDG_CACHE_HOME");
+			if (!env || !*env) {
+				fmt = "%s/.cache/" PROG;
+				env = getenv("HOME");
+			}
+		}
+		if (!env || !*env)
+			return 0;
+		dir = malloc(strlen(fmt) + strlen(env));
+		if (!dir)
+			return 0;
+		sprintf(dir, fmt, env);
+		cache_dir = dir;
+	}
+	if (mkdirs(dir) < 0)
+		return 0;
+	cache_state = 1;
+	return 1;
+}
+
+/* path of the cache file of filename */
+static void cache_path(char *path, size_t size, const char *filename)
+{
+	uint64_t h = 14695981039346656037ULL;
+
+	while (*filename)
+		h = (h ^ (unsigned char)*filename++) * 1099511628211ULL;
+	snprintf(path, size, "%s/%016llx.qjsc", cache_dir, (unsigned long long)h);
+}
+
+static void cache_header_init(struct cache_header *hdr, const char *filename, const struct stat *st)
+{
+	memset(hdr, 0, sizeof *hdr);
+	strncpy(hdr->magic, PROG " " QJS_VERSION, sizeof hdr->magic - 1);
+	hdr->dev = (uint64_t)st->st_dev;
+	hdr->ino = (uint64_t)st->st_ino;
+	hdr->mtime = (int64_t)st->st_mtim.tv_sec;
+	hdr->mtime_nsec = (int64_t)st->st_mtim.tv_nsec;
+	hdr->size = (int64_t)st->st_size;
+	hdr->pathlen = (uint32_t)strlen(filename);
+}
+
+/* read the compiled module of filename, returns JS_UNDEFINED when not cached */
+static JSValue cache_read(JSContext *ctx, const char *filename, const struct stat *st)
+{
+	char path[PATH_MAX + 1];
+	struct cache_header ref, *hdr;
+	uint8_t *buf;
+	size_t len;
+	JSValue val = JS_UNDEFINED;
+
+	cache_path(path, sizeof path, filename);
+	buf = js_load_file(ctx, &len, path);
+	if (!buf)
+		return val;
+	cache_header_init(&ref, filename, st);
+	hdr = (struct cache_header*)buf;
+	if (len >= sizeof *hdr
+	 && !memcmp(hdr->magic, ref.magic, sizeof ref.magic)
+	 && hdr->dev == ref.dev
+	 && hdr->ino == ref.ino
+	 && hdr->mtime == ref.mtime
+	 && hdr->mtime_nsec == ref.mtime_nsec
+	 && hdr->size == ref.size
+	 && hdr->pathlen == ref.pathlen
+	 && len == sizeof *hdr + hdr->pathlen + hdr->codelen
+	 && !memcmp(&hdr[1], filename, hdr->pathlen)) {
+		val = JS_ReadObject(ctx, buf + sizeof *hdr + hdr->pathlen,
+					hdr->codelen, JS_READ_OBJ_BYTECODE);
+		if (JS_IsException(val)) {
+			/* unreadable entry: recompile */
+			JS_FreeValue(ctx, JS_GetException(ctx));
+			val = JS_UNDEFINED;
+		}
+		else if (JS_ResolveModule(ctx, val) < 0) {
+			JS_FreeValue(ctx, val);
+			val = JS_EXCEPTION;
+		}
+	}
+	js_free(ctx, buf);
+	return val;
+}
+
+/* write the compiled module of filename, atomically for concurrent launches */
+static void cache_write(JSContext *ctx, const char *filename, const struct stat *st, JSValueConst val)
+{
+	char path[PATH_MAX + 1], tmp[PATH_MAX + 1];
+	struct cache_header hdr;
+	uint8_t *code;
+	size_t len;
+	int fd, ok;
+
+	code = JS_WriteObject(ctx, &len, val, JS_WRITE_OBJ_BYTECODE);
+	if (!code) {
+		JS_FreeValue(ctx, JS_GetException(ctx));
+		return;
+	}
+	cache_header_init(&hdr, filename, st);
+	hdr.codelen = (uint32_t)len;
+	cache_path(path, sizeof path, filename);
+	snprintf(tmp, sizeof tmp, "%s.XXXXXX", path);
+	fd = mkstemp(tmp);
+	if (fd >= 0) {
+		ok = write(fd, &hdr, sizeof hdr) == (ssize_t)sizeof hdr
+		  && write(fd, filename, hdr.pathlen) == (ssize_t)hdr.pathlen
+		  && write(fd, code, len) == (ssize_t)len;
+		ok = !close(fd) && ok;
+		if (!ok || rename(tmp, path) < 0)
+			unlink(tmp);
+	}
+	js_free(ctx, code);
+}
+
+/* compile the module of filename, through the cache when enabled */
+static JSValue compile_module(JSContext *ctx, const char *filename)
+{
+	char real[PATH_MAX];
+	struct stat st;
+	uint8_t *buf;
+	size_t len;
+	JSValue val;
+	int cached;
+
+	/* entries are keyed by the real path, the same for any path given */
+	cached = cache_enabled() && realpath(filename, real)
+		&& !stat(real, &st) && S_ISREG(st.st_mode);
+	if (cached) {
+		val = cache_read(ctx, real, &st);
+		if (!JS_IsUndefined(val))
+			return val;
+	}
+	buf = js_load_file(ctx, &len, filename);
+	if (!buf) {
+		JS_ThrowReferenceError(ctx, "could not load module filename '%s'", filename);
+		return JS_EXCEPTION;
+	}
+	val = JS_Eval(ctx, (char*)buf, len, filename, JS_EVAL_TYPE_MODULE | JS_EVAL_FLAG_COMPILE_ONLY);
+	js_free(ctx, buf);
+	if (cached && !JS_IsException(val))
+		cache_write(ctx, real, &st, val);
+	return val;
+}
+
 static int eval_buf(JSContext *ctx, const void *buf, int buf_len,
                     const char *filename, int eval_flags)
 {
@@ -145,29 +655,94 @@ static int eval_buf(JSContext *ctx, const void *buf, int buf_len,
 
 static int eval_file(JSContext *ctx, const char *filename)
 {
-	uint8_t *buf;
+	JSValue val;
 	int ret;
-	size_t buf_len;
 
-	buf = js_load_file(ctx, &buf_len, filename);
-	if (!buf) {
+	if (access(filename, R_OK) < 0) {
 		perror(filename);
 		exit(1);
 	}
 
-	ret = eval_buf(ctx, buf, buf_len, filename, JS_EVAL_TYPE_MODULE);
-	js_free(ctx, buf);
+	val = compile_module(ctx, filename);
+	if (!JS_IsException(val)) {
+		js_module_set_import_meta(ctx, val, FALSE, TRUE);
+		val = JS_EvalFunction(ctx, val);
+	}
+	if (JS_IsException(val)) {
+		js_std_dump_error(ctx);
+		ret = -1;
+	} else {
+		ret = 0;
+	}
+	JS_FreeValue(ctx, val);
 	return ret;
 }
 
+#ifdef EMBED_MODULES
+/*
+ * Builtin modules: the standard modules are embedded as bytecode
+ * compiled by qjsc and afb-qjs is linked in. They are found before
+ * any search of the file system.
+ */
+extern JSModuleDef *js_init_module_afb(JSContext *ctx, const char *module_name);
+extern const uint8_t qjsc_system[], qjsc_libafbws[], qjsc_diag[], qjsc_afb[];
+extern const uint32_t qjsc_system_size, qjsc_libafbws_size, qjsc_diag_size, qjsc_afb_size;
+
+struct builtin
+{
+	const char *specifier;
+	const uint8_t *code;
+	const uint32_t *size;
+	JSModuleDef *(*init)(JSContext *ctx, const char *module_name);
+};
+
+static const struct builtin builtins[] = {
+	{ "system",     qjsc_system,   &qjsc_system_size,   NULL },
+	{ "libafbws",   qjsc_libafbws, &qjsc_libafbws_size, NULL },
+	{ "diag",       qjsc_diag,     &qjsc_diag_size,     NULL },
+	{ "afb",        qjsc_afb,      &qjsc_afb_size,      NULL },
+	{ "afb-qjs.so", NULL,          NULL,                js_init_module_afb },
+	{ NULL,         NULL,          NULL,                NULL }
+};
+
+/* load the builtin module of specifier, returns 0 if not a builtin */
+static int builtin_load(JSContext *ctx, const char *specifier, JSModuleDef **pm)
+{
+	const struct builtin *b;
+	JSValue val;
+
+	for (b = builtins ; b->specifier && strcmp(b->specifier, specifier) ; b++);
+	if (!b->specifier)
+		return 0;
+	if (b->init)
+		*pm = b->init(ctx, specifier);
+	else {
+		val = JS_ReadObject(ctx, b->code, *b->size, JS_READ_OBJ_BYTECODE);
+		if (JS_IsException(val))
+			*pm = NULL;
+		else {
+			js_module_set_import_meta(ctx, val, FALSE, FALSE);
+			*pm = JS_VALUE_GET_PTR(val);
+			JS_FreeValue(ctx, val);
+		}
+	}
+	return 1;
+}
+#endif
+
 JSModuleDef *module_load(JSContext *ctx, const char *module_name, void *opaque)
 {
 	JSModuleDef *m;
+	JSValue val;
 	char path[PATH_MAX + 1];
 	char dirname[PATH_MAX + 1];
 	const char *name, *prvdir, *tmp;
 	size_t length;
 
+#ifdef EMBED_MODULES
+	if (builtin_load(ctx, module_name, &m))
+		return m;
+#endif
 	name = search_path_of_required(path, sizeof path, module_name) ? path : module_name;
 	prvdir = currentdir;
 	tmp = strrchr(name, '/');
@@ -182,7 +757,19 @@ JSModuleDef *module_load(JSContext *ctx, const char *module_name, void *opaque)
 		currentdir = dirname;
 	}
 
-	m = js_module_loader(ctx, name, opaque);
+	length = strlen(name);
+	if (length > 3 && !strcmp(name + length - 3, ".so"))
+		m = js_module_loader(ctx, name, opaque);
+	else {
+		val = compile_module(ctx, name);
+		if (JS_IsException(val))
+			m = NULL;
+		else {
+			js_module_set_import_meta(ctx, val, TRUE, FALSE);
+			m = JS_VALUE_GET_PTR(val);
+			JS_FreeValue(ctx, val);
+		}
+	}
 
 	currentdir = prvdir;
 	return m;
@@ -194,6 +781,9 @@ static JSContext *JS_NewCustomContext(JSRuntime *rt)
 {
 	JSContext *ctx = JS_NewContext(rt);
 	if (ctx) {
+		/* loader for ES6 modules, replaces the default one of workers */
+		JS_SetModuleLoaderFunc(rt, NULL, module_load, NULL);
+
 		/* system modules */
 		js_init_module_std(ctx, "std");
 		js_init_module_os(ctx, "os");
@@ -201,14 +791,57 @@ static JSContext *JS_NewCustomContext(JSRuntime *rt)
 	return ctx;
 }
 
-#define PROG      "afb-jscli"
-#define VERSION   "0.0.0"
+/* compile in the cache the modules of path, recursively for directories */
+static int compile_path(JSContext *ctx, const char *path, int explicit)
+{
+	char sub[PATH_MAX + 1];
+	struct stat st;
+	struct dirent *ent;
+	DIR *dir;
+	JSValue val;
+	size_t len;
+	int ret = 0;
+
+	if (stat(path, &st) < 0) {
+		perror(path);
+		return -1;
+	}
+	if (S_ISDIR(st.st_mode)) {
+		dir = opendir(path);
+		if (!dir) {
+			perror(path);
+			return -1;
+		}
+		while ((ent = readdir(dir))) {
+			if (ent->d_name[0] != '.'
+			 && snprintf(sub, sizeof sub, "%s/%s", path, ent->d_name) < (int)sizeof sub
+			 && compile_path(ctx, sub, 0) < 0)
+				ret = -1;
+		}
+		closedir(dir);
+		return ret;
+	}
+	len = strlen(path);
+	if (!explicit && (len < 3 || strcmp(path + len - 3, ".js")))
+		return 0;
+	val = compile_module(ctx, path);
+	if (JS_IsException(val)) {
+		js_std_dump_error(ctx);
+		return -1;
+	}
+	JS_FreeValue(ctx, val);
+	return 0;
+}
 
 void help(void)
 {
 	printf(PROG " version " VERSION "\n"
 		"usage: " PROG " [options] [file [args]]\n"
 		"-h  --help         list options\n"
+		"    --compile      compile the given files and directories in the cache\n"
+		"    --cache        use the bytecode cache, in ~/.cache/" PROG " by default\n"
+		"    --cache-dir=DIR  use the bytecode cache in DIR\n"
+		"    --no-cache     don't use the bytecode cache\n"
 	);
 	exit(1);
 }
@@ -217,7 +850,8 @@ int main(int argc, char **argv)
 {
 	JSRuntime *rt;
 	JSContext *ctx;
-	int optind, status = 1;
+	sigset_t sigs;
+	int optind, compile = 0, status = 1;
 
 	/* cannot use getopt because we want to pass the command line to
 	the script */
@@ -244,6 +878,22 @@ int main(int argc, char **argv)
 				help();
 				continue;
 			}
+			if (!strcmp(longopt, "compile")) {
+				compile = cache_wanted = 1;
+				continue;
+			}
+			if (!strcmp(longopt, "cache")) {
+				cache_wanted = 1;
+				continue;
+			}
+			if (!strcmp(longopt, "no-cache")) {
+				cache_state = -1;
+				continue;
+			}
+			if (!strncmp(longopt, "cache-dir=", 10) && longopt[10]) {
+				cache_dir = strdup(longopt + 10);
+				continue;
+			}
 			if (opt) {
 				fprintf(stderr, PROG": unknown option '-%c'\n", opt);
 			} else {
@@ -253,6 +903,15 @@ int main(int argc, char **argv)
 		}
 	}
 
+	/* the cache is set before workers can start */
+	cache_enabled();
+
+	/* the workers of prefork are watched through sd-event that
+	needs SIGCHLD to be blocked in all the threads */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &sigs, NULL);
+
 	rt = JS_NewRuntime();
 	if (!rt) {
 		fprintf(stderr, PROG": cannot allocate JS runtime\n");
@@ -266,9 +925,21 @@ int main(int argc, char **argv)
 		exit(2);
 	}
 
-	/* loader for ES6 modules */
-	JS_SetModuleLoaderFunc(rt, NULL, module_load, NULL);
 	JS_SetHostPromiseRejectionTracker(rt, js_std_promise_rejection_tracker, NULL);
+
+	/* precompilation only */
+	if (compile) {
+		if (!cache_enabled()) {
+			fprintf(stderr, PROG": no bytecode cache\n");
+			goto fail;
+		}
+		status = 0;
+		while (optind < argc)
+			if (compile_path(ctx, argv[optind++], 1) < 0)
+				status = 1;
+		goto fail;
+	}
+
 	js_std_add_helpers(ctx, argc - optind, argv + optind);
 
 	/* make 'std' and 'os' visible to non module code */
@@ -0,0 +1,47 @@
+/**************************************************************************************
+ * server of the benchmarks: afb-jscli bench-server.js URI
+ *
+ * verbs:
+ *   echo       replies the received object
+ *   push       {count, data}: pushes count times data on the event "bench"
+ *   broadcast  {count, data}: broadcasts count times data as "bench"
+ *   exit       terminates the server
+ */
+import * as AFB from 'afb';
+import * as std from 'std';
+
+var uri = scriptArgs[1];
+
+function onIncoming(ws) {
+	ws.onHangup = function() {};
+	ws.onCall = function(hndl, verb, obj) {
+		var i;
+		switch (verb) {
+		case "echo":
+			hndl.reply(obj);
+			break;
+		case "push":
+			ws.eventCreate(1, "bench");
+			for (i = 0 ; i < obj.count ; i++)
+				ws.eventPush(1, obj.data);
+			ws.eventRemove(1);
+			hndl.reply(true);
+			break;
+		case "broadcast":
+			for (i = 0 ; i < obj.count ; i++)
+				ws.eventBroadcast("bench", obj.data, 0);
+			hndl.reply(true);
+			break;
+		case "exit":
+			hndl.reply(true);
+			std.exit(0);
+			break;
+		default:
+			hndl.reply(null, "unknown-verb", verb);
+			break;
+		}
+	};
+}
+
+AFB.AFBWSAPI.serve_(uri, onIncoming);
+AFB.wait_forever();
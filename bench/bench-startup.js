@@ -0,0 +1,2 @@
+/* startup benchmark: launching afb-jscli and importing afb */
+import * as AFB from 'afb';
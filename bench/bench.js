@@ -0,0 +1,195 @@
+/**************************************************************************************
+ * benchmarks of afb-jscli
+ *
+ * usage: afb-jscli bench.js [--quick] [--output FILE] [--uri URI]
+ *
+ * A server (bench-server.js) is started on a unix socket and measured for:
+ *   - calls/s and latency percentiles of AFBWSAPI.call, one by one and pipelined,
+ *     with objects or with payloads serialized once
+ *   - events/s of eventPush and eventBroadcast
+ *   - round trips of AFBWSJ1 calls when BENCH_WSJ1_URI is set (with
+ *     BENCH_WSJ1_API and BENCH_WSJ1_VERB, default hello/ping)
+ *   - startup time of afb-jscli importing afb
+ * for payloads from true to 1 MB. The results are emitted as JSON. Received
+ * JSON is parsed by the kernel of the CPU unless AFB_JSON_KERNEL tells one of
+ * avx2, sse4.2, neon, scalar or quickjs.
+ */
+import * as AFB from 'afb';
+import * as std from 'std';
+import * as os from 'os';
+
+var now = AFB.afb_now;
+
+/* options */
+var quick = false;
+var output = null;
+var uri = "unix:@afb-jscli-bench-" + Math.floor(Math.random() * 1e9);
+for (var i = 1 ; i < scriptArgs.length ; i++) {
+	switch (scriptArgs[i]) {
+	case "--quick": quick = true; break;
+	case "--output": output = scriptArgs[++i]; break;
+	case "--uri": uri = scriptArgs[++i]; break;
+	default:
+		std.err.puts("unknown argument " + scriptArgs[i] + "\n");
+		std.exit(1);
+	}
+}
+
+var jscli = os.readlink("/proc/self/exe")[0];
+var dir = scriptArgs[0].replace(/[^\/]*$/, "") || "./";
+var scale = quick ? 0.1 : 1;
+
+/* payloads by size in bytes of their data, 0 is true */
+var sizes = [0, 100, 1024, 16384, 262144, 1048576];
+
+function payload(size) {
+	return size ? { data: "x".repeat(size) } : true;
+}
+
+/* count of operations for a payload size */
+function count_of(size, base) {
+	return Math.max(10, Math.round(scale * Math.min(base, 2e8 / (size + 100))));
+}
+
+function percentiles(lat) {
+	lat.sort(function(a, b) { return a - b; });
+	function p(q) { return lat[Math.min(lat.length - 1, Math.floor(q * lat.length))]; }
+	return {
+		p50: Math.round(p(0.50) * 1000),
+		p90: Math.round(p(0.90) * 1000),
+		p99: Math.round(p(0.99) * 1000),
+		max: Math.round(lat[lat.length - 1] * 1000)
+	};
+}
+
+var results = [];
+
+function record(name, size, count, ms, lat) {
+	var r = { name: name, size: size, count: count, seconds: ms / 1000, rate: Math.round(count * 1000 / ms) };
+	if (lat)
+		r.latency_us = percentiles(lat);
+	results.push(r);
+	std.err.puts(name + " size " + size + ": " + r.rate + "/s\n");
+}
+
+/* start the server and wait until it accepts connections */
+function start_server() {
+	var pid = os.exec([jscli, dir + "bench-server.js", uri], { block: false });
+	var ws = null, t0 = now();
+	while (!ws && now() - t0 < 5000) {
+		try {
+			ws = new AFB.AFBWSAPI(uri);
+		}
+		catch (e) {
+			os.sleep(10);
+		}
+	}
+	if (!ws) {
+		std.err.puts("can't connect the bench server at " + uri + "\n");
+		os.kill(pid, os.SIGTERM);
+		std.exit(1);
+	}
+	ws.onHangup = function() {};
+	return { pid: pid, ws: ws };
+}
+
+/* calls keeping window calls in flight, the object serialized once if pre */
+function bench_calls(ws, name, window, size, count, pre) {
+	var obj = pre ? new AFB.Payload(payload(size)) : payload(size);
+	var sent = 0, done = 0, lat = [];
+	function send() {
+		var t = now();
+		sent++;
+		ws.call_("echo", obj, function(res, err) {
+			lat.push(now() - t);
+			if (err && err != "success")
+				throw new Error("echo failed: " + err);
+			done++;
+			if (sent < count)
+				send();
+		});
+	}
+	var t0 = now();
+	while (sent < window && sent < count)
+		send();
+	AFB.wait_while(function() { return done < count; });
+	record(name, size, count, now() - t0, lat);
+}
+
+/* events pushed or broadcasted by the server */
+function bench_events(ws, verb, size, count) {
+	var received = 0, replied = false;
+	ws.onEventCreate = function() {};
+	ws.onEventRemove = function() {};
+	ws.onEventPush = function() { received++; };
+	ws.onEventBroadcast = function() { received++; };
+	var t0 = now();
+	ws.call_(verb, { count: count, data: payload(size) }, function() { replied = true; });
+	AFB.wait_while(function() { return !replied || received < count; });
+	record(verb, size, count, now() - t0);
+}
+
+/* round trips of WSJ1 to an external binder */
+function bench_wsj1(size, count) {
+	var ws = new AFB.AFBWSJ1(std.getenv("BENCH_WSJ1_URI"));
+	var api = std.getenv("BENCH_WSJ1_API") || "hello";
+	var verb = std.getenv("BENCH_WSJ1_VERB") || "ping";
+	var obj = payload(size), done = 0, lat = [];
+	var t0 = now();
+	function send() {
+		var t = now();
+		ws.call_(api, verb, obj, function() {
+			lat.push(now() - t);
+			if (++done < count)
+				send();
+		});
+	}
+	send();
+	AFB.wait_while(function() { return done < count; });
+	record("wsj1-call", size, count, now() - t0, lat);
+	ws.disconnect();
+}
+
+/* time to launch afb-jscli importing afb */
+function bench_startup(count) {
+	var lat = [], t0 = now(), t, i;
+	for (i = 0 ; i < count ; i++) {
+		t = now();
+		os.exec([jscli, dir + "bench-startup.js"]);
+		lat.push(now() - t);
+	}
+	record("startup", 0, count, now() - t0, lat);
+}
+
+var server = start_server();
+sizes.forEach(function(size) {
+	bench_calls(server.ws, "call", 1, size, count_of(size, 5000));
+	bench_calls(server.ws, "call-pipelined", 64, size, count_of(size, 50000));
+	bench_calls(server.ws, "call-payload", 64, size, count_of(size, 50000), true);
+});
+sizes.forEach(function(size) {
+	bench_events(server.ws, "push", size, count_of(size, 100000));
+	bench_events(server.ws, "broadcast", size, count_of(size, 100000));
+});
+if (std.getenv("BENCH_WSJ1_URI"))
+	sizes.forEach(function(size) { bench_wsj1(size, count_of(size, 5000)); });
+server.ws.disconnect();
+os.kill(server.pid, os.SIGTERM);
+os.waitpid(server.pid, 0);
+bench_startup(quick ? 5 : 50);
+
+var report = JSON.stringify({
+	date: new Date().toISOString(),
+	quick: quick,
+	uri: uri,
+	json_kernel: AFB.afb_json_kernel(),
+	results: results
+}, null, 1);
+if (output) {
+	var f = std.open(output, "w");
+	f.puts(report + "\n");
+	f.close();
+}
+else
+	print(report);
+std.exit(0);
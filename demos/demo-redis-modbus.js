@@ -7,7 +7,7 @@ import * as AFB from 'libafbws';
 var events = {};
 function getevent(name) {
 	if (!events[name])
-		events[name] = [];
+		events[name] = new AFB.AFBWSAPIGroup();
 	return events[name];
 };
 
@@ -20,7 +20,7 @@ function onIncoming(ws) {
 			print("mkev "+String(idg)+" "+name+"\n");
 			ws.eventCreate_(idg, name);
 			print("DONE\n");
-			getevent(name).push({ ws: ws, id: idg });
+			getevent(name).add(ws, idg);
 		}
 		return idn[name];
 	};
@@ -31,10 +31,7 @@ function onIncoming(ws) {
 			hndl.reply(true);
 		}
 		else if (obj.action == "PUSH") {
-			getevent(verb).forEach(function(item){
-					print("pushing id "+String(item.id)+"\n");
-					item.ws.eventPush_(item.id,obj.data);
-				});
+			print("pushed to "+String(getevent(verb).push(obj.data))+"\n");
 			hndl.reply(true);
 		}
 	};
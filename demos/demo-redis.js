@@ -6,30 +6,20 @@ import * as AFB from 'libafbws';
 modbus = new AFB.AFBWSAPI("unix:@modbus");
 redis = new AFB.AFBWSAPI("unix:@redis");
 
-modbus._eventids_ = {};
-
-modbus.onEventCreate = function (id, name) { /* TODO add in LIB */
-	print("add event " + String(id) + " => " + name + "\n");
-	this._eventids_[id] = name;
-}
-
-modbus.onEventRemove = function (id) { /* TODO add in LIB */
-	print("del event " + String(id) + "\n");
-	delete this._eventids_[id];
-}
-
-modbus.onEventPush = function (id, obj) {
-	print("received event " + String(id) 
-		 + " " + this._eventids_[id]
+function forward(obj, name) {
+	print("received event " + name
 		 + " " + JSON.stringify(obj)
 		 + "\n");
 	redis.call("ts_jinsert", {
-		class: this._eventids_[id],
+		class: name,
 		data: obj,
 		timestamp: '*'
 	});
 }
 
+modbus.on("1510SP/dig", forward);
+modbus.on("1510SP/ana", forward);
+
 function subscribe_modbus() {
 
 	modbus.call("1510SP/dig", {action: "SUBSCRIBE"});
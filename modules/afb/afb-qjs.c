@@ -23,11 +23,24 @@
  */
 
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/eventfd.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
 #include <systemd/sd-event.h>
 
 #include <quickjs/quickjs.h>
+#include <quickjs/quickjs-libc.h>
 
 #include <libafbcli/afb-wsapi.h>
 #include <libafbcli/afb-wsj1.h>
@@ -39,13 +52,53 @@ extern int AFBWSAPI_init(JSContext *ctx, JSModuleDef *m);
 extern int AFBWSJ1_preinit(JSContext *ctx, JSModuleDef *m);
 extern int AFBWSJ1_init(JSContext *ctx, JSModuleDef *m);
 
+extern int AFBPAYLOAD_preinit(JSContext *ctx, JSModuleDef *m);
+extern int AFBPAYLOAD_init(JSContext *ctx, JSModuleDef *m);
+extern int AFBJSON_init(JSContext *ctx, JSModuleDef *m);
+extern JSValue pool_stats(JSContext *ctx);
+extern const char *json_parse_kernel();
+extern JSValue json_parse(JSContext *ctx, const char *text, size_t length, const char *name);
+extern JSValue payload_export(JSContext *ctx, JSValueConst value);
+extern JSValue payload_import(JSContext *ctx, JSValueConst value);
+extern void *pool_alloc(size_t size);
+extern void pool_free(void *ptr, size_t size);
+
 #define countof(x) (sizeof(x) / sizeof(*(x)))
 
 /**************************************************************/
 
-static sd_event *sdev = NULL;
-static sd_event_source *break_src = NULL;
-static int break_fd;
+/* the loop and its state are per thread, each worker having its own */
+static __thread sd_event *sdev = NULL;
+static __thread sd_event_source *break_src = NULL;
+static __thread int break_fd;
+
+/* maximum count of sd_event dispatches per call to afb_dispatch */
+#define DISPATCH_MAX 64
+
+/* count of items (connections, servers) needing the loop */
+static __thread int loop_users = 0;
+/* the watcher installed by afb_watch and its last notified state */
+static __thread JSContext *watch_ctx = NULL;
+static __thread JSValue watch_func;
+static __thread int watch_state = 0;
+/* a job running the loop once is enqueued */
+static __thread int loop_kicked = 0;
+/* the watcher is owned by an object bound to afb_watch so that it dies with the module */
+static JSClassID afb_watch_class_id;
+
+static void loop_kick();
+
+/**************************************************************/
+
+/* class ids are shared by the runtimes of all the threads */
+void class_id_init(JSClassID *class_id)
+{
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+	pthread_mutex_lock(&lock);
+	JS_NewClassID(class_id);
+	pthread_mutex_unlock(&lock);
+}
 
 /**************************************************************/
 
@@ -71,6 +124,994 @@ int client_serve(const char *uri, int (*onclient)(void*,int), void *closure)
 
 /**************************************************************/
 
+/*
+ * Pre-forked servers: the listening socket is shared by worker processes
+ * running the same command line (/proc/self/exe), so each has its own
+ * runtime and loop. A worker finds the socket of its uri in PREFORK_ENV,
+ * lines of "fd uri" for all the uris served with workers, and accepts
+ * clients on it. The parent either supervises the workers, respawning
+ * them when they die, or serves as one of them. Workers are spawned once
+ * the loop runs, so the uris must be served before.
+ */
+
+#define PREFORK_ENV "AFB_JSCLI_PREFORK"
+/* minimal lifetime of a worker for respawning it at once, in microseconds */
+#define PREFORK_RESPAWN_DELAY 1000000
+
+struct prefork;
+
+struct worker
+{
+	struct prefork *prefork;
+	pid_t pid;
+	uint64_t started;
+	sd_event_source *child;
+	sd_event_source *timer;
+};
+
+struct prefork
+{
+	struct prefork *next;     /* in the list of the process */
+	int fd;                   /* the listening socket */
+	int stopped;
+	int spawned;              /* are the workers spawned */
+	int supervise;
+	int count;                /* count of worker processes */
+	int alive;                /* count of running worker processes */
+	pid_t parent;
+	sd_event_source *accept;  /* when clients are accepted by this process */
+	int (*onclient)(void*,int);
+	void *closure;
+	char **argv;              /* command line of the workers */
+	struct worker *workers;
+	char uri[];
+};
+
+void prefork_stop(struct prefork *pf);
+
+/* the preforks of the thread, the sockets bound here are given to the workers */
+static __thread struct prefork *preforks;
+static __thread sd_event_source *prefork_defer;
+static __thread int prefork_started;
+
+static int prefork_nop(void *closure, int fd)
+{
+	close(fd);
+	return -1;
+}
+
+/* read the command line of the process */
+static char **self_argv()
+{
+	char buf[65536], **argv, *strs;
+	ssize_t len;
+	int fd, i, n;
+
+	fd = open("/proc/self/cmdline", O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	len = read(fd, buf, sizeof buf - 1);
+	close(fd);
+	if (len <= 0)
+		return NULL;
+	buf[len] = 0;
+	for (n = i = 0 ; i < len ; i++)
+		n += !buf[i];
+	argv = malloc((n + 1) * sizeof *argv + len + 1);
+	if (argv) {
+		strs = memcpy(&argv[n + 1], buf, len + 1);
+		for (n = i = 0 ; i < len ; i += 1 + strlen(&buf[i]))
+			argv[n++] = &strs[i];
+		argv[n] = NULL;
+	}
+	return argv;
+}
+
+static void prefork_release(struct prefork *pf)
+{
+	struct prefork **prv;
+
+	if (pf->stopped && !pf->alive) {
+		for (prv = &preforks ; *prv && *prv != pf ; prv = &(*prv)->next);
+		if (*prv)
+			*prv = pf->next;
+		free(pf->argv);
+		free(pf->workers);
+		free(pf);
+	}
+}
+
+/* environment of the workers, the one of the process with PREFORK_ENV
+ * listing the sockets bound here, built before fork as setenv can't be
+ * called in the child of a threaded process */
+static char **prefork_env()
+{
+	struct prefork *pf;
+	size_t size = sizeof PREFORK_ENV + 1, len = sizeof PREFORK_ENV;
+	char **envp, *env, *p;
+	int i, n;
+
+	for (n = 0 ; environ[n] ; n++);
+	for (pf = preforks ; pf ; pf = pf->next)
+		if (pf->count && !pf->stopped)
+			size += 13 + strlen(pf->uri);
+	envp = malloc((n + 2) * sizeof *envp + size);
+	if (envp) {
+		env = (char*)&envp[n + 2];
+		p = env + sprintf(env, "%s=", PREFORK_ENV);
+		for (pf = preforks ; pf ; pf = pf->next)
+			if (pf->count && !pf->stopped)
+				p += sprintf(p, "%s%d %s", p == env + len ? "" : "\n", pf->fd, pf->uri);
+		envp[0] = env;
+		for (i = 0, n = 1 ; environ[i] ; i++)
+			if (strncmp(environ[i], env, len))
+				envp[n++] = environ[i];
+		envp[n] = NULL;
+	}
+	return envp;
+}
+
+static int prefork_accept_cb(sd_event_source *s, int fd, uint32_t revents, void *userdata)
+{
+	struct prefork *pf = userdata;
+	int cfd;
+
+	/* non blocking, the other workers compete for the client */
+	cfd = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+	if (cfd >= 0)
+		pf->onclient(pf->closure, cfd);
+	return 0;
+}
+
+static int prefork_child_cb(sd_event_source *s, const siginfo_t *si, void *userdata);
+
+static int prefork_spawn(struct worker *w)
+{
+	struct prefork *pf = w->prefork, *it;
+	sigset_t sigs;
+	pid_t pid;
+	char **envp;
+
+	envp = prefork_env();
+	if (!envp)
+		return -ENOMEM;
+	pid = fork();
+	if (pid < 0) {
+		free(envp);
+		return -errno;
+	}
+	if (pid == 0) {
+		/* the worker dies with its parent */
+		prctl(PR_SET_PDEATHSIG, SIGTERM);
+		if (getppid() != pf->parent)
+			_exit(1);
+		sigemptyset(&sigs);
+		sigaddset(&sigs, SIGCHLD);
+		sigprocmask(SIG_UNBLOCK, &sigs, NULL);
+		for (it = preforks ; it ; it = it->next)
+			if (it->count && !it->stopped)
+				fcntl(it->fd, F_SETFD, 0);
+		execve("/proc/self/exe", pf->argv, envp);
+		_exit(127);
+	}
+	free(envp);
+	w->pid = pid;
+	sd_event_now(sdev, CLOCK_MONOTONIC, &w->started);
+	pf->alive++;
+	return sd_event_add_child(sdev, &w->child, pid, WEXITED, prefork_child_cb, w);
+}
+
+static int prefork_timer_cb(sd_event_source *s, uint64_t usec, void *userdata)
+{
+	struct worker *w = userdata;
+
+	w->timer = sd_event_source_unref(w->timer);
+	prefork_spawn(w);
+	return 0;
+}
+
+static int prefork_child_cb(sd_event_source *s, const siginfo_t *si, void *userdata)
+{
+	struct worker *w = userdata;
+	struct prefork *pf = w->prefork;
+	uint64_t now;
+
+	w->child = sd_event_source_unref(w->child);
+	w->pid = 0;
+	pf->alive--;
+	if (pf->stopped || !pf->supervise)
+		prefork_release(pf);
+	else {
+		/* workers dying early are respawned after a delay */
+		sd_event_now(sdev, CLOCK_MONOTONIC, &now);
+		if (now - w->started >= PREFORK_RESPAWN_DELAY)
+			prefork_spawn(w);
+		else
+			sd_event_add_time(sdev, &w->timer, CLOCK_MONOTONIC,
+				w->started + PREFORK_RESPAWN_DELAY, 0, prefork_timer_cb, w);
+	}
+	return 0;
+}
+
+/* get the socket given by the parent for uri or -1, PREFORK_ENV is read
+ * once and removed so that it is not given to other programs */
+static int prefork_inherited(const char *uri)
+{
+	static char *env;
+	static int loaded;
+	const char *p, *end;
+	char *next;
+	size_t length = strlen(uri);
+	long fd;
+	int result = -1;
+
+	if (!loaded) {
+		loaded = 1;
+		p = getenv(PREFORK_ENV);
+		if (p) {
+			env = strdup(p);
+			unsetenv(PREFORK_ENV);
+		}
+		for (p = env ; p && *p ; p = *end ? end + 1 : end) {
+			fd = strtol(p, &next, 10);
+			end = strchrnul(next, '\n');
+			if (next != p && fd >= 0 && fd <= INT_MAX)
+				fcntl((int)fd, F_SETFD, FD_CLOEXEC);
+		}
+	}
+	for (p = env ; p && *p && result < 0 ; p = *end ? end + 1 : end) {
+		fd = strtol(p, &next, 10);
+		end = strchrnul(next, '\n');
+		if (next != p && *next == ' ' && fd >= 0 && fd <= INT_MAX
+		 && (size_t)(end - next - 1) == length && !memcmp(next + 1, uri, length))
+			result = (int)fd;
+	}
+	return result;
+}
+
+/* spawns the workers of the preforks served since the last run */
+static int prefork_defer_cb(sd_event_source *s, void *userdata)
+{
+	struct prefork *pf;
+	int i;
+
+	prefork_defer = sd_event_source_unref(prefork_defer);
+	prefork_started = 1;
+	for (pf = preforks ; pf ; pf = pf->next)
+		if (!pf->spawned && !pf->stopped) {
+			pf->spawned = 1;
+			for (i = !pf->supervise ; i < pf->count ; i++)
+				prefork_spawn(&pf->workers[i]);
+		}
+	return 0;
+}
+
+/* serve uri on count processes, the parent only supervises them if supervise
+ * is set, in a worker it serves the socket given by the parent */
+int prefork_serve(const char *uri, int count, int supervise, int (*onclient)(void*,int), void *closure, struct prefork **result)
+{
+	struct prefork *pf;
+	sd_event *bindloop;
+	sigset_t sigs;
+	int fd, rc, i, first;
+
+	pf = calloc(1, sizeof *pf + 1 + strlen(uri));
+	if (!pf)
+		return -ENOMEM;
+	strcpy(pf->uri, uri);
+	pf->onclient = onclient;
+	pf->closure = closure;
+	pf->parent = getpid();
+	pf->supervise = supervise;
+
+	fd = prefork_inherited(uri);
+	if (fd < 0) {
+		/* spawned workers would not get the socket */
+		rc = -EBUSY;
+		if (prefork_started)
+			goto error;
+		/* the socket is bound through a loop that is never run,
+		it keeps the registration of libafbcli for ever */
+		rc = sd_event_new(&bindloop);
+		if (rc < 0)
+			goto error;
+		fd = afb_ws_client_serve(bindloop, uri, prefork_nop, NULL);
+		sd_event_unref(bindloop);
+		if (fd <= 0) {
+			/* older libafbcli don't return the socket */
+			rc = fd < 0 ? fd : -ENOTSUP;
+			goto error;
+		}
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		pf->count = count;
+	}
+	pf->fd = fd;
+
+	pf->next = preforks;
+	preforks = pf;
+
+	/* spawn the workers when the loop runs, the parent being one of them if not supervising */
+	first = !supervise && pf->count;
+	if (pf->count > first) {
+		rc = -ENOMEM;
+		pf->argv = self_argv();
+		pf->workers = calloc(pf->count, sizeof *pf->workers);
+		if (!pf->argv || !pf->workers)
+			goto error2;
+		for (i = first ; i < pf->count ; i++)
+			pf->workers[i].prefork = pf;
+		if (!prefork_defer) {
+			rc = sd_event_add_defer(sdev, &prefork_defer, prefork_defer_cb, NULL);
+			if (rc < 0)
+				goto error2;
+			loop_kick();
+		}
+		/* blocked at start by afb-jscli, before any thread */
+		sigemptyset(&sigs);
+		sigaddset(&sigs, SIGCHLD);
+		pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+	}
+	if (!supervise || !pf->count) {
+		rc = sd_event_add_io(sdev, &pf->accept, fd, EPOLLIN, prefork_accept_cb, pf);
+		if (rc < 0)
+			goto error2;
+	}
+	*result = pf;
+	return fd;
+
+error2:
+	prefork_stop(pf);
+	return rc;
+error:
+	free(pf);
+	return rc;
+}
+
+/* stop serving and the workers */
+void prefork_stop(struct prefork *pf)
+{
+	int i;
+
+	pf->stopped = 1;
+	pf->accept = sd_event_source_unref(pf->accept);
+	close(pf->fd);
+	for (i = 0 ; pf->workers && i < pf->count ; i++) {
+		pf->workers[i].timer = sd_event_source_unref(pf->workers[i].timer);
+		if (pf->workers[i].pid)
+			kill(pf->workers[i].pid, SIGTERM);
+	}
+	prefork_release(pf);
+}
+
+/**************************************************************/
+
+/* makes the error used for rejecting promises of calls, takes ownership of values */
+JSValue reply_error(JSContext *ctx, JSValue error, JSValue info, JSValue response)
+{
+	JSValue err = JS_NewError(ctx);
+	if (JS_IsException(err)) {
+		JS_FreeValue(ctx, error);
+		JS_FreeValue(ctx, info);
+		JS_FreeValue(ctx, response);
+	}
+	else {
+		JS_DefinePropertyValueStr(ctx, err, "message", JS_ToString(ctx, error),
+					JS_PROP_WRITABLE | JS_PROP_CONFIGURABLE);
+		JS_SetPropertyStr(ctx, err, "error", error);
+		JS_SetPropertyStr(ctx, err, "info", info);
+		JS_SetPropertyStr(ctx, err, "response", response);
+	}
+	return err;
+}
+
+/**************************************************************/
+
+/* runs the loop once, setting its timers and dispatching its deferred events */
+static JSValue loop_kick_job(JSContext *ctx, int argc, JSValueConst *argv)
+{
+	loop_kicked = 0;
+	if (sd_event_get_state(sdev) == SD_EVENT_INITIAL)
+		sd_event_run(sdev, 0);
+	return JS_UNDEFINED;
+}
+
+/* out of a run, timers are only set by the next run and deferred events
+ * wait it, but the QuickJS loop only runs sd_event when its fd is readable */
+static void loop_kick()
+{
+	if (!loop_kicked && watch_ctx && sd_event_get_state(sdev) == SD_EVENT_INITIAL) {
+		loop_kicked = 1;
+		JS_EnqueueJob(watch_ctx, loop_kick_job, 0, NULL);
+	}
+}
+
+static JSValue loop_watch_job(JSContext *ctx, int argc, JSValueConst *argv)
+{
+	JSValue arg, ret;
+	int active = loop_users > 0;
+
+	if (watch_ctx && active != watch_state) {
+		watch_state = active;
+		arg = JS_NewBool(watch_ctx, active);
+		ret = JS_Call(watch_ctx, watch_func, JS_UNDEFINED, 1, &arg);
+		if (JS_IsException(ret))
+			js_std_dump_error(watch_ctx);
+		JS_FreeValue(watch_ctx, ret);
+	}
+	return JS_UNDEFINED;
+}
+
+static void loop_watch_notify()
+{
+	/* deferred as a job because it can be called from finalizers */
+	if (watch_ctx)
+		JS_EnqueueJob(watch_ctx, loop_watch_job, 0, NULL);
+}
+
+void loop_ref()
+{
+	if (!loop_users++)
+		loop_watch_notify();
+}
+
+void loop_unref()
+{
+	if (loop_users > 0 && !--loop_users)
+		loop_watch_notify();
+}
+
+/**************************************************************/
+
+/*
+ * Deadlines are kept in a timer wheel of WHEEL_SLOTS slots of WHEEL_TICK
+ * microseconds. A single sd_event timer is armed at the tick of the next
+ * slot not empty. Deadlines further than a turn stay in their slot and
+ * are skipped until expired.
+ */
+
+#define WHEEL_TICK  10000
+#define WHEEL_SLOTS 256
+
+struct deadline
+{
+	struct deadline *next, **prev;
+	uint64_t expire;                  /* microseconds of CLOCK_MONOTONIC */
+	int armed;                        /* in the wheel, not being notified */
+	void (*expired)(void *closure);
+	void *closure;
+};
+
+static __thread struct deadline *wheel[WHEEL_SLOTS];
+static __thread struct deadline *wheel_expired;   /* being notified */
+static __thread sd_event_source *wheel_src = NULL;
+static __thread uint64_t wheel_tick;              /* next tick to process */
+static __thread uint64_t wheel_next = 0;           /* armed tick or 0 */
+static __thread unsigned wheel_count = 0;
+
+static int wheel_cb(sd_event_source *s, uint64_t usec, void *userdata);
+
+/* time of the loop, or of the clock before the first run */
+static uint64_t wheel_now()
+{
+	struct timespec ts;
+	uint64_t now;
+
+	if (sd_event_now(sdev, CLOCK_MONOTONIC, &now) >= 0)
+		return now;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static void wheel_link(struct deadline **head, struct deadline *d)
+{
+	d->next = *head;
+	d->prev = head;
+	if (*head)
+		(*head)->prev = &d->next;
+	*head = d;
+}
+
+static void wheel_unlink(struct deadline *d)
+{
+	*d->prev = d->next;
+	if (d->next)
+		d->next->prev = d->prev;
+}
+
+/* arms the timer at tick */
+static void wheel_arm(uint64_t tick)
+{
+	wheel_next = tick;
+	if (wheel_src) {
+		sd_event_source_set_time(wheel_src, tick * WHEEL_TICK);
+		sd_event_source_set_enabled(wheel_src, SD_EVENT_ONESHOT);
+	}
+	else
+		sd_event_add_time(sdev, &wheel_src, CLOCK_MONOTONIC,
+				tick * WHEEL_TICK, WHEEL_TICK / 2, wheel_cb, NULL);
+	loop_kick();
+}
+
+/* arms the timer at the next slot not empty or disarms it */
+static void wheel_rearm()
+{
+	uint64_t tick = wheel_tick;
+	unsigned i;
+
+	if (wheel_count) {
+		for (i = 0 ; i < WHEEL_SLOTS - 1 && !wheel[tick % WHEEL_SLOTS] ; i++)
+			tick++;
+		wheel_arm(tick);
+	}
+	else {
+		wheel_next = 0;
+		if (wheel_src)
+			sd_event_source_set_enabled(wheel_src, SD_EVENT_OFF);
+	}
+}
+
+static int wheel_cb(sd_event_source *s, uint64_t usec, void *userdata)
+{
+	uint64_t now, last;
+	struct deadline *d, *next;
+	unsigned n;
+
+	/* moves the expired deadlines of the elapsed slots, a turn at most */
+	now = wheel_now();
+	last = now / WHEEL_TICK;
+	for (n = 0 ; wheel_tick <= last && n < WHEEL_SLOTS ; n++, wheel_tick++)
+		for (d = wheel[wheel_tick % WHEEL_SLOTS] ; d ; d = next) {
+			next = d->next;
+			if (d->expire <= now) {
+				wheel_unlink(d);
+				wheel_link(&wheel_expired, d);
+				d->armed = 0;
+				wheel_count--;
+			}
+		}
+	if (wheel_tick <= last)
+		wheel_tick = last + 1;
+
+	/* notifies them, the notified can cancel others */
+	while ((d = wheel_expired)) {
+		wheel_unlink(d);
+		d->expired(d->closure);
+		pool_free(d, sizeof *d);
+	}
+	wheel_rearm();
+	return 0;
+}
+
+/* calls expired(closure) at expire, in microseconds of CLOCK_MONOTONIC,
+ * unless cancelled before. The deadline is released after its call */
+struct deadline *deadline_create(uint64_t expire, void (*expired)(void*), void *closure)
+{
+	struct deadline *d;
+	uint64_t tick;
+
+	d = pool_alloc(sizeof *d);
+	if (d) {
+		if (!wheel_count)
+			wheel_tick = wheel_now() / WHEEL_TICK;
+		tick = (expire + WHEEL_TICK - 1) / WHEEL_TICK;
+		if (tick < wheel_tick)
+			tick = wheel_tick;
+		d->expire = expire;
+		d->armed = 1;
+		d->expired = expired;
+		d->closure = closure;
+		wheel_link(&wheel[tick % WHEEL_SLOTS], d);
+		wheel_count++;
+		if (!wheel_next || tick < wheel_next)
+			wheel_arm(tick);
+	}
+	return d;
+}
+
+void deadline_cancel(struct deadline *d)
+{
+	wheel_unlink(d);
+	if (d->armed)
+		wheel_count--;
+	pool_free(d, sizeof *d);
+}
+
+/**************************************************************/
+
+/*
+ * Idle calls are done once the events pending in the loop are dispatched,
+ * by a single deferred source of the lowest priority, so at most once per
+ * iteration of the loop whatever the count of events.
+ */
+
+struct idle
+{
+	struct idle *next, **prev;        /* in the list of scheduled ones */
+	void (*fun)(void *closure);
+	void *closure;
+};
+
+static __thread struct idle *idles;
+static __thread sd_event_source *idle_src = NULL;
+
+static int idle_cb(sd_event_source *s, void *userdata)
+{
+	struct idle *idle, *list;
+
+	/* the ones scheduled by the calls wait the next iteration */
+	list = idles;
+	idles = NULL;
+	if (list)
+		list->prev = &list;
+	while ((idle = list)) {
+		list = idle->next;
+		if (list)
+			list->prev = &list;
+		idle->prev = NULL;
+		idle->fun(idle->closure);
+	}
+	return 0;
+}
+
+/* the idle call of fun(closure), done when scheduled */
+struct idle *idle_create(void (*fun)(void*), void *closure)
+{
+	struct idle *idle = pool_alloc(sizeof *idle);
+
+	if (idle) {
+		idle->prev = NULL;
+		idle->fun = fun;
+		idle->closure = closure;
+	}
+	return idle;
+}
+
+/* schedules the idle call if not already */
+int idle_schedule(struct idle *idle)
+{
+	int rc;
+
+	if (idle->prev)
+		return 0;
+	if (!idle_src) {
+		rc = sd_event_add_defer(sdev, &idle_src, idle_cb, NULL);
+		if (rc < 0)
+			return rc;
+		sd_event_source_set_priority(idle_src, SD_EVENT_PRIORITY_IDLE);
+	}
+	rc = sd_event_source_set_enabled(idle_src, SD_EVENT_ONESHOT);
+	if (rc < 0)
+		return rc;
+	idle->next = idles;
+	idle->prev = &idles;
+	if (idles)
+		idles->prev = &idle->next;
+	idles = idle;
+	loop_kick();
+	return 0;
+}
+
+void idle_destroy(struct idle *idle)
+{
+	if (idle->prev) {
+		*idle->prev = idle->next;
+		if (idle->next)
+			idle->next->prev = idle->prev;
+	}
+	pool_free(idle, sizeof *idle);
+}
+
+/**************************************************************/
+
+/*
+ * Upgrade of HTTP connections to websockets (RFC 6455) for serving them:
+ * the request is read as it comes without blocking the loop, then the
+ * protocol is checked and the handshake answered.
+ */
+
+/* max length of the request and time given to send it in microseconds */
+#define UPGRADE_MAX     4096
+#define UPGRADE_TIMEOUT 10000000
+
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+struct upgrade
+{
+	int fd;
+	int ok;
+	int sending;
+	size_t length;
+	size_t written;
+	sd_event_source *source;
+	struct deadline *deadline;
+	const char *protocol;
+	void (*onupgrade)(void *closure, int fd);
+	void *closure;
+	char buffer[UPGRADE_MAX + 1];
+};
+
+#define ROL(x,n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+/* SHA-1 of data, enough for the key of the handshake */
+static void sha1(const char *data, size_t length, unsigned char digest[20])
+{
+	uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+	uint32_t w[80], a, b, c, d, e, f, k, t;
+	unsigned char block[64];
+	uint64_t bits = (uint64_t)length * 8;
+	size_t i, n, off = 0;
+	int last = 0, j;
+
+	while (!last) {
+		/* fill the block, padding after the data */
+		n = off >= length ? 0 : length - off < 64 ? length - off : 64;
+		memcpy(block, data + off, n);
+		if (n < 64) {
+			if (off <= length)
+				block[n++] = 0x80;
+			memset(block + n, 0, 64 - n);
+			if (n <= 56) {
+				for (j = 0 ; j < 8 ; j++)
+					block[63 - j] = (unsigned char)(bits >> (8 * j));
+				last = 1;
+			}
+		}
+		off += 64;
+
+		for (i = 0 ; i < 16 ; i++)
+			w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16
+				| (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+		for ( ; i < 80 ; i++)
+			w[i] = ROL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+		a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4];
+		for (i = 0 ; i < 80 ; i++) {
+			if (i < 20) {
+				f = (b & c) | (~b & d);
+				k = 0x5A827999;
+			}
+			else if (i < 40) {
+				f = b ^ c ^ d;
+				k = 0x6ED9EBA1;
+			}
+			else if (i < 60) {
+				f = (b & c) | (b & d) | (c & d);
+				k = 0x8F1BBCDC;
+			}
+			else {
+				f = b ^ c ^ d;
+				k = 0xCA62C1D6;
+			}
+			t = ROL(a, 5) + f + e + k + w[i];
+			e = d; d = c; c = ROL(b, 30); b = a; a = t;
+		}
+		h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+	}
+	for (i = 0 ; i < 20 ; i++)
+		digest[i] = (unsigned char)(h[i / 4] >> (24 - 8 * (i % 4)));
+}
+
+/* base64 of data in out of size at least 4 * ((length + 2) / 3) + 1 */
+static void base64(const unsigned char *data, size_t length, char *out)
+{
+	static const char tbl[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	uint32_t v;
+	size_t i;
+
+	for (i = 0 ; i + 2 < length ; i += 3) {
+		v = (uint32_t)data[i] << 16 | (uint32_t)data[i + 1] << 8 | data[i + 2];
+		*out++ = tbl[v >> 18];
+		*out++ = tbl[(v >> 12) & 63];
+		*out++ = tbl[(v >> 6) & 63];
+		*out++ = tbl[v & 63];
+	}
+	if (i < length) {
+		v = (uint32_t)data[i] << 16 | (i + 1 < length ? (uint32_t)data[i + 1] << 8 : 0);
+		*out++ = tbl[v >> 18];
+		*out++ = tbl[(v >> 12) & 63];
+		*out++ = i + 1 < length ? tbl[(v >> 6) & 63] : '=';
+		*out++ = '=';
+	}
+	*out = 0;
+}
+
+/* value of the header name in the request or NULL, the value is ended by \r */
+static const char *upgrade_header(const char *request, const char *name)
+{
+	size_t len = strlen(name);
+	const char *p = strstr(request, "\r\n");
+
+	while (p && p[2] != '\r') {
+		p += 2;
+		if (!strncasecmp(p, name, len) && p[len] == ':') {
+			p += len + 1;
+			while (*p == ' ' || *p == '\t')
+				p++;
+			return p;
+		}
+		p = strstr(p, "\r\n");
+	}
+	return NULL;
+}
+
+/* does the comma separated list ended by \r contains the token */
+static int upgrade_has(const char *list, const char *token)
+{
+	size_t len = strlen(token);
+
+	while (list && *list != '\r') {
+		while (*list == ' ' || *list == ',')
+			list++;
+		if (!strncasecmp(list, token, len)
+		 && (list[len] == ',' || list[len] == ' ' || list[len] == '\r'))
+			return 1;
+		list = strpbrk(list, ",\r");
+	}
+	return 0;
+}
+
+static void upgrade_end(struct upgrade *up, int ok)
+{
+	int fd = up->fd;
+
+	sd_event_source_unref(up->source);
+	if (up->deadline)
+		deadline_cancel(up->deadline);
+	if (!ok) {
+		close(fd);
+		fd = -1;
+	}
+	up->onupgrade(up->closure, fd);
+	free(up);
+}
+
+/* writes what remains of the response, waiting the socket be writable */
+static void upgrade_flush(struct upgrade *up)
+{
+	ssize_t n;
+
+	while (up->written < up->length) {
+		n = write(up->fd, up->buffer + up->written, up->length - up->written);
+		if (n > 0)
+			up->written += (size_t)n;
+		else if (n < 0 && errno == EAGAIN)
+			return;
+		else if (n == 0 || errno != EINTR) {
+			upgrade_end(up, 0);
+			return;
+		}
+	}
+	upgrade_end(up, up->ok);
+}
+
+/* sends the length bytes of the buffer then ends the upgrade with ok */
+static void upgrade_send(struct upgrade *up, size_t length, int ok)
+{
+	up->ok = ok;
+	up->sending = 1;
+	up->length = length;
+	up->written = 0;
+	if (sd_event_source_set_io_events(up->source, EPOLLOUT) < 0)
+		upgrade_end(up, 0);
+	else
+		upgrade_flush(up);
+}
+
+/* answers the request in the buffer, the response replacing it */
+static void upgrade_reply(struct upgrade *up)
+{
+	static const char bad[] = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n\r\n";
+	const char *key, *end;
+	char accept[64 + sizeof WS_GUID];
+	unsigned char digest[20];
+	size_t klen;
+	int n;
+
+	key = upgrade_header(up->buffer, "Sec-WebSocket-Key");
+	if (strncmp(up->buffer, "GET ", 4)
+	 || !upgrade_has(upgrade_header(up->buffer, "Upgrade"), "websocket")
+	 || !upgrade_has(upgrade_header(up->buffer, "Connection"), "upgrade")
+	 || !upgrade_has(upgrade_header(up->buffer, "Sec-WebSocket-Version"), "13")
+	 || !upgrade_has(upgrade_header(up->buffer, "Sec-WebSocket-Protocol"), up->protocol)
+	 || !key || !(end = strchr(key, '\r')) || (klen = (size_t)(end - key)) > 64) {
+		memcpy(up->buffer, bad, sizeof bad - 1);
+		upgrade_send(up, sizeof bad - 1, 0);
+		return;
+	}
+
+	/* the accept key is the base64 of the SHA-1 of the key and the GUID */
+	memcpy(accept, key, klen);
+	memcpy(accept + klen, WS_GUID, sizeof WS_GUID);
+	sha1(accept, klen + sizeof WS_GUID - 1, digest);
+	base64(digest, sizeof digest, accept);
+	n = snprintf(up->buffer, sizeof up->buffer,
+		"HTTP/1.1 101 Switching Protocols\r\n"
+		"Upgrade: websocket\r\n"
+		"Connection: Upgrade\r\n"
+		"Sec-WebSocket-Accept: %s\r\n"
+		"Sec-WebSocket-Protocol: %s\r\n"
+		"\r\n", accept, up->protocol);
+	if (n > 0 && (size_t)n < sizeof up->buffer)
+		upgrade_send(up, (size_t)n, 1);
+	else
+		upgrade_end(up, 0);
+}
+
+static int upgrade_cb(sd_event_source *s, int fd, uint32_t revents, void *userdata)
+{
+	struct upgrade *up = userdata;
+	ssize_t n;
+
+	if (up->sending) {
+		upgrade_flush(up);
+		return 0;
+	}
+	n = read(fd, up->buffer + up->length, UPGRADE_MAX - up->length);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+	if (n <= 0) {
+		upgrade_end(up, 0);
+		return 0;
+	}
+	up->length += (size_t)n;
+	up->buffer[up->length] = 0;
+	if (strstr(up->buffer, "\r\n\r\n"))
+		upgrade_reply(up);
+	else if (up->length == UPGRADE_MAX)
+		upgrade_end(up, 0);
+	return 0;
+}
+
+static void upgrade_expired(void *closure)
+{
+	struct upgrade *up = closure;
+
+	/* released by the wheel */
+	up->deadline = NULL;
+	upgrade_end(up, 0);
+}
+
+/* upgrades the connection fd to a websocket of the protocol, then calls
+ * onupgrade(closure, fd) with fd or with -1 on failure, fd being closed */
+int ws_upgrade(int fd, const char *protocol, void (*onupgrade)(void *closure, int fd), void *closure)
+{
+	struct upgrade *up;
+	int rc;
+
+	up = malloc(sizeof *up);
+	if (!up)
+		return -ENOMEM;
+	up->fd = fd;
+	up->sending = 0;
+	up->length = 0;
+	up->protocol = protocol;
+	up->onupgrade = onupgrade;
+	up->closure = closure;
+	rc = sd_event_add_io(sdev, &up->source, fd, EPOLLIN, upgrade_cb, up);
+	if (rc < 0) {
+		free(up);
+		return rc;
+	}
+	up->deadline = deadline_create(wheel_now() + UPGRADE_TIMEOUT, upgrade_expired, up);
+	return 0;
+}
+
+struct afb_wsj1 *server_wsj1(int fd, struct afb_wsj1_itf *itf, void *closure)
+{
+	return afb_wsj1_create(sdev, fd, itf, closure);
+}
+
+/**************************************************************/
+
+static void run_pending_jobs(JSContext *ctx)
+{
+	JSContext *ctx1;
+	int rc;
+
+	while ((rc = JS_ExecutePendingJob(JS_GetRuntime(ctx), &ctx1)) != 0)
+		if (rc < 0)
+			js_std_dump_error(ctx1);
+}
+
 static JSValue qjs_loop(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
 {
 	int sts;
@@ -80,9 +1121,125 @@ static JSValue qjs_loop(JSContext *ctx, JSValueConst this_val, int argc, JSValue
 		delay = 1000LL * adelay;
 
 	sts = sd_event_run(sdev,  (uint64_t)delay);
+	run_pending_jobs(ctx);
 	return JS_NewBool(ctx, sts > 0);
 }
 
+static JSValue qjs_dispatch(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+{
+	int count = 0;
+
+	/* bounded so that os timers and handlers are not starved */
+	while (count < DISPATCH_MAX && sd_event_run(sdev, 0) > 0) {
+		count++;
+		run_pending_jobs(ctx);
+	}
+	return JS_NewInt32(ctx, count);
+}
+
+static JSValue qjs_fd(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+{
+	return JS_NewInt32(ctx, sd_event_get_fd(sdev));
+}
+
+/* monotonic time in milliseconds with a microsecond resolution */
+static JSValue qjs_now(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return JS_NewFloat64(ctx, (double)ts.tv_sec * 1000.0 + (double)(ts.tv_nsec / 1000) / 1000.0);
+}
+
+static JSValue qjs_pool_stats(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+{
+	return pool_stats(ctx);
+}
+
+static JSValue qjs_json_kernel(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+{
+	return JS_NewString(ctx, json_parse_kernel());
+}
+
+/* parses as received JSON the text, a string or an ArrayBuffer of UTF-8 */
+static JSValue qjs_json_parse(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+{
+	const char *text;
+	size_t length;
+	JSValue value;
+
+	if (JS_IsObject(argv[0])) {
+		text = (const char*)JS_GetArrayBuffer(ctx, &length, argv[0]);
+		return text ? json_parse(ctx, text, length, "<json>") : JS_EXCEPTION;
+	}
+	text = JS_ToCStringLen(ctx, &length, argv[0]);
+	if (!text)
+		return JS_EXCEPTION;
+	value = json_parse(ctx, text, length, "<json>");
+	JS_FreeCString(ctx, text);
+	return value;
+}
+
+static JSValue qjs_payload_export(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+{
+	return payload_export(ctx, argv[0]);
+}
+
+static JSValue qjs_payload_import(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+{
+	return payload_import(ctx, argv[0]);
+}
+
+static JSValue qjs_watch(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv, int magic, JSValue *data)
+{
+	if (!JS_IsFunction(ctx, argv[0]))
+		return JS_ThrowTypeError(ctx, "function expected");
+	if (watch_ctx)
+		JS_FreeValue(ctx, watch_func);
+	watch_ctx = ctx;
+	watch_func = JS_DupValue(ctx, argv[0]);
+	watch_state = 0;
+	loop_watch_notify();
+	return JS_UNDEFINED;
+}
+
+static void release_loop();
+
+static void AFBWATCH_finalizer(JSRuntime *rt, JSValue val)
+{
+	if (watch_ctx)
+		JS_FreeValueRT(rt, watch_func);
+	watch_ctx = NULL;
+	/* the module dies with its runtime, that of a worker releases its loop */
+	release_loop();
+}
+
+static void AFBWATCH_mark(JSRuntime *rt, JSValueConst val, JS_MarkFunc *mark_func)
+{
+	if (watch_ctx)
+		JS_MarkValue(rt, watch_func, mark_func);
+}
+
+static JSClassDef afb_watch_class = {
+	"AFBWATCH",
+	.finalizer = AFBWATCH_finalizer,
+	.gc_mark = AFBWATCH_mark,
+};
+
+static JSValue mkwatch(JSContext *ctx)
+{
+	JSValue state, func;
+
+	class_id_init(&afb_watch_class_id);
+	JS_NewClass(JS_GetRuntime(ctx), afb_watch_class_id, &afb_watch_class);
+	state = JS_NewObjectClass(ctx, afb_watch_class_id);
+	if (JS_IsException(state))
+		return state;
+	func = JS_NewCFunctionData(ctx, qjs_watch, 1, 0, 1, &state);
+	JS_FreeValue(ctx, state);
+	return func;
+}
+
 static JSValue qjs_break(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
 {
 	uint64_t x = 1;
@@ -130,9 +1287,31 @@ static int init_loop()
 	return s;
 }
 
+static void release_loop()
+{
+	if (sdev) {
+		wheel_src = sd_event_source_unref(wheel_src);
+		wheel_next = 0;
+		idle_src = sd_event_source_unref(idle_src);
+		sd_event_source_unref(break_src);
+		close(break_fd);
+		sd_event_unref(sdev);
+		break_src = NULL;
+		sdev = NULL;
+	}
+}
+
 static const JSCFunctionListEntry afb_qjs_funcs[] = {
     JS_CFUNC_DEF("afb_loop", 0, qjs_loop ),
     JS_CFUNC_DEF("afb_break", 0, qjs_break ),
+    JS_CFUNC_DEF("afb_dispatch", 0, qjs_dispatch ),
+    JS_CFUNC_DEF("afb_fd", 0, qjs_fd ),
+    JS_CFUNC_DEF("afb_now", 0, qjs_now ),
+    JS_CFUNC_DEF("afb_pool_stats", 0, qjs_pool_stats ),
+    JS_CFUNC_DEF("afb_json_kernel", 0, qjs_json_kernel ),
+    JS_CFUNC_DEF("afb_json_parse", 1, qjs_json_parse ),
+    JS_CFUNC_DEF("afb_payload_export", 1, qjs_payload_export ),
+    JS_CFUNC_DEF("afb_payload_import", 1, qjs_payload_import ),
 };
 
 static int js_afb_init(JSContext *ctx, JSModuleDef *m)
@@ -143,14 +1322,21 @@ static int js_afb_init(JSContext *ctx, JSModuleDef *m)
 	if (rc < 0)
 		return rc;
 
+	AFBJSON_init(ctx, m);
+	AFBPAYLOAD_init(ctx, m);
 	AFBWSAPI_init(ctx, m);
 	AFBWSJ1_init(ctx, m);
+	JS_SetModuleExport(ctx, m, "afb_watch", mkwatch(ctx));
 	return JS_SetModuleExportList(ctx, m, afb_qjs_funcs, countof(afb_qjs_funcs));
 	return 0;
 }
 
+/* when linked in afb-jscli, the module is registered as builtin */
+#ifdef AFB_QJS_STATIC
+#define JS_INIT_MODULE js_init_module_afb
+#else
 #define JS_INIT_MODULE js_init_module
-//#define JS_INIT_MODULE js_init_module_afb
+#endif
 
 JSModuleDef *JS_INIT_MODULE(JSContext *ctx, const char *module_name)
 {
@@ -159,7 +1345,9 @@ JSModuleDef *JS_INIT_MODULE(JSContext *ctx, const char *module_name)
 	if (!m)
 		return NULL;
 	JS_AddModuleExportList(ctx, m, afb_qjs_funcs, countof(afb_qjs_funcs));
+	JS_AddModuleExport(ctx, m, "afb_watch");
 
+	AFBPAYLOAD_preinit(ctx, m);
 	AFBWSAPI_preinit(ctx, m);
 	AFBWSJ1_preinit(ctx, m);
 	return m;
@@ -0,0 +1,918 @@
+/*
+ * Copyright (C) 2019-2022 IoT.bzh Company
+ * Author: José Bollo <jose.bollo@iot.bzh>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <quickjs/quickjs.h>
+
+struct payload;
+extern struct payload *payload_get(JSValueConst val);
+extern const char *payload_data(struct payload *payload, size_t *length);
+extern JSValue json_parse(JSContext *ctx, const char *text, size_t length, const char *name);
+
+/* initial size of buffers */
+#define JSONBUF_INITIAL  256
+/* buffers bigger than that are freed after use */
+#define JSONBUF_KEEP     65536
+/* deepest nesting of serialized objects */
+#define JSON_MAX_DEPTH   1024
+
+/**************************************************************/
+
+/*
+ * growable buffer receiving serialized JSON
+ * when busy, because serializing calls JS code that serializes too,
+ * the next buffer of the chain is used
+ */
+struct jsonbuf
+{
+	char *data;
+	size_t length;
+	size_t size;
+	int busy;
+	struct jsonbuf *next;
+	/* objects currently serialized for detection of cycles */
+	void **stack;
+	unsigned depth;
+	unsigned stacksize;
+	/* Number, String and Boolean, got at the first object serialized */
+	int boxes;
+	JSValue box[3];
+};
+
+static __thread struct jsonbuf default_jsonbuf;
+
+static const char text_null[] = "null";
+static const char text_true[] = "true";
+static const char text_false[] = "false";
+
+static __thread JSAtom atom_toJSON = JS_ATOM_NULL;
+static __thread JSAtom atom_length = JS_ATOM_NULL;
+
+struct jsonbuf *jsonbuf_create()
+{
+	return calloc(1, sizeof(struct jsonbuf));
+}
+
+void jsonbuf_destroy(struct jsonbuf *buf)
+{
+	struct jsonbuf *next;
+
+	while (buf) {
+		next = buf->next;
+		free(buf->data);
+		free(buf->stack);
+		if (buf != &default_jsonbuf)
+			free(buf);
+		buf = next;
+	}
+}
+
+static int jb_reserve(JSContext *ctx, struct jsonbuf *buf, size_t count)
+{
+	size_t size;
+	char *data;
+
+	if (buf->length + count < buf->size)
+		return 0;
+	size = buf->size ? buf->size : JSONBUF_INITIAL;
+	while (size <= buf->length + count)
+		size <<= 1;
+	data = realloc(buf->data, size);
+	if (!data) {
+		JS_ThrowOutOfMemory(ctx);
+		return -1;
+	}
+	buf->data = data;
+	buf->size = size;
+	return 0;
+}
+
+static int jb_put(JSContext *ctx, struct jsonbuf *buf, const char *text, size_t length)
+{
+	if (jb_reserve(ctx, buf, length) < 0)
+		return -1;
+	memcpy(&buf->data[buf->length], text, length);
+	buf->length += length;
+	return 0;
+}
+
+static int jb_putc(JSContext *ctx, struct jsonbuf *buf, char c)
+{
+	if (jb_reserve(ctx, buf, 1) < 0)
+		return -1;
+	buf->data[buf->length++] = c;
+	return 0;
+}
+
+static int jb_put_int(JSContext *ctx, struct jsonbuf *buf, int64_t value)
+{
+	char tmp[24], *p = &tmp[sizeof tmp];
+	uint64_t u = value < 0 ? -(uint64_t)value : (uint64_t)value;
+
+	do { *--p = (char)('0' + u % 10); } while (u /= 10);
+	if (value < 0)
+		*--p = '-';
+	return jb_put(ctx, buf, p, (size_t)(&tmp[sizeof tmp] - p));
+}
+
+static int jb_put_string(JSContext *ctx, struct jsonbuf *buf, const char *text, size_t length)
+{
+	static const char hex[] = "0123456789abcdef";
+	size_t i, begin;
+	unsigned char c;
+	char esc[6];
+
+	if (jb_putc(ctx, buf, '"') < 0)
+		return -1;
+	for (begin = i = 0 ; i < length ; i++) {
+		c = (unsigned char)text[i];
+		if (c >= ' ' && c != '"' && c != '\\')
+			continue;
+		if (jb_put(ctx, buf, &text[begin], i - begin) < 0)
+			return -1;
+		begin = i + 1;
+		esc[0] = '\\';
+		switch (c) {
+		case '"': case '\\': esc[1] = (char)c; break;
+		case '\b': esc[1] = 'b'; break;
+		case '\f': esc[1] = 'f'; break;
+		case '\n': esc[1] = 'n'; break;
+		case '\r': esc[1] = 'r'; break;
+		case '\t': esc[1] = 't'; break;
+		default:
+			esc[1] = 'u';
+			esc[2] = esc[3] = '0';
+			esc[4] = hex[c >> 4];
+			esc[5] = hex[c & 15];
+			if (jb_put(ctx, buf, esc, 6) < 0)
+				return -1;
+			continue;
+		}
+		if (jb_put(ctx, buf, esc, 2) < 0)
+			return -1;
+	}
+	if (jb_put(ctx, buf, &text[begin], length - begin) < 0)
+		return -1;
+	return jb_putc(ctx, buf, '"');
+}
+
+/**************************************************************/
+
+static int put_value(JSContext *ctx, struct jsonbuf *buf, JSValueConst value, JSAtom key, int64_t index, int tojson);
+
+static int put_js_string(JSContext *ctx, struct jsonbuf *buf, JSValueConst value)
+{
+	size_t length;
+	int rc;
+	const char *str = JS_ToCStringLen(ctx, &length, value);
+
+	if (!str)
+		return -1;
+	rc = jb_put_string(ctx, buf, str, length);
+	JS_FreeCString(ctx, str);
+	return rc;
+}
+
+static int put_number(JSContext *ctx, struct jsonbuf *buf, JSValueConst value)
+{
+	double d = JS_VALUE_GET_FLOAT64(value);
+	size_t length;
+	const char *str;
+	int rc;
+
+	if (!isfinite(d))
+		return jb_put(ctx, buf, text_null, sizeof text_null - 1);
+	if (fabs(d) < 9007199254740992.0 && d == (double)(int64_t)d)
+		return jb_put_int(ctx, buf, (int64_t)d);
+	/* let QuickJS format other numbers as JS does */
+	str = JS_ToCStringLen(ctx, &length, value);
+	if (!str)
+		return -1;
+	rc = jb_put(ctx, buf, str, length);
+	JS_FreeCString(ctx, str);
+	return rc;
+}
+
+static int put_array(JSContext *ctx, struct jsonbuf *buf, JSValueConst value)
+{
+	JSValue item, len;
+	int64_t index, length;
+	int rc;
+
+	len = JS_GetProperty(ctx, value, atom_length);
+	rc = JS_ToInt64(ctx, &length, len);
+	JS_FreeValue(ctx, len);
+	if (rc < 0 || jb_putc(ctx, buf, '[') < 0)
+		return -1;
+	for (index = 0 ; index < length ; index++) {
+		if (index && jb_putc(ctx, buf, ',') < 0)
+			return -1;
+		item = JS_GetPropertyUint32(ctx, value, (uint32_t)index);
+		if (JS_IsException(item))
+			return -1;
+		rc = put_value(ctx, buf, item, JS_ATOM_NULL, index, 1);
+		JS_FreeValue(ctx, item);
+		if (rc < 0)
+			return -1;
+		if (rc == 0 && jb_put(ctx, buf, text_null, sizeof text_null - 1) < 0)
+			return -1;
+	}
+	return jb_putc(ctx, buf, ']');
+}
+
+static int put_props(JSContext *ctx, struct jsonbuf *buf, JSValueConst value)
+{
+	JSPropertyEnum *tab;
+	uint32_t idx, count;
+	size_t mark;
+	JSValue item;
+	const char *key;
+	int rc, first = 1;
+
+	if (JS_GetOwnPropertyNames(ctx, &tab, &count, value, JS_GPN_STRING_MASK | JS_GPN_ENUM_ONLY) < 0)
+		return -1;
+	rc = jb_putc(ctx, buf, '{');
+	for (idx = 0 ; rc >= 0 && idx < count ; idx++) {
+		item = JS_GetProperty(ctx, value, tab[idx].atom);
+		if (JS_IsException(item)) {
+			rc = -1;
+			break;
+		}
+		mark = buf->length;
+		key = JS_AtomToCString(ctx, tab[idx].atom);
+		rc = key ? 0 : -1;
+		if (rc >= 0 && !first)
+			rc = jb_putc(ctx, buf, ',');
+		if (rc >= 0)
+			rc = jb_put_string(ctx, buf, key, strlen(key));
+		if (rc >= 0)
+			rc = jb_putc(ctx, buf, ':');
+		if (key)
+			JS_FreeCString(ctx, key);
+		if (rc >= 0)
+			rc = put_value(ctx, buf, item, tab[idx].atom, -1, 1);
+		JS_FreeValue(ctx, item);
+		if (rc == 0)
+			/* skipped value, forget the key */
+			buf->length = mark;
+		else if (rc > 0)
+			first = 0;
+	}
+	for (idx = 0 ; idx < count ; idx++)
+		JS_FreeAtom(ctx, tab[idx].atom);
+	js_free(ctx, tab);
+	return rc < 0 ? rc : jb_putc(ctx, buf, '}');
+}
+
+/* gets in *prim the primitive of the Number, String or Boolean object
+ * value, returns 1 if it is one of them, 0 if not or -1 on exception */
+static int unbox(JSContext *ctx, struct jsonbuf *buf, JSValueConst value, JSValue *prim)
+{
+	static const char *const names[3] = { "Number", "String", "Boolean" };
+	JSValue global, proto, func;
+	double d;
+	int idx, rc;
+
+	if (!buf->boxes) {
+		global = JS_GetGlobalObject(ctx);
+		for (idx = 0 ; idx < 3 ; idx++)
+			buf->box[idx] = JS_GetPropertyStr(ctx, global, names[idx]);
+		JS_FreeValue(ctx, global);
+		buf->boxes = 1;
+	}
+	for (idx = 0, rc = 0 ; !rc && idx < 3 ; idx++)
+		if (JS_IsFunction(ctx, buf->box[idx]))
+			rc = JS_IsInstanceOf(ctx, value, buf->box[idx]);
+	if (rc <= 0)
+		return rc;
+	switch (idx) {
+	case 1:
+		if (JS_ToFloat64(ctx, &d, value) < 0)
+			return -1;
+		*prim = JS_NewFloat64(ctx, d);
+		break;
+	case 2:
+		*prim = JS_ToString(ctx, value);
+		break;
+	default:
+		proto = JS_GetPropertyStr(ctx, buf->box[2], "prototype");
+		func = JS_GetPropertyStr(ctx, proto, "valueOf");
+		*prim = JS_Call(ctx, func, value, 0, NULL);
+		JS_FreeValue(ctx, func);
+		JS_FreeValue(ctx, proto);
+		break;
+	}
+	return JS_IsException(*prim) ? -1 : 1;
+}
+
+static int put_object(JSContext *ctx, struct jsonbuf *buf, JSValueConst value)
+{
+	void *ptr = JS_VALUE_GET_PTR(value), **stack;
+	JSValue prim;
+	unsigned idx;
+	int rc;
+
+	/* detects cycles */
+	for (idx = 0 ; idx < buf->depth ; idx++)
+		if (buf->stack[idx] == ptr) {
+			JS_ThrowTypeError(ctx, "circular reference");
+			return -1;
+		}
+	if (buf->depth == buf->stacksize) {
+		stack = realloc(buf->stack, (buf->stacksize + 16) * sizeof *stack);
+		if (!stack) {
+			JS_ThrowOutOfMemory(ctx);
+			return -1;
+		}
+		buf->stack = stack;
+		buf->stacksize += 16;
+	}
+	if (buf->depth == JSON_MAX_DEPTH) {
+		JS_ThrowRangeError(ctx, "too deep nesting");
+		return -1;
+	}
+	buf->stack[buf->depth++] = ptr;
+	rc = JS_IsArray(ctx, value);
+	if (rc > 0)
+		rc = put_array(ctx, buf, value);
+	else if (rc == 0) {
+		rc = unbox(ctx, buf, value, &prim);
+		if (rc > 0) {
+			rc = put_value(ctx, buf, prim, JS_ATOM_NULL, -1, 0);
+			JS_FreeValue(ctx, prim);
+		}
+		else if (rc == 0)
+			rc = put_props(ctx, buf, value);
+	}
+	buf->depth--;
+	return rc;
+}
+
+static JSValue key_value(JSContext *ctx, JSAtom key, int64_t index)
+{
+	if (index >= 0)
+		return JS_ToString(ctx, JS_NewInt64(ctx, index));
+	if (key == JS_ATOM_NULL)
+		return JS_NewString(ctx, "");
+	return JS_AtomToString(ctx, key);
+}
+
+/*
+ * puts the value as JSON.stringify does, returns 1 when something
+ * was written, 0 when the value is skipped (undefined, function or symbol)
+ * or -1 on exception
+ */
+static int put_value(JSContext *ctx, struct jsonbuf *buf, JSValueConst value, JSAtom key, int64_t index, int tojson)
+{
+	struct payload *payload;
+	const char *data;
+	size_t length;
+	JSValue func, arg, repl;
+	int rc;
+
+	switch (JS_VALUE_GET_TAG(value)) {
+	case JS_TAG_INT:
+		rc = jb_put_int(ctx, buf, JS_VALUE_GET_INT(value));
+		break;
+	case JS_TAG_BOOL:
+		rc = JS_VALUE_GET_BOOL(value)
+			? jb_put(ctx, buf, text_true, sizeof text_true - 1)
+			: jb_put(ctx, buf, text_false, sizeof text_false - 1);
+		break;
+	case JS_TAG_NULL:
+		rc = jb_put(ctx, buf, text_null, sizeof text_null - 1);
+		break;
+	case JS_TAG_FLOAT64:
+		rc = put_number(ctx, buf, value);
+		break;
+	case JS_TAG_STRING:
+		rc = put_js_string(ctx, buf, value);
+		break;
+	case JS_TAG_OBJECT:
+		payload = payload_get(value);
+		if (payload) {
+			/* already serialized */
+			data = payload_data(payload, &length);
+			rc = jb_put(ctx, buf, data, length);
+			break;
+		}
+		if (JS_IsFunction(ctx, value))
+			return 0;
+		if (tojson) {
+			func = JS_GetProperty(ctx, value, atom_toJSON);
+			if (JS_IsException(func))
+				return -1;
+			if (JS_IsFunction(ctx, func)) {
+				arg = key_value(ctx, key, index);
+				repl = JS_Call(ctx, func, value, 1, &arg);
+				JS_FreeValue(ctx, arg);
+				JS_FreeValue(ctx, func);
+				if (JS_IsException(repl))
+					return -1;
+				rc = put_value(ctx, buf, repl, key, index, 0);
+				JS_FreeValue(ctx, repl);
+				return rc;
+			}
+			JS_FreeValue(ctx, func);
+		}
+		rc = put_object(ctx, buf, value);
+		break;
+	case JS_TAG_BIG_INT:
+	case JS_TAG_BIG_FLOAT:
+	case JS_TAG_BIG_DECIMAL:
+		JS_ThrowTypeError(ctx, "bigint are not serializable");
+		return -1;
+	default:
+		return 0;
+	}
+	return rc < 0 ? rc : 1;
+}
+
+/**************************************************************/
+
+/*
+ * Serializes the value to JSON in the buffer (or in a default one if NULL).
+ * Returns the zero terminated text or NULL on exception. The text must be
+ * given back using json_release. Undefined values are serialized as null.
+ * The text of a payload is valid while the payload is.
+ */
+const char *json_stringify(JSContext *ctx, JSValueConst value, struct jsonbuf *buf, size_t *length)
+{
+	struct payload *payload;
+	const char *data;
+	size_t dummy;
+	int rc, idx;
+
+	if (!length)
+		length = &dummy;
+
+	/* fast path for common primitives */
+	switch (JS_VALUE_GET_TAG(value)) {
+	case JS_TAG_BOOL:
+		if (JS_VALUE_GET_BOOL(value)) {
+			*length = sizeof text_true - 1;
+			return text_true;
+		}
+		*length = sizeof text_false - 1;
+		return text_false;
+	case JS_TAG_NULL:
+	case JS_TAG_UNDEFINED:
+		*length = sizeof text_null - 1;
+		return text_null;
+	case JS_TAG_OBJECT:
+		/* payloads ending the text are sent as is, without copy */
+		payload = payload_get(value);
+		if (payload) {
+			data = payload_data(payload, length);
+			if (!data[*length])
+				return data;
+		}
+		break;
+	default:
+		break;
+	}
+
+	/* get a free buffer */
+	if (!buf)
+		buf = &default_jsonbuf;
+	while (buf->busy) {
+		if (!buf->next) {
+			buf->next = jsonbuf_create();
+			if (!buf->next) {
+				JS_ThrowOutOfMemory(ctx);
+				return NULL;
+			}
+		}
+		buf = buf->next;
+	}
+
+	buf->busy = 1;
+	buf->length = 0;
+	buf->depth = 0;
+	buf->boxes = 0;
+	rc = put_value(ctx, buf, value, JS_ATOM_NULL, -1, 1);
+	if (buf->boxes)
+		for (idx = 0 ; idx < 3 ; idx++)
+			JS_FreeValue(ctx, buf->box[idx]);
+	if (rc == 0)
+		rc = jb_put(ctx, buf, text_null, sizeof text_null - 1);
+	if (rc >= 0)
+		rc = jb_putc(ctx, buf, 0);
+	if (rc < 0) {
+		buf->busy = 0;
+		return NULL;
+	}
+	*length = buf->length - 1;
+	return buf->data;
+}
+
+void json_release(struct jsonbuf *buf, const char *text)
+{
+	if (!buf)
+		buf = &default_jsonbuf;
+	for ( ; buf ; buf = buf->next)
+		if (buf->busy && buf->data == text) {
+			buf->busy = 0;
+			if (buf->size > JSONBUF_KEEP) {
+				free(buf->data);
+				buf->data = NULL;
+				buf->size = 0;
+			}
+			break;
+		}
+}
+
+/**************************************************************/
+
+/*
+ * Projections are lists of paths like "response.values[3]" whose values
+ * are extracted from JSON texts without building the rest: the text is
+ * scanned from the root, skipping the values that are not on the path.
+ * Keys are compared as written in the text, with escapes decoded.
+ */
+
+struct step
+{
+	int64_t index;          /* index in arrays or -1 for keys of objects */
+	size_t length;          /* length of the key */
+	const char *key;        /* the key, in the text of the path */
+};
+
+struct projpath
+{
+	JSAtom atom;            /* the path, key of its value in the result */
+	unsigned nsteps;
+	struct step *steps;
+	char *text;
+};
+
+struct projection
+{
+	unsigned count;
+	struct projpath paths[];
+};
+
+/* compiles the path of text, returns 0 or -1 if invalid */
+static int projpath_compile(struct projpath *path, const char *text)
+{
+	char *p;
+	unsigned n;
+
+	path->nsteps = 0;
+	path->text = strdup(text);
+	path->steps = malloc((strlen(text) + 1) * sizeof *path->steps);
+	if (!path->text || !path->steps)
+		return -1;
+	p = path->text;
+	while (*p) {
+		n = path->nsteps++;
+		if (*p == '[') {
+			path->steps[n].index = 0;
+			path->steps[n].key = 0;
+			path->steps[n].length = 0;
+			if (*++p < '0' || *p > '9')
+				return -1;
+			while (*p >= '0' && *p <= '9')
+				if ((path->steps[n].index = path->steps[n].index * 10 + *p++ - '0') > UINT32_MAX)
+					return -1;
+			if (*p++ != ']')
+				return -1;
+		}
+		else {
+			path->steps[n].index = -1;
+			path->steps[n].key = p;
+			while (*p && *p != '.' && *p != '[')
+				p++;
+			path->steps[n].length = (size_t)(p - path->steps[n].key);
+			if (!path->steps[n].length)
+				return -1;
+		}
+		if (*p == '.' && !*++p)
+			return -1;
+	}
+	return 0;
+}
+
+void projection_destroy(JSRuntime *rt, struct projection *proj)
+{
+	unsigned i;
+
+	if (proj) {
+		for (i = 0 ; i < proj->count ; i++) {
+			if (proj->paths[i].atom != JS_ATOM_NULL)
+				JS_FreeAtomRT(rt, proj->paths[i].atom);
+			free(proj->paths[i].steps);
+			free(proj->paths[i].text);
+		}
+		free(proj);
+	}
+}
+
+/* makes the projection of the array of paths list, NULL on exception */
+struct projection *projection_create(JSContext *ctx, JSValueConst list)
+{
+	struct projection *proj;
+	struct projpath *path;
+	const char *text;
+	JSValue item;
+	int64_t length;
+	unsigned i;
+	int rc;
+
+	if (!JS_IsArray(ctx, list)) {
+		JS_ThrowTypeError(ctx, "array of paths expected");
+		return NULL;
+	}
+	item = JS_GetProperty(ctx, list, atom_length);
+	rc = JS_ToInt64(ctx, &length, item);
+	JS_FreeValue(ctx, item);
+	if (rc)
+		return NULL;
+	if (length < 0 || length > 1024) {
+		JS_ThrowRangeError(ctx, "too many paths");
+		return NULL;
+	}
+	proj = calloc(1, sizeof *proj + (size_t)length * sizeof *proj->paths);
+	if (!proj) {
+		JS_ThrowOutOfMemory(ctx);
+		return NULL;
+	}
+	for (i = 0 ; i < (unsigned)length ; i++) {
+		path = &proj->paths[proj->count++];
+		path->atom = JS_ATOM_NULL;
+		item = JS_GetPropertyUint32(ctx, list, i);
+		text = JS_IsString(item) ? JS_ToCString(ctx, item) : NULL;
+		JS_FreeValue(ctx, item);
+		if (!text) {
+			JS_ThrowTypeError(ctx, "path string expected at index %u", i);
+			goto error;
+		}
+		path->atom = JS_NewAtom(ctx, text);
+		rc = projpath_compile(path, text);
+		JS_FreeCString(ctx, text);
+		if (rc < 0 || path->atom == JS_ATOM_NULL) {
+			JS_ThrowSyntaxError(ctx, "invalid path at index %u", i);
+			goto error;
+		}
+	}
+	return proj;
+
+error:
+	projection_destroy(JS_GetRuntime(ctx), proj);
+	return NULL;
+}
+
+static const char *scan_space(const char *p, const char *end)
+{
+	while (p < end && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t'))
+		p++;
+	return p;
+}
+
+/* end of the string whose quote is at p or NULL */
+static const char *scan_string(const char *p, const char *end)
+{
+	for (p++ ; p < end ; p++) {
+		if (*p == '"')
+			return p + 1;
+		if (*p == '\\')
+			p++;
+	}
+	return NULL;
+}
+
+/* end of the value at p or NULL, scalars end before their separator */
+static const char *scan_value(const char *p, const char *end)
+{
+	unsigned depth = 0;
+
+	while (p < end) {
+		switch (*p) {
+		case '"':
+			p = scan_string(p, end);
+			if (!p || !depth)
+				return p;
+			continue;
+		case '{':
+		case '[':
+			depth++;
+			break;
+		case '}':
+		case ']':
+			if (!depth)
+				return p;
+			if (!--depth)
+				return p + 1;
+			break;
+		case ',':
+			if (!depth)
+				return p;
+			break;
+		}
+		p++;
+	}
+	return depth ? NULL : p;
+}
+
+/* the 4 hexadecimal digits at p or -1 */
+static int scan_hex4(const char *p, const char *end)
+{
+	int i, c, r = 0;
+
+	if (end - p < 4)
+		return -1;
+	for (i = 0 ; i < 4 ; i++) {
+		c = p[i];
+		if (c >= '0' && c <= '9')
+			c -= '0';
+		else if ((c | 32) >= 'a' && (c | 32) <= 'f')
+			c = (c | 32) - 'a' + 10;
+		else
+			return -1;
+		r = (r << 4) | c;
+	}
+	return r;
+}
+
+/* decodes the \u escape whose digits are at *p in UTF-8 in buf, returns its length or 0,
+ * lone surrogates are encoded in 3 bytes as QuickJS does for strings */
+static int scan_unicode(const char **p, const char *end, char buf[4])
+{
+	int c, lo;
+
+	c = scan_hex4(*p, end);
+	if (c < 0)
+		return 0;
+	*p += 4;
+	if (c >= 0xD800 && c < 0xDC00 && end - *p >= 6 && (*p)[0] == '\\' && (*p)[1] == 'u') {
+		lo = scan_hex4(*p + 2, end);
+		if (lo >= 0xDC00 && lo < 0xE000) {
+			*p += 6;
+			c = 0x10000 + ((c - 0xD800) << 10) + (lo - 0xDC00);
+		}
+	}
+	if (c < 0x80) {
+		buf[0] = (char)c;
+		return 1;
+	}
+	if (c < 0x800) {
+		buf[0] = (char)(0xC0 | (c >> 6));
+		buf[1] = (char)(0x80 | (c & 0x3F));
+		return 2;
+	}
+	if (c < 0x10000) {
+		buf[0] = (char)(0xE0 | (c >> 12));
+		buf[1] = (char)(0x80 | ((c >> 6) & 0x3F));
+		buf[2] = (char)(0x80 | (c & 0x3F));
+		return 3;
+	}
+	buf[0] = (char)(0xF0 | (c >> 18));
+	buf[1] = (char)(0x80 | ((c >> 12) & 0x3F));
+	buf[2] = (char)(0x80 | ((c >> 6) & 0x3F));
+	buf[3] = (char)(0x80 | (c & 0x3F));
+	return 4;
+}
+
+/* compares the key of the text (without quotes) to the key of the step */
+static int scan_key_is(const char *p, const char *end, const struct step *step)
+{
+	const char *k = step->key, *kend = k + step->length;
+	char c, buf[4];
+	int n;
+
+	while (p < end && k < kend) {
+		c = *p++;
+		if (c == '\\' && p < end) {
+			switch (c = *p++) {
+			case 'b': c = '\b'; break;
+			case 'f': c = '\f'; break;
+			case 'n': c = '\n'; break;
+			case 'r': c = '\r'; break;
+			case 't': c = '\t'; break;
+			case 'u':
+				n = scan_unicode(&p, end, buf);
+				if (!n || kend - k < n || memcmp(k, buf, n))
+					return 0;
+				k += n;
+				continue;
+			default: break;
+			}
+		}
+		if (c != *k++)
+			return 0;
+	}
+	return p == end && k == kend;
+}
+
+/* start of the value of the path in the text or NULL, its end in vend */
+static const char *scan_path(const struct projpath *path, const char *p, const char *end, const char **vend)
+{
+	const struct step *step;
+	const char *key;
+	unsigned i;
+	int64_t idx;
+	int found;
+
+	for (i = 0 ; i < path->nsteps ; i++) {
+		step = &path->steps[i];
+		p = scan_space(p, end);
+		if (p == end || *p != (step->index < 0 ? '{' : '['))
+			return NULL;
+		p = scan_space(p + 1, end);
+		if (step->index < 0) {
+			/* search the key in the object */
+			for (;;) {
+				if (p == end || *p != '"')
+					return NULL;
+				key = p + 1;
+				p = scan_string(p, end);
+				if (!p)
+					return NULL;
+				found = scan_key_is(key, p - 1, step);
+				p = scan_space(p, end);
+				if (p == end || *p != ':')
+					return NULL;
+				p = scan_space(p + 1, end);
+				if (found)
+					break;
+				p = scan_value(p, end);
+				if (!p || (p = scan_space(p, end)) == end || *p != ',')
+					return NULL;
+				p = scan_space(p + 1, end);
+			}
+		}
+		else {
+			/* skip the items before the index */
+			for (idx = 0 ; idx < step->index ; idx++) {
+				p = scan_value(p, end);
+				if (!p || (p = scan_space(p, end)) == end || *p != ',')
+					return NULL;
+				p = scan_space(p + 1, end);
+			}
+			if (p == end || *p == ']')
+				return NULL;
+		}
+	}
+	p = scan_space(p, end);
+	*vend = scan_value(p, end);
+	return *vend && *vend != p ? p : NULL;
+}
+
+/*
+ * Extracts the values of the paths of the projection from the JSON text
+ * in an object whose keys are the paths, missing or invalid values being
+ * omitted. Only the extracted values are parsed.
+ */
+JSValue projection_apply(JSContext *ctx, struct projection *proj, const char *json, size_t length)
+{
+	const char *start, *vend;
+	JSValue obj, value;
+	unsigned i;
+
+	obj = JS_NewObject(ctx);
+	if (JS_IsException(obj))
+		return obj;
+	for (i = 0 ; i < proj->count ; i++) {
+		start = scan_path(&proj->paths[i], json, json + length, &vend);
+		if (!start)
+			continue;
+		value = json_parse(ctx, start, (size_t)(vend - start), "<projection>");
+		if (JS_IsException(value))
+			JS_FreeValue(ctx, JS_GetException(ctx));
+		else
+			JS_SetProperty(ctx, obj, proj->paths[i].atom, value);
+	}
+	return obj;
+}
+
+int AFBJSON_init(JSContext *ctx, JSModuleDef *m)
+{
+	if (atom_toJSON == JS_ATOM_NULL) {
+		atom_toJSON = JS_NewAtom(ctx, "toJSON");
+		atom_length = JS_NewAtom(ctx, "length");
+	}
+	return 0;
+}
@@ -0,0 +1,831 @@
+/*
+ * Copyright (C) 2019-2022 IoT.bzh Company
+ * Author: José Bollo <jose.bollo@iot.bzh>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <quickjs/quickjs.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define PARSE_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define PARSE_NEON 1
+#endif
+
+/*
+ * Parsing of received JSON texts in two stages, as simdjson does:
+ *  1. the text is read by blocks of 64 bytes classified with vector
+ *     instructions, giving the positions of the structural characters
+ *     and of the quotes that are not in strings;
+ *  2. the values are built from these positions, the contents of
+ *     strings being never read byte by byte except for escapes.
+ * The kernel of the first stage is chosen at run time for the CPU and
+ * can be forced by the environment variable AFB_JSON_KERNEL (scalar,
+ * sse4.2, avx2, neon or quickjs), the best supported being used for
+ * other names. Texts that are not handled (invalid, invalid UTF-8, too
+ * deep, lone surrogates) are given to JS_ParseJSON that reports the
+ * errors.
+ */
+
+/* max depth of nesting, deeper texts are parsed by QuickJS */
+#define PARSE_DEPTH 512
+/* buffers bigger than that are freed after use */
+#define PARSE_KEEP  65536
+
+/**************************************************************/
+
+/* classes of the 64 bytes of a block, a bit per byte */
+struct blockmasks
+{
+	uint64_t quote;
+	uint64_t backslash;
+	uint64_t structural;    /* { } [ ] : , */
+	uint64_t control;       /* bytes lower than 0x20 */
+	uint64_t high;          /* bytes of 0x80 or more */
+};
+
+/* state of the first stage */
+struct stage1
+{
+	uint64_t prev_escaped;  /* is the first byte of the next block escaped */
+	uint64_t prev_instring; /* all ones if the next block starts in a string */
+	uint64_t errors;        /* control characters in strings */
+	uint64_t backslashes;   /* any backslash */
+	uint64_t high;          /* any byte of 0x80 or more, to be checked as UTF-8 */
+	uint32_t *idx;
+	size_t n;
+};
+
+/* the quotes that are not escaped by an odd count of backslashes */
+static inline uint64_t stage1_quotes(struct stage1 *s, const struct blockmasks *m)
+{
+	const uint64_t even = 0x5555555555555555ULL;
+	uint64_t bs, follows, odd_starts, seq, escaped;
+
+	s->backslashes |= m->backslash;
+	s->high |= m->high;
+	bs = m->backslash & ~s->prev_escaped;
+	follows = (bs << 1) | s->prev_escaped;
+	odd_starts = bs & ~even & ~follows;
+	s->prev_escaped = __builtin_add_overflow(odd_starts, bs, &seq);
+	escaped = (even ^ (seq << 1)) & follows;
+	return m->quote & ~escaped;
+}
+
+/* records the positions, prefix has the bit i set when an odd count of
+ * quotes is at positions lower or equal to i */
+static inline void stage1_index(struct stage1 *s, const struct blockmasks *m, uint64_t quotes, uint64_t prefix, uint32_t base)
+{
+	uint64_t instring, bits;
+	uint32_t *idx = s->idx + s->n;
+
+	instring = prefix ^ s->prev_instring;
+	s->prev_instring = (uint64_t)((int64_t)instring >> 63);
+	s->errors |= m->control & instring;
+	bits = (m->structural & ~instring) | quotes;
+	s->n += (size_t)__builtin_popcountll(bits);
+	while (bits) {
+		*idx++ = base + (uint32_t)__builtin_ctzll(bits);
+		bits &= bits - 1;
+	}
+}
+
+static inline uint64_t prefix_xor_scalar(uint64_t x)
+{
+	x ^= x << 1;
+	x ^= x << 2;
+	x ^= x << 4;
+	x ^= x << 8;
+	x ^= x << 16;
+	x ^= x << 32;
+	return x;
+}
+
+/* loop of a kernel over the text, the last block is padded with spaces */
+#define STAGE1_KERNEL(name, target, classify, prefix_xor)			\
+target static void name(struct stage1 *s, const char *text, size_t length)	\
+{										\
+	struct blockmasks m;							\
+	uint8_t tail[64];							\
+	uint64_t q;								\
+	size_t i;								\
+										\
+	for (i = 0 ; i + 64 <= length ; i += 64) {				\
+		classify((const uint8_t*)text + i, &m);				\
+		q = stage1_quotes(s, &m);					\
+		stage1_index(s, &m, q, prefix_xor(q), (uint32_t)i);		\
+	}									\
+	if (i < length) {							\
+		memset(tail, ' ', sizeof tail);					\
+		memcpy(tail, text + i, length - i);				\
+		classify(tail, &m);						\
+		q = stage1_quotes(s, &m);					\
+		stage1_index(s, &m, q, prefix_xor(q), (uint32_t)i);		\
+	}									\
+}
+
+static void classify_scalar(const uint8_t *p, struct blockmasks *m)
+{
+	uint64_t bit;
+	uint8_t c;
+	int i;
+
+	m->quote = m->backslash = m->structural = m->control = m->high = 0;
+	for (i = 0 ; i < 64 ; i++) {
+		c = p[i];
+		bit = (uint64_t)1 << i;
+		if (c == '"')
+			m->quote |= bit;
+		else if (c == '\\')
+			m->backslash |= bit;
+		else if ((c | 0x20) == '{' || (c | 0x20) == '}' || c == ':' || c == ',')
+			m->structural |= bit;
+		else if (c < 0x20)
+			m->control |= bit;
+		else if (c >= 0x80)
+			m->high |= bit;
+	}
+}
+
+STAGE1_KERNEL(stage1_scalar, , classify_scalar, prefix_xor_scalar)
+
+#if PARSE_X86
+
+#define TARGET_SSE  __attribute__((target("sse4.2,pclmul")))
+#define TARGET_AVX2 __attribute__((target("avx2,pclmul")))
+
+TARGET_SSE static inline uint64_t prefix_xor_clmul(uint64_t x)
+{
+	__m128i r = _mm_clmulepi64_si128(_mm_set_epi64x(0, (int64_t)x), _mm_set1_epi8((char)0xFF), 0);
+	return (uint64_t)_mm_cvtsi128_si64(r);
+}
+
+TARGET_AVX2 static inline uint64_t prefix_xor_clmul_avx2(uint64_t x)
+{
+	__m128i r = _mm_clmulepi64_si128(_mm_set_epi64x(0, (int64_t)x), _mm_set1_epi8((char)0xFF), 0);
+	return (uint64_t)_mm_cvtsi128_si64(r);
+}
+
+/* 16 bytes of the block at offset i, the comparisons of ( | 0x20) catch both { [ and } ] */
+TARGET_SSE static inline void classify16_sse(__m128i x, int i, struct blockmasks *m)
+{
+	__m128i lower = _mm_or_si128(x, _mm_set1_epi8(0x20));
+	__m128i st = _mm_or_si128(
+		_mm_or_si128(_mm_cmpeq_epi8(lower, _mm_set1_epi8('{')), _mm_cmpeq_epi8(lower, _mm_set1_epi8('}'))),
+		_mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(':')), _mm_cmpeq_epi8(x, _mm_set1_epi8(','))));
+	__m128i ctl = _mm_cmpeq_epi8(_mm_min_epu8(x, _mm_set1_epi8(0x1f)), x);
+
+	m->quote |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_set1_epi8('"'))) << i;
+	m->backslash |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_set1_epi8('\\'))) << i;
+	m->structural |= (uint64_t)(uint16_t)_mm_movemask_epi8(st) << i;
+	m->control |= (uint64_t)(uint16_t)_mm_movemask_epi8(ctl) << i;
+	m->high |= (uint64_t)(uint16_t)_mm_movemask_epi8(x) << i;
+}
+
+TARGET_SSE static inline void classify_sse(const uint8_t *p, struct blockmasks *m)
+{
+	int i;
+
+	m->quote = m->backslash = m->structural = m->control = m->high = 0;
+	for (i = 0 ; i < 64 ; i += 16)
+		classify16_sse(_mm_loadu_si128((const __m128i*)(p + i)), i, m);
+}
+
+TARGET_AVX2 static inline uint64_t classify32_avx2(__m256i x, uint64_t *quote, uint64_t *backslash, uint64_t *control, uint64_t *high)
+{
+	__m256i lower = _mm256_or_si256(x, _mm256_set1_epi8(0x20));
+	__m256i st = _mm256_or_si256(
+		_mm256_or_si256(_mm256_cmpeq_epi8(lower, _mm256_set1_epi8('{')), _mm256_cmpeq_epi8(lower, _mm256_set1_epi8('}'))),
+		_mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8(':')), _mm256_cmpeq_epi8(x, _mm256_set1_epi8(','))));
+	__m256i ctl = _mm256_cmpeq_epi8(_mm256_min_epu8(x, _mm256_set1_epi8(0x1f)), x);
+
+	*quote = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('"')));
+	*backslash = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('\\')));
+	*control = (uint32_t)_mm256_movemask_epi8(ctl);
+	*high = (uint32_t)_mm256_movemask_epi8(x);
+	return (uint32_t)_mm256_movemask_epi8(st);
+}
+
+TARGET_AVX2 static inline void classify_avx2(const uint8_t *p, struct blockmasks *m)
+{
+	uint64_t q0, q1, b0, b1, c0, c1, h0, h1, s0, s1;
+
+	s0 = classify32_avx2(_mm256_loadu_si256((const __m256i*)p), &q0, &b0, &c0, &h0);
+	s1 = classify32_avx2(_mm256_loadu_si256((const __m256i*)(p + 32)), &q1, &b1, &c1, &h1);
+	m->quote = q0 | (q1 << 32);
+	m->backslash = b0 | (b1 << 32);
+	m->structural = s0 | (s1 << 32);
+	m->control = c0 | (c1 << 32);
+	m->high = h0 | (h1 << 32);
+}
+
+STAGE1_KERNEL(stage1_sse, TARGET_SSE, classify_sse, prefix_xor_clmul)
+STAGE1_KERNEL(stage1_avx2, TARGET_AVX2, classify_avx2, prefix_xor_clmul_avx2)
+
+#endif
+
+#if PARSE_NEON
+
+/* bit i of the result is set when the byte i of the 64 is all ones */
+static inline uint64_t neon_movemask(uint8x16_t a, uint8x16_t b, uint8x16_t c, uint8x16_t d)
+{
+	static const uint8_t bits[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+	const uint8x16_t mask = vld1q_u8(bits);
+	uint8x16_t s0, s1;
+
+	s0 = vpaddq_u8(vandq_u8(a, mask), vandq_u8(b, mask));
+	s1 = vpaddq_u8(vandq_u8(c, mask), vandq_u8(d, mask));
+	s0 = vpaddq_u8(s0, s1);
+	s0 = vpaddq_u8(s0, s0);
+	return vgetq_lane_u64(vreinterpretq_u64_u8(s0), 0);
+}
+
+static inline uint8x16_t neon_structural(uint8x16_t x)
+{
+	uint8x16_t lower = vorrq_u8(x, vdupq_n_u8(0x20));
+	return vorrq_u8(
+		vorrq_u8(vceqq_u8(lower, vdupq_n_u8('{')), vceqq_u8(lower, vdupq_n_u8('}'))),
+		vorrq_u8(vceqq_u8(x, vdupq_n_u8(':')), vceqq_u8(x, vdupq_n_u8(','))));
+}
+
+static void classify_neon(const uint8_t *p, struct blockmasks *m)
+{
+	uint8x16_t x0 = vld1q_u8(p), x1 = vld1q_u8(p + 16), x2 = vld1q_u8(p + 32), x3 = vld1q_u8(p + 48);
+	uint8x16_t q = vdupq_n_u8('"'), b = vdupq_n_u8('\\'), c = vdupq_n_u8(0x1f), h = vdupq_n_u8(0x80);
+
+	m->quote = neon_movemask(vceqq_u8(x0, q), vceqq_u8(x1, q), vceqq_u8(x2, q), vceqq_u8(x3, q));
+	m->backslash = neon_movemask(vceqq_u8(x0, b), vceqq_u8(x1, b), vceqq_u8(x2, b), vceqq_u8(x3, b));
+	m->control = neon_movemask(vcleq_u8(x0, c), vcleq_u8(x1, c), vcleq_u8(x2, c), vcleq_u8(x3, c));
+	m->high = neon_movemask(vcgeq_u8(x0, h), vcgeq_u8(x1, h), vcgeq_u8(x2, h), vcgeq_u8(x3, h));
+	m->structural = neon_movemask(neon_structural(x0), neon_structural(x1),
+					neon_structural(x2), neon_structural(x3));
+}
+
+STAGE1_KERNEL(stage1_neon, , classify_neon, prefix_xor_scalar)
+
+#endif
+
+/**************************************************************/
+
+/* the kernels, by order of preference */
+static const struct kernel
+{
+	const char *name;
+	void (*run)(struct stage1 *s, const char *text, size_t length);
+	int (*supported)();
+}
+*kernel;
+
+static int supported_always() { return 1; }
+
+#if PARSE_X86
+static int supported_sse() { return __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul"); }
+static int supported_avx2() { return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("pclmul"); }
+#endif
+
+static const struct kernel kernels[] =
+{
+#if PARSE_X86
+	{ "avx2", stage1_avx2, supported_avx2 },
+	{ "sse4.2", stage1_sse, supported_sse },
+#endif
+#if PARSE_NEON
+	{ "neon", stage1_neon, supported_always },
+#endif
+	{ "scalar", stage1_scalar, supported_always },
+	{ "quickjs", NULL, supported_always },
+};
+
+#define KERNELS_END (kernels + sizeof kernels / sizeof *kernels)
+
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+/* key whose destructor frees the buffers of exiting threads */
+static pthread_key_t parse_key;
+
+static void parse_release(void *value);
+
+/* the kernel named by AFB_JSON_KERNEL if supported, or the best one */
+static void kernel_select()
+{
+	const char *env = getenv("AFB_JSON_KERNEL");
+	const struct kernel *k = KERNELS_END;
+
+#if PARSE_X86
+	__builtin_cpu_init();
+#endif
+	if (env)
+		for (k = kernels ; k < KERNELS_END && (strcmp(env, k->name) || !k->supported()) ; k++);
+	if (k == KERNELS_END)
+		for (k = kernels ; !k->supported() ; k++);
+	kernel = k;
+	pthread_key_create(&parse_key, parse_release);
+}
+
+/* name of the kernel of the first stage */
+const char *json_parse_kernel()
+{
+	pthread_once(&kernel_once, kernel_select);
+	return kernel->name;
+}
+
+/**************************************************************/
+
+/* state of the second stage */
+struct parser
+{
+	JSContext *ctx;
+	const char *text;
+	const char *end;
+	const char *p;          /* current position */
+	const uint32_t *idx;    /* positions of the first stage */
+	size_t k;               /* next position */
+	size_t n;
+	unsigned depth;
+	int failed;             /* not handled, JS_ParseJSON will tell why */
+	int backslashes;        /* strings can have escapes */
+};
+
+/* buffers of the thread, busy while parsing */
+static __thread uint32_t *parse_idx;
+static __thread size_t parse_idx_size;
+static __thread char *parse_buf;
+static __thread size_t parse_buf_size;
+static __thread int parse_busy;
+
+static JSValue parse_value(struct parser *ps);
+
+/* frees the buffers of the thread, its runtime being gone */
+static void parse_release(void *value)
+{
+	free(parse_idx);
+	parse_idx = NULL;
+	parse_idx_size = 0;
+	free(parse_buf);
+	parse_buf = NULL;
+	parse_buf_size = 0;
+}
+
+static JSValue parse_fail(struct parser *ps)
+{
+	ps->failed = 1;
+	return JS_EXCEPTION;
+}
+
+static inline const char *skip_space(const char *p, const char *end)
+{
+	while (p < end && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t'))
+		p++;
+	return p;
+}
+
+/* takes the structural character c, it must be the next position */
+static inline int take(struct parser *ps, char c)
+{
+	const char *p = skip_space(ps->p, ps->end);
+
+	if (p == ps->end || *p != c || ps->k == ps->n || ps->text + ps->idx[ps->k] != p)
+		return 0;
+	ps->k++;
+	ps->p = p + 1;
+	return 1;
+}
+
+/* the string at the current position, its content is from *begin to the result */
+static const char *take_string(struct parser *ps, const char **begin)
+{
+	const char *p = skip_space(ps->p, ps->end), *q;
+
+	if (p == ps->end || *p != '"' || ps->k + 1 >= ps->n || ps->text + ps->idx[ps->k] != p)
+		return NULL;
+	q = ps->text + ps->idx[ps->k + 1];
+	if (*q != '"')
+		return NULL;
+	ps->k += 2;
+	ps->p = q + 1;
+	*begin = p + 1;
+	return q;
+}
+
+static int buf_reserve(size_t size)
+{
+	char *buf;
+
+	if (size > parse_buf_size) {
+		buf = realloc(parse_buf, size);
+		if (!buf)
+			return 0;
+		parse_buf = buf;
+		parse_buf_size = size;
+	}
+	return 1;
+}
+
+static int hex4(const char *p, uint32_t *value)
+{
+	uint32_t v = 0;
+	int i;
+	char c;
+
+	for (i = 0 ; i < 4 ; i++) {
+		c = p[i];
+		if (c >= '0' && c <= '9')
+			v = v * 16 + (uint32_t)(c - '0');
+		else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+			v = v * 16 + (uint32_t)((c | 0x20) - 'a' + 10);
+		else
+			return 0;
+	}
+	*value = v;
+	return 1;
+}
+
+/* decodes the escapes of the string from p to q in UTF-8, NULL if not handled */
+static const char *unescape(struct parser *ps, const char *p, const char *q, size_t *length)
+{
+	uint32_t u, low;
+	char *o;
+
+	/* an escape gives at most 3 bytes for 2 read, pairs 4 for 12 */
+	if (!ps->backslashes || !memchr(p, '\\', (size_t)(q - p))) {
+		*length = (size_t)(q - p);
+		return p;
+	}
+	if (!buf_reserve((size_t)(q - p) * 2)) {
+		JS_ThrowOutOfMemory(ps->ctx);
+		return NULL;
+	}
+	o = parse_buf;
+	while (p < q) {
+		if (*p != '\\') {
+			*o++ = *p++;
+			continue;
+		}
+		p++;
+		switch (*p++) {
+		case '"': *o++ = '"'; break;
+		case '\\': *o++ = '\\'; break;
+		case '/': *o++ = '/'; break;
+		case 'b': *o++ = '\b'; break;
+		case 'f': *o++ = '\f'; break;
+		case 'n': *o++ = '\n'; break;
+		case 'r': *o++ = '\r'; break;
+		case 't': *o++ = '\t'; break;
+		case 'u':
+			if (q - p < 4 || !hex4(p, &u))
+				goto fail;
+			p += 4;
+			if (u >= 0xDC00 && u < 0xE000)
+				goto fail;
+			if (u >= 0xD800 && u < 0xDC00) {
+				/* lone surrogates are not UTF-8, QuickJS makes them */
+				if (q - p < 6 || p[0] != '\\' || p[1] != 'u' || !hex4(p + 2, &low)
+				 || low < 0xDC00 || low >= 0xE000)
+					goto fail;
+				p += 6;
+				u = 0x10000 + ((u - 0xD800) << 10) + (low - 0xDC00);
+			}
+			if (u < 0x80)
+				*o++ = (char)u;
+			else if (u < 0x800) {
+				*o++ = (char)(0xC0 | (u >> 6));
+				*o++ = (char)(0x80 | (u & 0x3F));
+			}
+			else if (u < 0x10000) {
+				*o++ = (char)(0xE0 | (u >> 12));
+				*o++ = (char)(0x80 | ((u >> 6) & 0x3F));
+				*o++ = (char)(0x80 | (u & 0x3F));
+			}
+			else {
+				*o++ = (char)(0xF0 | (u >> 18));
+				*o++ = (char)(0x80 | ((u >> 12) & 0x3F));
+				*o++ = (char)(0x80 | ((u >> 6) & 0x3F));
+				*o++ = (char)(0x80 | (u & 0x3F));
+			}
+			break;
+		default:
+			goto fail;
+		}
+	}
+	*length = (size_t)(o - parse_buf);
+	return parse_buf;
+fail:
+	ps->failed = 1;
+	return NULL;
+}
+
+static JSValue parse_string(struct parser *ps)
+{
+	const char *begin, *end, *str;
+	size_t length;
+
+	end = take_string(ps, &begin);
+	if (!end)
+		return parse_fail(ps);
+	str = unescape(ps, begin, end, &length);
+	return str ? JS_NewStringLen(ps->ctx, str, length) : JS_EXCEPTION;
+}
+
+static inline int is_digit(const char *p, const char *end)
+{
+	return p < end && *p >= '0' && *p <= '9';
+}
+
+static JSValue parse_number(struct parser *ps)
+{
+	const char *p = ps->p, *start = p, *end = ps->end;
+	uint64_t v = 0;
+	int neg = 0, digits = 0, isint = 1;
+	char copy[64];
+
+	if (*p == '-') {
+		neg = 1;
+		p++;
+	}
+	if (!is_digit(p, end))
+		return parse_fail(ps);
+	if (*p == '0') {
+		p++;
+		digits = 1;
+	}
+	else
+		for ( ; is_digit(p, end) ; p++, digits++)
+			v = v * 10 + (uint64_t)(*p - '0');
+	if (p < end && *p == '.') {
+		isint = 0;
+		if (!is_digit(++p, end))
+			return parse_fail(ps);
+		while (is_digit(p, end))
+			p++;
+	}
+	if (p < end && (*p | 0x20) == 'e') {
+		isint = 0;
+		p++;
+		if (p < end && (*p == '+' || *p == '-'))
+			p++;
+		if (!is_digit(p, end))
+			return parse_fail(ps);
+		while (is_digit(p, end))
+			p++;
+	}
+	ps->p = p;
+
+	/* exact integers, -0 is not an integer */
+	if (isint && digits <= 15 && !(neg && !v))
+		return JS_NewInt64(ps->ctx, neg ? -(int64_t)v : (int64_t)v);
+	if ((size_t)(p - start) >= sizeof copy)
+		return parse_fail(ps);
+	memcpy(copy, start, (size_t)(p - start));
+	copy[p - start] = 0;
+	return JS_NewFloat64(ps->ctx, strtod(copy, NULL));
+}
+
+static JSValue parse_literal(struct parser *ps, const char *text, size_t length, JSValue value)
+{
+	if ((size_t)(ps->end - ps->p) < length || memcmp(ps->p, text, length))
+		return parse_fail(ps);
+	ps->p += length;
+	return value;
+}
+
+static JSValue parse_object(struct parser *ps)
+{
+	JSContext *ctx = ps->ctx;
+	const char *begin, *end, *key;
+	size_t length;
+	JSValue obj, value;
+	JSAtom atom;
+
+	ps->k++;
+	ps->p++;
+	obj = JS_NewObject(ctx);
+	if (JS_IsException(obj) || take(ps, '}'))
+		return obj;
+	do {
+		end = take_string(ps, &begin);
+		if (!end || !take(ps, ':'))
+			goto fail;
+		key = unescape(ps, begin, end, &length);
+		if (!key)
+			goto error;
+		atom = JS_NewAtomLen(ctx, key, length);
+		if (atom == JS_ATOM_NULL)
+			goto error;
+		value = parse_value(ps);
+		if (JS_IsException(value)) {
+			JS_FreeAtom(ctx, atom);
+			goto error;
+		}
+		if (JS_DefinePropertyValue(ctx, obj, atom, value, JS_PROP_C_W_E) < 0) {
+			JS_FreeAtom(ctx, atom);
+			goto error;
+		}
+		JS_FreeAtom(ctx, atom);
+	} while (take(ps, ','));
+	if (take(ps, '}'))
+		return obj;
+fail:
+	ps->failed = 1;
+error:
+	JS_FreeValue(ctx, obj);
+	return JS_EXCEPTION;
+}
+
+static JSValue parse_array(struct parser *ps)
+{
+	JSContext *ctx = ps->ctx;
+	JSValue arr, value;
+	uint32_t i = 0;
+
+	ps->k++;
+	ps->p++;
+	arr = JS_NewArray(ctx);
+	if (JS_IsException(arr) || take(ps, ']'))
+		return arr;
+	do {
+		value = parse_value(ps);
+		if (JS_IsException(value)
+		 || JS_DefinePropertyValueUint32(ctx, arr, i++, value, JS_PROP_C_W_E) < 0)
+			goto error;
+	} while (take(ps, ','));
+	if (take(ps, ']'))
+		return arr;
+	ps->failed = 1;
+error:
+	JS_FreeValue(ctx, arr);
+	return JS_EXCEPTION;
+}
+
+static JSValue parse_value(struct parser *ps)
+{
+	JSValue value;
+
+	ps->p = skip_space(ps->p, ps->end);
+	if (ps->p == ps->end)
+		return parse_fail(ps);
+	switch (*ps->p) {
+	case '{':
+	case '[':
+		if (ps->k == ps->n || ps->text + ps->idx[ps->k] != ps->p || ++ps->depth > PARSE_DEPTH)
+			return parse_fail(ps);
+		value = *ps->p == '{' ? parse_object(ps) : parse_array(ps);
+		ps->depth--;
+		return value;
+	case '"':
+		return parse_string(ps);
+	case 't':
+		return parse_literal(ps, "true", 4, JS_TRUE);
+	case 'f':
+		return parse_literal(ps, "false", 5, JS_FALSE);
+	case 'n':
+		return parse_literal(ps, "null", 4, JS_NULL);
+	default:
+		return parse_number(ps);
+	}
+}
+
+/* is the text valid UTF-8, surrogates and overlong forms excluded */
+static int utf8_valid(const char *text, size_t length)
+{
+	static const uint32_t least[4] = { 0, 0x80, 0x800, 0x10000 };
+	const uint8_t *p = (const uint8_t*)text, *end = p + length;
+	uint64_t word;
+	uint32_t c;
+	int i, n;
+
+	while (p < end) {
+		/* ASCII by words */
+		if (end - p >= 8) {
+			memcpy(&word, p, 8);
+			if (!(word & 0x8080808080808080ULL)) {
+				p += 8;
+				continue;
+			}
+		}
+		c = *p++;
+		if (c < 0x80)
+			continue;
+		n = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC0 ? 1 : 0;
+		if (!n || c > 0xF4 || end - p < n)
+			return 0;
+		c &= 0x3F >> n;
+		for (i = 0 ; i < n ; i++) {
+			if ((p[i] & 0xC0) != 0x80)
+				return 0;
+			c = (c << 6) | (p[i] & 0x3F);
+		}
+		p += n;
+		if (c < least[n] || c > 0x10FFFF || (c >= 0xD800 && c < 0xE000))
+			return 0;
+	}
+	return 1;
+}
+
+/* parses with QuickJS that wants a zero terminated text */
+static JSValue parse_quickjs(JSContext *ctx, const char *text, size_t length, const char *name)
+{
+	char *copy;
+	JSValue value;
+
+	copy = malloc(length + 1);
+	if (!copy)
+		return JS_ThrowOutOfMemory(ctx);
+	memcpy(copy, text, length);
+	copy[length] = 0;
+	value = JS_ParseJSON(ctx, copy, length, name);
+	free(copy);
+	return value;
+}
+
+/*
+ * Parses the JSON text of length, that needs not to be zero terminated,
+ * as JS_ParseJSON does. The name is used for reporting errors.
+ */
+JSValue json_parse(JSContext *ctx, const char *text, size_t length, const char *name)
+{
+	struct stage1 s;
+	struct parser ps;
+	uint32_t *idx;
+	JSValue value;
+
+	pthread_once(&kernel_once, kernel_select);
+	if (!kernel->run || parse_busy || length > UINT32_MAX)
+		return parse_quickjs(ctx, text, length, name);
+
+	/* at most one position per byte */
+	if (length + 1 > parse_idx_size) {
+		idx = realloc(parse_idx, (length + 1) * sizeof *idx);
+		if (!idx)
+			return JS_ThrowOutOfMemory(ctx);
+		parse_idx = idx;
+		parse_idx_size = length + 1;
+		/* the destructor is only called for threads having a value */
+		if (!pthread_getspecific(parse_key))
+			pthread_setspecific(parse_key, &parse_busy);
+	}
+	s.prev_escaped = 0;
+	s.prev_instring = 0;
+	s.errors = 0;
+	s.backslashes = 0;
+	s.high = 0;
+	s.idx = parse_idx;
+	s.n = 0;
+	kernel->run(&s, text, length);
+
+	/* QuickJS rejects invalid UTF-8 that JS_NewStringLen would replace */
+	ps.failed = s.errors || s.prev_instring || (s.high && !utf8_valid(text, length));
+	if (!ps.failed) {
+		parse_busy = 1;
+		ps.ctx = ctx;
+		ps.text = text;
+		ps.end = text + length;
+		ps.p = text;
+		ps.idx = parse_idx;
+		ps.k = 0;
+		ps.n = s.n;
+		ps.depth = 0;
+		ps.backslashes = s.backslashes != 0;
+		value = parse_value(&ps);
+		if (!JS_IsException(value) && (skip_space(ps.p, ps.end) != ps.end || ps.k != ps.n)) {
+			JS_FreeValue(ctx, value);
+			value = JS_EXCEPTION;
+			ps.failed = 1;
+		}
+		parse_busy = 0;
+	}
+	if (parse_idx_size > PARSE_KEEP) {
+		free(parse_idx);
+		parse_idx = NULL;
+		parse_idx_size = 0;
+	}
+	if (parse_buf_size > PARSE_KEEP) {
+		free(parse_buf);
+		parse_buf = NULL;
+		parse_buf_size = 0;
+	}
+	return ps.failed ? parse_quickjs(ctx, text, length, name) : value;
+}
@@ -0,0 +1,396 @@
+/*
+ * Copyright (C) 2019-2022 IoT.bzh Company
+ * Author: José Bollo <jose.bollo@iot.bzh>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <quickjs/quickjs.h>
+
+extern void class_id_init(JSClassID *class_id);
+struct jsonbuf;
+extern const char *json_stringify(JSContext *ctx, JSValueConst value, struct jsonbuf *buf, size_t *length);
+extern void json_release(struct jsonbuf *buf, const char *text);
+extern JSValue json_parse(JSContext *ctx, const char *text, size_t length, const char *name);
+
+#define countof(x) (sizeof(x) / sizeof(*(x)))
+
+static JSClassID afb_payload_class_id;
+
+/**************************************************************/
+
+/* a JSON text kept as is, the release function frees its storage,
+ * the byte after the data must be readable (it is 0 for whole texts) */
+struct payload
+{
+	int refcount;
+	size_t length;
+	const char *data;
+	void (*release)(void *closure);
+	void *closure;
+};
+
+struct payload *payload_create(const char *data, size_t length, void (*release)(void*), void *closure)
+{
+	struct payload *payload = malloc(sizeof *payload);
+	if (payload) {
+		payload->refcount = 1;
+		payload->length = length;
+		payload->data = data;
+		payload->release = release;
+		payload->closure = closure;
+	}
+	else if (release)
+		release(closure);
+	return payload;
+}
+
+struct payload *payload_addref(struct payload *payload)
+{
+	__atomic_add_fetch(&payload->refcount, 1, __ATOMIC_RELAXED);
+	return payload;
+}
+
+void payload_unref(struct payload *payload)
+{
+	if (!__atomic_sub_fetch(&payload->refcount, 1, __ATOMIC_ACQ_REL)) {
+		if (payload->release)
+			payload->release(payload->closure);
+		free(payload);
+	}
+}
+
+const char *payload_data(struct payload *payload, size_t *length)
+{
+	if (length)
+		*length = payload->length;
+	return payload->data;
+}
+
+/**************************************************************/
+
+/*
+ * Payloads are passed between threads (workers) by exporting them as
+ * an id that is imported once by the receiver. The data of a payload
+ * still attached to a message of its connection is copied first
+ * because the message must be released by the thread of its loop.
+ * Exports not imported within EXPORT_LIFETIME seconds, for example
+ * because the receiver died, are released by the next export or import.
+ */
+
+#define EXPORT_LIFETIME 60
+
+struct export
+{
+	struct export *next;
+	uint32_t id;
+	time_t expire;          /* seconds of CLOCK_MONOTONIC */
+	struct payload *payload;
+};
+
+static pthread_mutex_t export_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct export *exports;  /* the latest first */
+static uint32_t export_id;
+
+static time_t export_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/* unlink the expired exports, the lock being held, returns them */
+static struct export *export_expired(time_t now)
+{
+	struct export *ex, **prv;
+
+	for (prv = &exports ; (ex = *prv) && ex->expire > now ; prv = &ex->next);
+	*prv = NULL;
+	return ex;
+}
+
+/* release the unlinked exports */
+static void export_release(struct export *ex)
+{
+	struct export *next;
+
+	for ( ; ex ; ex = next) {
+		next = ex->next;
+		payload_unref(ex->payload);
+		free(ex);
+	}
+}
+
+/* get a payload whose data can be released by any thread, takes the reference */
+static struct payload *payload_detach(struct payload *payload)
+{
+	char *data;
+
+	if (payload->release == NULL || payload->release == free)
+		return payload;
+	data = malloc(payload->length + 1);
+	if (data) {
+		memcpy(data, payload->data, payload->length);
+		data[payload->length] = 0;
+	}
+	payload_unref(payload);
+	return data ? payload_create(data, payload->length, free, data) : NULL;
+}
+
+/**************************************************************/
+
+/* the JS side of a payload, value is the parsed data once required */
+struct jspayload
+{
+	struct payload *payload;
+	JSValue value;
+};
+
+/* makes the JS object for the payload whose reference is taken */
+JSValue payload_make(JSContext *ctx, struct payload *payload)
+{
+	struct jspayload *jp;
+	JSValue obj;
+
+	if (!payload)
+		return JS_ThrowOutOfMemory(ctx);
+
+	obj = JS_NewObjectClass(ctx, afb_payload_class_id);
+	if (JS_IsException(obj)) {
+		payload_unref(payload);
+		return obj;
+	}
+	jp = malloc(sizeof *jp);
+	if (!jp) {
+		JS_FreeValue(ctx, obj);
+		payload_unref(payload);
+		return JS_ThrowOutOfMemory(ctx);
+	}
+	jp->payload = payload;
+	jp->value = JS_UNINITIALIZED;
+	JS_SetOpaque(obj, jp);
+	return obj;
+}
+
+/* get the payload of the object or NULL if not a payload */
+struct payload *payload_get(JSValueConst val)
+{
+	struct jspayload *jp = JS_GetOpaque(val, afb_payload_class_id);
+	return jp ? jp->payload : 0;
+}
+
+/* export the payload for another thread, returns its id */
+JSValue payload_export(JSContext *ctx, JSValueConst value)
+{
+	struct jspayload *jp = JS_GetOpaque2(ctx, value, afb_payload_class_id);
+	struct payload *payload;
+	struct export *ex, *expired;
+	time_t now;
+	uint32_t id;
+
+	if (!jp)
+		return JS_EXCEPTION;
+	payload = payload_detach(payload_addref(jp->payload));
+	if (!payload)
+		return JS_ThrowOutOfMemory(ctx);
+	if (payload != jp->payload) {
+		/* keep the detached copy for the next exports */
+		payload_unref(jp->payload);
+		jp->payload = payload_addref(payload);
+	}
+	ex = malloc(sizeof *ex);
+	if (!ex) {
+		payload_unref(payload);
+		return JS_ThrowOutOfMemory(ctx);
+	}
+	ex->payload = payload;
+	pthread_mutex_lock(&export_lock);
+	/* taken in the lock to keep the list sorted */
+	now = export_now();
+	ex->expire = now + EXPORT_LIFETIME;
+	expired = export_expired(now);
+	if (!++export_id)
+		++export_id;
+	ex->id = id = export_id;
+	ex->next = exports;
+	exports = ex;
+	pthread_mutex_unlock(&export_lock);
+	export_release(expired);
+	return JS_NewUint32(ctx, id);
+}
+
+/* import the payload of the exported id, it can be imported only once */
+JSValue payload_import(JSContext *ctx, JSValueConst value)
+{
+	struct export *ex, **prv, *expired;
+	struct payload *payload = NULL;
+	uint32_t id;
+	time_t now;
+
+	if (JS_ToUint32(ctx, &id, value) < 0)
+		return JS_EXCEPTION;
+	now = export_now();
+	pthread_mutex_lock(&export_lock);
+	expired = export_expired(now);
+	for (prv = &exports ; (ex = *prv) && ex->id != id ; prv = &ex->next);
+	if (ex) {
+		*prv = ex->next;
+		payload = ex->payload;
+	}
+	pthread_mutex_unlock(&export_lock);
+	export_release(expired);
+	if (!ex)
+		return JS_ThrowRangeError(ctx, "no exported payload %u", (unsigned)id);
+	free(ex);
+	return payload_make(ctx, payload);
+}
+
+static JSValue payload_value(JSContext *ctx, JSValueConst this_val)
+{
+	struct jspayload *jp = JS_GetOpaque2(ctx, this_val, afb_payload_class_id);
+	JSValue value;
+
+	if (!jp)
+		return JS_EXCEPTION;
+	if (JS_VALUE_GET_TAG(jp->value) == JS_TAG_UNINITIALIZED) {
+		value = json_parse(ctx, jp->payload->data, jp->payload->length, "<payload>");
+		if (JS_IsException(value))
+			return value;
+		jp->value = value;
+	}
+	return JS_DupValue(ctx, jp->value);
+}
+
+static JSValue payload_raw(JSContext *ctx, JSValueConst this_val)
+{
+	struct jspayload *jp = JS_GetOpaque2(ctx, this_val, afb_payload_class_id);
+	return jp ? JS_NewStringLen(ctx, jp->payload->data, jp->payload->length) : JS_EXCEPTION;
+}
+
+static JSValue payload_length(JSContext *ctx, JSValueConst this_val)
+{
+	struct jspayload *jp = JS_GetOpaque2(ctx, this_val, afb_payload_class_id);
+	return jp ? JS_NewInt64(ctx, (int64_t)jp->payload->length) : JS_EXCEPTION;
+}
+
+static JSValue payload_get_field(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+{
+	JSValue value, ret;
+	JSAtom atom;
+
+	value = payload_value(ctx, this_val);
+	if (JS_IsException(value))
+		return value;
+	atom = JS_ValueToAtom(ctx, argv[0]);
+	if (atom == JS_ATOM_NULL)
+		ret = JS_EXCEPTION;
+	else {
+		ret = JS_GetProperty(ctx, value, atom);
+		JS_FreeAtom(ctx, atom);
+	}
+	JS_FreeValue(ctx, value);
+	return ret;
+}
+
+static JSValue payload_to_json(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+{
+	return payload_value(ctx, this_val);
+}
+
+/* makes a payload of argv[0] serialized once, sent as is afterward */
+static JSValue AFBPAYLOAD_constructor(JSContext *ctx, JSValueConst new_target, int argc, JSValueConst *argv)
+{
+	const char *text;
+	char *data;
+	size_t length;
+
+	if (payload_get(argv[0]))
+		return JS_DupValue(ctx, argv[0]);
+	text = json_stringify(ctx, argv[0], NULL, &length);
+	if (!text)
+		return JS_EXCEPTION;
+	data = malloc(length + 1);
+	if (data)
+		memcpy(data, text, length + 1);
+	json_release(NULL, text);
+	if (!data)
+		return JS_ThrowOutOfMemory(ctx);
+	return payload_make(ctx, payload_create(data, length, free, data));
+}
+
+static void AFBPAYLOAD_finalizer(JSRuntime *rt, JSValue val)
+{
+	struct jspayload *jp = JS_GetOpaque(val, afb_payload_class_id);
+	if (jp) {
+		JS_FreeValueRT(rt, jp->value);
+		payload_unref(jp->payload);
+		free(jp);
+	}
+}
+
+static void AFBPAYLOAD_mark(JSRuntime *rt, JSValueConst val, JS_MarkFunc *mark_func)
+{
+	struct jspayload *jp = JS_GetOpaque(val, afb_payload_class_id);
+	if (jp)
+		JS_MarkValue(rt, jp->value, mark_func);
+}
+
+static JSClassDef afb_payload_class = {
+	.class_name = "AFBPAYLOAD",
+	.finalizer = AFBPAYLOAD_finalizer,
+	.gc_mark = AFBPAYLOAD_mark,
+};
+
+static const JSCFunctionListEntry afb_payload_proto_funcs[] = {
+	JS_CGETSET_DEF("value", payload_value, NULL),
+	JS_CGETSET_DEF("raw", payload_raw, NULL),
+	JS_CGETSET_DEF("length", payload_length, NULL),
+	JS_CFUNC_DEF("get", 1, payload_get_field),
+	JS_CFUNC_DEF("toJSON", 0, payload_to_json),
+};
+
+int AFBPAYLOAD_init(JSContext *ctx, JSModuleDef *m)
+{
+	JSValue proto, ctor;
+
+	/* create the class */
+	class_id_init(&afb_payload_class_id);
+	JS_NewClass(JS_GetRuntime(ctx), afb_payload_class_id, &afb_payload_class);
+
+	proto = JS_NewObject(ctx);
+	JS_SetPropertyFunctionList(ctx, proto, afb_payload_proto_funcs, countof(afb_payload_proto_funcs));
+	ctor = JS_NewCFunction2(ctx, AFBPAYLOAD_constructor, "Payload", 1, JS_CFUNC_constructor_or_func, 0);
+	JS_SetConstructor(ctx, ctor, proto);
+	JS_SetClassProto(ctx, afb_payload_class_id, proto);
+	JS_SetModuleExport(ctx, m, "Payload", ctor);
+	return 0;
+}
+
+int AFBPAYLOAD_preinit(JSContext *ctx, JSModuleDef *m)
+{
+	JS_AddModuleExport(ctx, m, "Payload");
+	return 0;
+}
@@ -0,0 +1,212 @@
+/*
+ * Copyright (C) 2019-2022 IoT.bzh Company
+ * Author: José Bollo <jose.bollo@iot.bzh>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <quickjs/quickjs.h>
+
+/*
+ * Pool of the fixed size structures allocated per call or per connection.
+ * The sizes are rounded up to a power of 2 and each size class has its own
+ * free list fed by arenas released when the thread exits. Bigger sizes go
+ * to malloc. The pool is per thread, structures are released by the thread
+ * of their runtime.
+ */
+
+/* smallest size class is 1 << POOL_MINSHIFT */
+#define POOL_MINSHIFT 5
+/* count of size classes: 32, 64, 128, 256, 512, 1024, 2048 */
+#define POOL_CLASSES  7
+/* size of arenas */
+#define POOL_ARENA    65536
+
+struct arena
+{
+	struct arena *next;
+};
+
+struct slot
+{
+	struct slot *next;
+};
+
+struct sizeclass
+{
+	struct slot *free;      /* the free list */
+	struct arena *arenas;   /* the arenas */
+	unsigned narenas;       /* count of arenas */
+	unsigned count;         /* count of slots */
+	unsigned used;          /* count of slots in use */
+	unsigned highwater;     /* highest count of slots in use */
+};
+
+static __thread struct sizeclass classes[POOL_CLASSES];
+
+/* count of allocations too big for the classes */
+static __thread unsigned large_used, large_highwater;
+
+/* key whose destructor releases the arenas of exiting threads */
+static pthread_key_t pool_key;
+static pthread_once_t pool_key_once = PTHREAD_ONCE_INIT;
+
+/**************************************************************/
+
+static int pool_class(size_t size)
+{
+	int idx = 0;
+
+	size = (size - 1) >> POOL_MINSHIFT;
+	while (size) {
+		size >>= 1;
+		idx++;
+	}
+	return idx;
+}
+
+/* releases the arenas of the thread, its runtime being gone */
+static void pool_release(void *value)
+{
+	struct sizeclass *sc;
+	struct arena *arena;
+
+	for (sc = classes ; sc < &classes[POOL_CLASSES] ; sc++) {
+		while ((arena = sc->arenas)) {
+			sc->arenas = arena->next;
+			free(arena);
+		}
+		sc->free = 0;
+		sc->narenas = sc->count = sc->used = 0;
+	}
+}
+
+static void pool_key_create()
+{
+	pthread_key_create(&pool_key, pool_release);
+}
+
+static int pool_grow(struct sizeclass *sc, size_t size)
+{
+	struct arena *arena;
+	struct slot *slot;
+	char *iter, *end;
+
+	/* the destructor is only called for threads having a value */
+	pthread_once(&pool_key_once, pool_key_create);
+	if (!pthread_getspecific(pool_key))
+		pthread_setspecific(pool_key, classes);
+	arena = malloc(POOL_ARENA);
+	if (!arena)
+		return 0;
+	arena->next = sc->arenas;
+	sc->arenas = arena;
+	sc->narenas++;
+
+	/* first slot is after the header, aligned on the size of slots */
+	iter = (char*)arena + size;
+	end = (char*)arena + POOL_ARENA;
+	for (; iter + size <= end ; iter += size) {
+		slot = (struct slot*)iter;
+		slot->next = sc->free;
+		sc->free = slot;
+		sc->count++;
+	}
+	return 1;
+}
+
+void *pool_alloc(size_t size)
+{
+	int idx = pool_class(size);
+	struct sizeclass *sc;
+	struct slot *slot;
+
+	if (idx >= POOL_CLASSES) {
+		slot = malloc(size);
+		if (slot && ++large_used > large_highwater)
+			large_highwater = large_used;
+		return slot;
+	}
+
+	sc = &classes[idx];
+	if (!sc->free && !pool_grow(sc, (size_t)1 << (idx + POOL_MINSHIFT)))
+		return 0;
+	slot = sc->free;
+	sc->free = slot->next;
+	if (++sc->used > sc->highwater)
+		sc->highwater = sc->used;
+	return slot;
+}
+
+void pool_free(void *ptr, size_t size)
+{
+	int idx = pool_class(size);
+	struct sizeclass *sc;
+	struct slot *slot = ptr;
+
+	if (!ptr)
+		return;
+	if (idx >= POOL_CLASSES) {
+		large_used--;
+		free(ptr);
+		return;
+	}
+	sc = &classes[idx];
+	slot->next = sc->free;
+	sc->free = slot;
+	sc->used--;
+}
+
+/**************************************************************/
+
+static JSValue mkstat(JSContext *ctx, size_t size, unsigned used, unsigned highwater, unsigned count, unsigned narenas)
+{
+	JSValue obj = JS_NewObject(ctx);
+	if (!JS_IsException(obj)) {
+		JS_SetPropertyStr(ctx, obj, "size", JS_NewInt64(ctx, (int64_t)size));
+		JS_SetPropertyStr(ctx, obj, "used", JS_NewUint32(ctx, used));
+		JS_SetPropertyStr(ctx, obj, "highwater", JS_NewUint32(ctx, highwater));
+		JS_SetPropertyStr(ctx, obj, "count", JS_NewUint32(ctx, count));
+		JS_SetPropertyStr(ctx, obj, "arenas", JS_NewUint32(ctx, narenas));
+	}
+	return obj;
+}
+
+/* returns an array of the counters of the size classes, the last is for big sizes */
+JSValue pool_stats(JSContext *ctx)
+{
+	int idx;
+	struct sizeclass *sc;
+	JSValue arr = JS_NewArray(ctx);
+
+	if (JS_IsException(arr))
+		return arr;
+	for (idx = 0 ; idx < POOL_CLASSES ; idx++) {
+		sc = &classes[idx];
+		JS_SetPropertyUint32(ctx, arr, idx,
+			mkstat(ctx, (size_t)1 << (idx + POOL_MINSHIFT), sc->used, sc->highwater, sc->count, sc->narenas));
+	}
+	JS_SetPropertyUint32(ctx, arr, idx,
+		mkstat(ctx, 0, large_used, large_highwater, large_used, 0));
+	return arr;
+}
@@ -0,0 +1,309 @@
+/*
+ * Copyright (C) 2019-2022 IoT.bzh Company
+ * Author: José Bollo <jose.bollo@iot.bzh>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <quickjs/quickjs.h>
+
+/*
+ * Statistics of the calls of a connection: counters and, by verb, an
+ * histogram of the latencies in microseconds. Histograms are log-linear
+ * as HDR ones: each power of 2 is split in HIST_SUB linear buckets, so
+ * values are recorded with a relative error below 1 / HIST_SUB.
+ */
+
+#define HIST_SUB_BITS 5
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+/* latencies are recorded up to 2^HIST_MAX_BITS microseconds (12 days) */
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS  ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+/* count of buckets of verbs */
+#define VERB_BUCKETS  16
+
+struct verbstats
+{
+	struct verbstats *next;
+	unsigned hash;
+	uint64_t count;
+	uint64_t errors;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint32_t histogram[HIST_BUCKETS];
+	char name[];
+};
+
+struct stats
+{
+	uint64_t calls;
+	uint64_t replies;
+	uint64_t errors;
+	uint64_t bytes_sent;
+	uint64_t bytes_received;
+	struct verbstats *verbs[VERB_BUCKETS];
+};
+
+/**************************************************************/
+
+static unsigned hist_index(uint64_t value)
+{
+	unsigned e, idx;
+
+	if (value < HIST_SUB)
+		return (unsigned)value;
+	e = 63 - (unsigned)__builtin_clzll(value);
+	idx = (e - HIST_SUB_BITS + 1) * HIST_SUB
+		+ (unsigned)((value >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+	return idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1;
+}
+
+/* lowest value of the bucket idx */
+static uint64_t hist_low(unsigned idx)
+{
+	unsigned b = idx / HIST_SUB;
+	return b ? (uint64_t)(HIST_SUB + idx % HIST_SUB) << (b - 1) : idx;
+}
+
+/* highest value of the bucket idx */
+static uint64_t hist_high(unsigned idx)
+{
+	unsigned b = idx / HIST_SUB;
+	return b ? hist_low(idx) + ((uint64_t)1 << (b - 1)) - 1 : idx;
+}
+
+/* value at the quantile q of the histogram */
+static uint64_t hist_quantile(struct verbstats *vs, double q)
+{
+	uint64_t rank, acc = 0;
+	unsigned idx;
+
+	rank = (uint64_t)(q * (double)vs->count);
+	if (rank >= vs->count)
+		rank = vs->count - 1;
+	for (idx = 0 ; idx < HIST_BUCKETS ; idx++) {
+		acc += vs->histogram[idx];
+		if (acc > rank) {
+			/* middle of the bucket, bounded by the extrema */
+			rank = (hist_low(idx) + hist_high(idx)) / 2;
+			return rank < vs->min ? vs->min : rank > vs->max ? vs->max : rank;
+		}
+	}
+	return vs->max;
+}
+
+/**************************************************************/
+
+/* monotonic time in microseconds */
+uint64_t stats_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+struct stats *stats_create()
+{
+	return calloc(1, sizeof(struct stats));
+}
+
+void stats_destroy(struct stats *stats)
+{
+	struct verbstats *vs;
+	int i;
+
+	if (stats) {
+		for (i = 0 ; i < VERB_BUCKETS ; i++)
+			while ((vs = stats->verbs[i])) {
+				stats->verbs[i] = vs->next;
+				free(vs);
+			}
+		free(stats);
+	}
+}
+
+void stats_reset(struct stats *stats)
+{
+	struct verbstats *vs;
+	int i;
+
+	if (stats) {
+		stats->calls = stats->replies = stats->errors = 0;
+		stats->bytes_sent = stats->bytes_received = 0;
+		for (i = 0 ; i < VERB_BUCKETS ; i++)
+			for (vs = stats->verbs[i] ; vs ; vs = vs->next) {
+				vs->count = vs->errors = vs->sum = vs->max = 0;
+				vs->min = UINT64_MAX;
+				memset(vs->histogram, 0, sizeof vs->histogram);
+			}
+	}
+}
+
+/* records the sending of a call of api/verb (api can be NULL) with sent
+ * bytes of data, returns the statistics of the verb for the reply */
+struct verbstats *stats_call(struct stats *stats, const char *api, const char *verb, size_t sent)
+{
+	struct verbstats *vs;
+	unsigned h = 0;
+	size_t alen, vlen;
+	const char *s;
+
+	if (!stats)
+		return NULL;
+	stats->calls++;
+	stats->bytes_sent += sent;
+
+	/* search the verb */
+	alen = api ? strlen(api) : 0;
+	vlen = strlen(verb);
+	for (s = api ; s && *s ; s++)
+		h = h * 31 + (unsigned char)*s;
+	for (s = verb ; *s ; s++)
+		h = h * 31 + (unsigned char)*s;
+	for (vs = stats->verbs[h % VERB_BUCKETS] ; vs ; vs = vs->next)
+		if (vs->hash == h
+		 && (api ? !memcmp(vs->name, api, alen) && vs->name[alen] == '/'
+				&& !strcmp(&vs->name[alen + 1], verb)
+			 : !strcmp(vs->name, verb)))
+			return vs;
+
+	/* create it */
+	vs = malloc(sizeof *vs + alen + !!api + vlen + 1);
+	if (vs) {
+		if (api) {
+			memcpy(vs->name, api, alen);
+			vs->name[alen] = '/';
+		}
+		memcpy(&vs->name[alen + !!api], verb, vlen + 1);
+		vs->hash = h;
+		vs->count = vs->errors = vs->sum = vs->max = 0;
+		vs->min = UINT64_MAX;
+		memset(vs->histogram, 0, sizeof vs->histogram);
+		vs->next = stats->verbs[h % VERB_BUCKETS];
+		stats->verbs[h % VERB_BUCKETS] = vs;
+	}
+	return vs;
+}
+
+/* records the reply to a call sent at start */
+void stats_reply(struct stats *stats, struct verbstats *vs, uint64_t start, int error)
+{
+	uint64_t elapsed;
+
+	if (!stats)
+		return;
+	stats->replies++;
+	if (error)
+		stats->errors++;
+	if (vs) {
+		elapsed = stats_now() - start;
+		vs->count++;
+		vs->errors += !!error;
+		vs->sum += elapsed;
+		if (elapsed < vs->min)
+			vs->min = elapsed;
+		if (elapsed > vs->max)
+			vs->max = elapsed;
+		vs->histogram[hist_index(elapsed)]++;
+	}
+}
+
+/* name of the verb as api/verb or verb */
+const char *stats_name(struct verbstats *vs)
+{
+	return vs->name;
+}
+
+/* records received bytes */
+void stats_received(struct stats *stats, size_t received)
+{
+	if (stats)
+		stats->bytes_received += received;
+}
+
+/**************************************************************/
+
+static JSValue verbstats_get(JSContext *ctx, struct verbstats *vs, int buckets)
+{
+	JSValue obj, arr, item;
+	unsigned idx;
+	uint32_t n;
+
+	obj = JS_NewObject(ctx);
+	if (JS_IsException(obj))
+		return obj;
+	JS_SetPropertyStr(ctx, obj, "count", JS_NewInt64(ctx, (int64_t)vs->count));
+	JS_SetPropertyStr(ctx, obj, "errors", JS_NewInt64(ctx, (int64_t)vs->errors));
+	if (vs->count) {
+		JS_SetPropertyStr(ctx, obj, "min", JS_NewInt64(ctx, (int64_t)vs->min));
+		JS_SetPropertyStr(ctx, obj, "max", JS_NewInt64(ctx, (int64_t)vs->max));
+		JS_SetPropertyStr(ctx, obj, "mean", JS_NewFloat64(ctx, (double)vs->sum / (double)vs->count));
+		JS_SetPropertyStr(ctx, obj, "p50", JS_NewInt64(ctx, (int64_t)hist_quantile(vs, 0.50)));
+		JS_SetPropertyStr(ctx, obj, "p90", JS_NewInt64(ctx, (int64_t)hist_quantile(vs, 0.90)));
+		JS_SetPropertyStr(ctx, obj, "p99", JS_NewInt64(ctx, (int64_t)hist_quantile(vs, 0.99)));
+		JS_SetPropertyStr(ctx, obj, "p999", JS_NewInt64(ctx, (int64_t)hist_quantile(vs, 0.999)));
+	}
+	if (buckets) {
+		/* the not empty buckets as [low, high, count] */
+		arr = JS_NewArray(ctx);
+		for (n = idx = 0 ; idx < HIST_BUCKETS ; idx++)
+			if (vs->histogram[idx]) {
+				item = JS_NewArray(ctx);
+				JS_SetPropertyUint32(ctx, item, 0, JS_NewInt64(ctx, (int64_t)hist_low(idx)));
+				JS_SetPropertyUint32(ctx, item, 1, JS_NewInt64(ctx, (int64_t)hist_high(idx)));
+				JS_SetPropertyUint32(ctx, item, 2, JS_NewUint32(ctx, vs->histogram[idx]));
+				JS_SetPropertyUint32(ctx, arr, n++, item);
+			}
+		JS_SetPropertyStr(ctx, obj, "buckets", arr);
+	}
+	return obj;
+}
+
+/* returns the statistics as an object, latencies are in microseconds */
+JSValue stats_get(JSContext *ctx, struct stats *stats, uint32_t inflight, int buckets)
+{
+	struct verbstats *vs;
+	JSValue obj, verbs;
+	int i;
+
+	obj = JS_NewObject(ctx);
+	if (JS_IsException(obj) || !stats)
+		return obj;
+	JS_SetPropertyStr(ctx, obj, "calls", JS_NewInt64(ctx, (int64_t)stats->calls));
+	JS_SetPropertyStr(ctx, obj, "replies", JS_NewInt64(ctx, (int64_t)stats->replies));
+	JS_SetPropertyStr(ctx, obj, "errors", JS_NewInt64(ctx, (int64_t)stats->errors));
+	JS_SetPropertyStr(ctx, obj, "inflight", JS_NewUint32(ctx, inflight));
+	JS_SetPropertyStr(ctx, obj, "bytesSent", JS_NewInt64(ctx, (int64_t)stats->bytes_sent));
+	JS_SetPropertyStr(ctx, obj, "bytesReceived", JS_NewInt64(ctx, (int64_t)stats->bytes_received));
+	verbs = JS_NewObject(ctx);
+	for (i = 0 ; i < VERB_BUCKETS ; i++)
+		for (vs = stats->verbs[i] ; vs ; vs = vs->next)
+			JS_SetPropertyStr(ctx, verbs, vs->name, verbstats_get(ctx, vs, buckets));
+	JS_SetPropertyStr(ctx, obj, "verbs", verbs);
+	return obj;
+}
@@ -23,7 +23,10 @@
  */
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <quickjs/quickjs.h>
 #include <libafbcli/afb-wsapi.h>
@@ -32,46 +35,650 @@
 
 static JSClassID afb_wsapi_class_id;
 static JSClassID afb_wsapi_msg_class_id;
+static JSClassID afb_wsapi_desc_class_id;
+static JSClassID afb_wsapi_group_class_id;
 
 extern struct afb_wsapi *client_wsapi(const char *uri, struct afb_wsapi_itf *itf, void *closure);
 extern int client_serve(const char *uri, int (*onclient)(void*,int), void *closure);
+struct prefork;
+extern int prefork_serve(const char *uri, int count, int supervise, int (*onclient)(void*,int), void *closure, struct prefork **result);
+extern void prefork_stop(struct prefork *pf);
+extern void loop_ref();
+extern void loop_unref();
+extern JSValue reply_error(JSContext *ctx, JSValue error, JSValue info, JSValue response);
+extern void class_id_init(JSClassID *class_id);
+
+struct payload;
+extern struct payload *payload_create(const char *data, size_t length, void (*release)(void*), void *closure);
+extern JSValue payload_make(JSContext *ctx, struct payload *payload);
+
+extern void *pool_alloc(size_t size);
+extern void pool_free(void *ptr, size_t size);
+
+struct jsonbuf;
+extern struct jsonbuf *jsonbuf_create();
+extern void jsonbuf_destroy(struct jsonbuf *buf);
+extern const char *json_stringify(JSContext *ctx, JSValueConst value, struct jsonbuf *buf, size_t *length);
+extern void json_release(struct jsonbuf *buf, const char *text);
+
+struct projection;
+extern struct projection *projection_create(JSContext *ctx, JSValueConst list);
+extern void projection_destroy(JSRuntime *rt, struct projection *proj);
+extern JSValue projection_apply(JSContext *ctx, struct projection *proj, const char *json, size_t length);
+extern JSValue json_parse(JSContext *ctx, const char *text, size_t length, const char *name);
+
+struct stats;
+struct verbstats;
+extern struct stats *stats_create();
+extern void stats_destroy(struct stats *stats);
+extern void stats_reset(struct stats *stats);
+extern uint64_t stats_now();
+extern struct verbstats *stats_call(struct stats *stats, const char *api, const char *verb, size_t sent);
+extern void stats_reply(struct stats *stats, struct verbstats *vs, uint64_t start, int error);
+extern void stats_received(struct stats *stats, size_t received);
+extern JSValue stats_get(JSContext *ctx, struct stats *stats, uint32_t inflight, int buckets);
+extern const char *stats_name(struct verbstats *vs);
+
+struct deadline;
+extern struct deadline *deadline_create(uint64_t expire, void (*expired)(void*), void *closure);
+extern void deadline_cancel(struct deadline *d);
+struct idle;
+extern struct idle *idle_create(void (*fun)(void*), void *closure);
+extern int idle_schedule(struct idle *idle);
+extern void idle_destroy(struct idle *idle);
 
 /**************************************************************/
 
+/* the handlers called on incoming messages */
+enum handler
+{
+	H_onHangup,
+	H_onCall,
+	H_onEventCreate,
+	H_onEventRemove,
+	H_onEventSubscribe,
+	H_onEventUnsubscribe,
+	H_onEventPush,
+	H_onEventBatch,
+	H_onEventBroadcast,
+	H_onEventUnexpected,
+	H_onSessionCreate,
+	H_onSessionRemove,
+	H_onTokenCreate,
+	H_onTokenRemove,
+	H_count
+};
+
+static const char *handler_names[H_count] =
+{
+	[H_onHangup] = "onHangup",
+	[H_onCall] = "onCall",
+	[H_onEventCreate] = "onEventCreate",
+	[H_onEventRemove] = "onEventRemove",
+	[H_onEventSubscribe] = "onEventSubscribe",
+	[H_onEventUnsubscribe] = "onEventUnsubscribe",
+	[H_onEventPush] = "onEventPush",
+	[H_onEventBatch] = "onEventBatch",
+	[H_onEventBroadcast] = "onEventBroadcast",
+	[H_onEventUnexpected] = "onEventUnexpected",
+	[H_onSessionCreate] = "onSessionCreate",
+	[H_onSessionRemove] = "onSessionRemove",
+	[H_onTokenCreate] = "onTokenCreate",
+	[H_onTokenRemove] = "onTokenRemove",
+};
+
+/* names of handlers interned at init */
+static __thread JSAtom handler_atoms[H_count];
+
+/* names of the fields of batched requests and results interned at init */
+static __thread JSAtom atom_verb, atom_args, atom_session, atom_token, atom_timeout, atom_projection;
+static __thread JSAtom atom_response, atom_error, atom_info;
+
+/*
+ * Incremented on any assignment of a handler, invalidates the caches.
+ * Handlers must be changed by assignment: their accessors on prototypes
+ * are not configurable so that redefining or deleting them throws, and
+ * properties defined on instances or changes of the prototype of an
+ * instance are not seen once its handlers are cached.
+ */
+static __thread unsigned handler_generation = 0;
+
+/* count of call message wrappers kept for reuse by connection */
+#define MSG_POOL 8
+/* count of verb strings kept by connection */
+#define VERB_CACHE 16
+
+struct verb
+{
+	char      *name;
+	JSValue    value;
+};
+
+/* event created by the peer, indexed by its id */
+struct event
+{
+	char      *name;
+	JSValue    value;     /* the name as a string */
+	JSValue    handler;   /* the routed handler or undefined */
+	/* coalescing of pushes when depth isn't 0 */
+	uint16_t   depth;     /* size of the ring, 1 for latest value only */
+	uint16_t   head;      /* index of the oldest queued push */
+	uint16_t   count;     /* count of queued pushes */
+	uint16_t   pending;   /* is in the pending list */
+	uint32_t   dropped;   /* count of pushes dropped since last delivery */
+	const struct afb_wsapi_msg **ring;
+};
+
+/* maximum depth of coalescing rings */
+#define COALESCE_MAX 4096
+
+/* handler of events of a name recorded by 'on' */
+struct route
+{
+	struct route *next;
+	JSValue    handler;   /* set by 'on' or undefined */
+	uint16_t   depth;     /* set by 'coalesce' for the events of the name */
+	char       name[];
+};
+
 struct holder
 {
 	JSContext *ctx;
 	JSValue    value;
 	void      *item;
+	int        lazy;
+	int        refcount;
+	struct jsonbuf *json;
+	struct stats *stats;
+	unsigned   generation;
+	JSValue    handlers[H_count]; /* assigned to the instance */
+	JSValue    cache[H_count];    /* resolved for the generation */
+	int        nmsgs;
+	JSValue    msgs[MSG_POOL];    /* released call message wrappers */
+	struct verb verbs[VERB_CACHE];
+	uint32_t   nevents;
+	struct event *events;         /* dense by event id */
+	struct route *routes;
+	uint32_t   npendings;
+	uint32_t  *pendings;          /* ids of events with queued pushes */
+	struct idle *flush;           /* delivery of the queued pushes */
+	uint32_t   inflight;          /* count of calls waiting their reply */
+	struct holdcb *calls;         /* the calls waiting their reply */
+	struct holdcb *expireds;      /* the failed calls still waiting their reply */
+	uint32_t   timeout;           /* default timeout of calls in ms, 0 for none */
+	uint32_t   window;            /* max count of calls in flight, 0 for none */
+	size_t     window_bytes;      /* max bytes of calls in flight, 0 for none */
+	size_t     inflight_bytes;    /* bytes of the calls in flight */
+	struct holdcb *queue;         /* calls waiting room in the window */
+	struct holdcb **queue_tail;
+	uint32_t   nqueued;
+	size_t     queued_bytes;
+	struct holdcb *drains;        /* waiting the queue to be empty */
+	struct member *members;       /* memberships in groups */
 };
 
 /**************************************************************/
 
-static void call_prop(JSContext *ctx, JSValue thisobj, const char *prop, int argc, JSValueConst *argv)
+static void holder_init(struct holder *holder)
+{
+	int i;
+
+	holder->refcount = 1;
+	holder->generation = handler_generation;
+	for (i = 0 ; i < H_count ; i++) {
+		holder->handlers[i] = JS_UNDEFINED;
+		holder->cache[i] = JS_UNINITIALIZED;
+	}
+	holder->nmsgs = 0;
+	for (i = 0 ; i < VERB_CACHE ; i++) {
+		holder->verbs[i].name = 0;
+		holder->verbs[i].value = JS_UNDEFINED;
+	}
+	holder->nevents = 0;
+	holder->events = 0;
+	holder->routes = 0;
+	holder->npendings = 0;
+	holder->pendings = 0;
+	holder->flush = 0;
+	holder->inflight = 0;
+	holder->calls = 0;
+	holder->expireds = 0;
+	holder->timeout = 0;
+	holder->window = 0;
+	holder->window_bytes = 0;
+	holder->inflight_bytes = 0;
+	holder->queue = 0;
+	holder->queue_tail = &holder->queue;
+	holder->nqueued = 0;
+	holder->queued_bytes = 0;
+	holder->drains = 0;
+	holder->members = 0;
+}
+
+static void holder_flush_cache(JSRuntime *rt, struct holder *holder)
+{
+	int i;
+
+	holder->generation = handler_generation;
+	for (i = 0 ; i < H_count ; i++) {
+		JS_FreeValueRT(rt, holder->cache[i]);
+		holder->cache[i] = JS_UNINITIALIZED;
+	}
+}
+
+/* releases the queued pushes of the event */
+static void event_unqueue(struct event *event)
+{
+	while (event->count) {
+		afb_wsapi_msg_unref(event->ring[event->head]);
+		event->head = (uint16_t)((event->head + 1) % event->depth);
+		event->count--;
+	}
+	event->head = 0;
+	event->dropped = 0;
+}
+
+static void event_unname(JSRuntime *rt, struct event *event)
+{
+	free(event->name);
+	event->name = 0;
+	JS_FreeValueRT(rt, event->value);
+	event->value = JS_UNDEFINED;
+	JS_FreeValueRT(rt, event->handler);
+	event->handler = JS_UNDEFINED;
+}
+
+static void event_free(JSRuntime *rt, struct event *event)
+{
+	event_unname(rt, event);
+	event_unqueue(event);
+	free(event->ring);
+	event->ring = 0;
+	event->depth = 0;
+}
+
+/* sets the depth of coalescing of the event, its queued pushes are released */
+static int event_coalesce(struct event *event, uint16_t depth)
+{
+	const struct afb_wsapi_msg **ring = 0;
+
+	if (depth) {
+		ring = malloc(depth * sizeof *ring);
+		if (!ring)
+			return -1;
+	}
+	event_unqueue(event);
+	free(event->ring);
+	event->ring = ring;
+	event->depth = depth;
+	return 0;
+}
+
+/* get the event of id, growing the table if needed */
+static struct event *holder_event(struct holder *holder, uint16_t id)
+{
+	uint32_t i, n, *pendings;
+	struct event *events;
+
+	if (id >= holder->nevents) {
+		n = (id + 16) & ~(uint32_t)15;
+		pendings = realloc(holder->pendings, n * sizeof *pendings);
+		if (!pendings)
+			return 0;
+		holder->pendings = pendings;
+		events = realloc(holder->events, n * sizeof *events);
+		if (!events)
+			return 0;
+		for (i = holder->nevents ; i < n ; i++) {
+			events[i].name = 0;
+			events[i].value = JS_UNDEFINED;
+			events[i].handler = JS_UNDEFINED;
+			events[i].depth = 0;
+			events[i].head = 0;
+			events[i].count = 0;
+			events[i].pending = 0;
+			events[i].dropped = 0;
+			events[i].ring = 0;
+		}
+		holder->events = events;
+		holder->nevents = n;
+	}
+	return &holder->events[id];
+}
+
+static struct route *route_search(struct holder *holder, const char *name)
+{
+	struct route *route = holder->routes;
+	while (route && strcmp(route->name, name))
+		route = route->next;
+	return route;
+}
+
+/* the route of the name of length, without handler nor coalescing */
+static struct route *route_create(struct holder *holder, const char *name, size_t length)
+{
+	struct route *route = pool_alloc(sizeof *route + 1 + length);
+
+	if (route) {
+		memcpy(route->name, name, length + 1);
+		route->handler = JS_UNDEFINED;
+		route->depth = 0;
+		route->next = holder->routes;
+		holder->routes = route;
+	}
+	return route;
+}
+
+/* records the event created by the peer and binds its route if any */
+static void holder_event_create(JSContext *ctx, struct holder *holder, uint16_t id, const char *name)
+{
+	struct event *event = holder_event(holder, id);
+	struct route *route;
+	uint16_t depth;
+
+	if (!event)
+		return;
+	event_unname(JS_GetRuntime(ctx), event);
+	event->name = strdup(name);
+	event->value = JS_NewString(ctx, name);
+	route = route_search(holder, name);
+	if (route)
+		event->handler = JS_DupValue(ctx, route->handler);
+	/* the coalescing is kept for the events of the name */
+	depth = route ? route->depth : 0;
+	if (depth != event->depth)
+		event_coalesce(event, depth);
+}
+
+static void holder_event_remove(JSRuntime *rt, struct holder *holder, uint16_t id)
+{
+	if (id < holder->nevents)
+		event_free(rt, &holder->events[id]);
+}
+
+/* set the handler of the events of name to the handler (that can be undefined) */
+static void holder_event_bind(JSContext *ctx, struct holder *holder, const char *name, JSValueConst handler)
+{
+	uint32_t i;
+
+	for (i = 0 ; i < holder->nevents ; i++)
+		if (holder->events[i].name && !strcmp(holder->events[i].name, name)) {
+			JS_FreeValue(ctx, holder->events[i].handler);
+			holder->events[i].handler = JS_DupValue(ctx, handler);
+		}
+}
+
+static void holder_clear_events(JSRuntime *rt, struct holder *holder)
+{
+	uint32_t i;
+	struct route *route;
+
+	for (i = 0 ; i < holder->nevents ; i++)
+		event_free(rt, &holder->events[i]);
+	free(holder->events);
+	holder->events = 0;
+	holder->nevents = 0;
+	free(holder->pendings);
+	holder->pendings = 0;
+	holder->npendings = 0;
+	if (holder->flush) {
+		idle_destroy(holder->flush);
+		holder->flush = 0;
+	}
+	while ((route = holder->routes)) {
+		holder->routes = route->next;
+		JS_FreeValueRT(rt, route->handler);
+		pool_free(route, sizeof *route + 1 + strlen(route->name));
+	}
+}
+
+static void holder_leave_groups(struct holder *holder);
+
+/* releases the values held by the holder */
+static void holder_clear(JSRuntime *rt, struct holder *holder)
+{
+	int i;
+
+	holder_leave_groups(holder);
+	for (i = 0 ; i < H_count ; i++) {
+		JS_FreeValueRT(rt, holder->handlers[i]);
+		holder->handlers[i] = JS_UNDEFINED;
+	}
+	holder_flush_cache(rt, holder);
+	while (holder->nmsgs)
+		JS_FreeValueRT(rt, holder->msgs[--holder->nmsgs]);
+	for (i = 0 ; i < VERB_CACHE ; i++) {
+		free(holder->verbs[i].name);
+		holder->verbs[i].name = 0;
+		JS_FreeValueRT(rt, holder->verbs[i].value);
+		holder->verbs[i].value = JS_UNDEFINED;
+	}
+	holder_clear_events(rt, holder);
+}
+
+static void holder_mark(JSRuntime *rt, struct holder *holder, JS_MarkFunc *mark_func)
+{
+	int i;
+	struct route *route;
+
+	for (i = 0 ; i < H_count ; i++) {
+		JS_MarkValue(rt, holder->handlers[i], mark_func);
+		JS_MarkValue(rt, holder->cache[i], mark_func);
+	}
+	for (i = 0 ; i < holder->nmsgs ; i++)
+		JS_MarkValue(rt, holder->msgs[i], mark_func);
+	for (i = 0 ; i < (int)holder->nevents ; i++)
+		JS_MarkValue(rt, holder->events[i].handler, mark_func);
+	for (route = holder->routes ; route ; route = route->next)
+		JS_MarkValue(rt, route->handler, mark_func);
+}
+
+static void expired_release(struct holder *holder);
+
+/* the holder is referenced during dispatch because handlers can hang up */
+static void holder_unref(JSRuntime *rt, struct holder *holder)
+{
+	if (!--holder->refcount) {
+		expired_release(holder);
+		holder_clear(rt, holder);
+		jsonbuf_destroy(holder->json);
+		stats_destroy(holder->stats);
+		pool_free(holder, sizeof *holder);
+	}
+}
+
+/* get the string of the verb, recently used verbs are not rebuilt */
+static JSValue holder_verb(JSContext *ctx, struct holder *holder, const char *name)
 {
-	JSValue func = JS_GetPropertyStr(ctx, thisobj, prop);
+	unsigned h = 0;
+	const char *p;
+	char *copy;
+	struct verb *verb;
+	JSValue value;
+
+	for (p = name ; *p ; p++)
+		h = h * 31 + (unsigned char)*p;
+	verb = &holder->verbs[h % VERB_CACHE];
+	if (!verb->name || strcmp(verb->name, name)) {
+		value = JS_NewString(ctx, name);
+		copy = strdup(name);
+		if (!copy || JS_IsException(value)) {
+			free(copy);
+			return value;
+		}
+		free(verb->name);
+		JS_FreeValue(ctx, verb->value);
+		verb->name = copy;
+		verb->value = value;
+	}
+	return JS_DupValue(ctx, verb->value);
+}
+
+/* get the handler, resolved through the prototype chain once per generation */
+static JSValueConst holder_handler(JSContext *ctx, struct holder *holder, enum handler h)
+{
+	if (!JS_IsUndefined(holder->handlers[h]))
+		return holder->handlers[h];
+	if (holder->generation != handler_generation)
+		holder_flush_cache(JS_GetRuntime(ctx), holder);
+	if (JS_VALUE_GET_TAG(holder->cache[h]) == JS_TAG_UNINITIALIZED) {
+		holder->cache[h] = JS_GetProperty(ctx, holder->value, handler_atoms[h]);
+		if (JS_IsException(holder->cache[h]))
+			holder->cache[h] = JS_UNDEFINED;
+	}
+	return holder->cache[h];
+}
+
+static void call_handler(JSContext *ctx, struct holder *holder, enum handler h, int argc, JSValueConst *argv)
+{
+	/* hold the function, the holder may vanish during the call */
+	JSValue func = JS_DupValue(ctx, holder_handler(ctx, holder, h));
+	JSValue thisobj = holder->value;
 	if (JS_IsFunction(ctx, func))
-		JS_Call(ctx, func, thisobj, argc, argv);
+		JS_FreeValue(ctx, JS_Call(ctx, func, thisobj, argc, argv));
 	JS_FreeValue(ctx, func);
 }
 
+/* getter of handlers, the data is the object of defaults */
+static JSValue handler_get(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv, int magic, JSValue *data)
+{
+	struct holder *holder = JS_GetOpaque(this_val, afb_wsapi_class_id);
+
+	if (holder && !JS_IsUndefined(holder->handlers[magic]))
+		return JS_DupValue(ctx, holder->handlers[magic]);
+	return JS_GetProperty(ctx, data[0], handler_atoms[magic]);
+}
+
+static int define_handler(JSContext *ctx, JSValueConst obj, int i, JSValueConst defaults);
+
+/* setter of handlers, records on instances, as default on the prototype owning
+ * the accessor, the data are the object of defaults and that prototype */
+static JSValue handler_set(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv, int magic, JSValue *data)
+{
+	struct holder *holder = JS_GetOpaque(this_val, afb_wsapi_class_id);
+	JSValue defaults;
+	int rc;
+
+	handler_generation++;
+	if (holder) {
+		JS_FreeValue(ctx, holder->handlers[magic]);
+		holder->handlers[magic] = JS_DupValue(ctx, argv[0]);
+		return JS_UNDEFINED;
+	}
+	if (JS_VALUE_GET_PTR(data[1]) == JS_VALUE_GET_PTR(this_val))
+		rc = JS_SetProperty(ctx, data[0], handler_atoms[magic], JS_DupValue(ctx, argv[0]));
+	else {
+		/* prototypes of subclasses and disconnected objects get their accessor */
+		defaults = JS_NewObject(ctx);
+		if (JS_IsException(defaults))
+			return defaults;
+		rc = JS_SetProperty(ctx, defaults, handler_atoms[magic], JS_DupValue(ctx, argv[0]));
+		if (rc >= 0)
+			rc = define_handler(ctx, this_val, magic, defaults);
+		JS_FreeValue(ctx, defaults);
+	}
+	return rc < 0 ? JS_EXCEPTION : JS_UNDEFINED;
+}
+
+/* define on obj the accessor of the handler i, not configurable */
+static int define_handler(JSContext *ctx, JSValueConst obj, int i, JSValueConst defaults)
+{
+	JSValueConst data[2] = { defaults, obj };
+	JSValue get, set;
+
+	get = JS_NewCFunctionData(ctx, handler_get, 0, i, 2, data);
+	set = JS_NewCFunctionData(ctx, handler_set, 1, i, 2, data);
+	return JS_DefinePropertyGetSet(ctx, obj, handler_atoms[i], get, set, JS_PROP_THROW);
+}
+
+static void define_handlers(JSContext *ctx, JSValueConst proto)
+{
+	JSValue defaults = JS_NewObject(ctx);
+	int i;
+
+	for (i = 0 ; i < H_count ; i++) {
+		handler_atoms[i] = JS_NewAtom(ctx, handler_names[i]);
+		define_handler(ctx, proto, i, defaults);
+	}
+	JS_FreeValue(ctx, defaults);
+}
+
 /**************************************************************/
 
+/* callback of a pending request, reject is undefined except for promises */
 struct holdcb
 {
 	JSContext *ctx;
 	JSValue    thisobj;
 	JSValue    func;
+	JSValue    reject;
+	JSValue    results;       /* for batches, the array of results */
+	uint32_t   remaining;     /* for batches, count of pending calls */
+	uint32_t   index;         /* for calls of batches, index of the result */
+	struct holdcb *batch;     /* for calls of batches, the batch */
+	struct verbstats *vstats; /* for calls, statistics of the verb */
+	uint64_t   start;         /* for calls, time of the sending */
+	struct holder *holder;    /* for calls, the connection while pending */
+	struct holdcb *next, **prev; /* for calls, links of the pending ones */
+	struct deadline *deadline; /* for calls, the deadline if any */
+	uint32_t   timeout;       /* for calls, the timeout in ms or 0 */
+	int        expired;       /* completed without reply, kept until it */
+	int        lazy;          /* for calls, is the reply given as payload */
+	size_t     size;          /* for calls, length of the data */
+	char      *queued;        /* for queued calls, verb, data and creds */
+	const char *creds;        /* for queued calls, creds in queued or NULL */
+	uint16_t   sessionid;     /* for queued calls */
+	uint16_t   tokenid;       /* for queued calls */
+	struct projection *projection; /* for calls, the paths extracted from the reply */
 };
 
 static struct holdcb *mkholdcb(JSContext *ctx, JSValueConst thisobj, JSValueConst func)
 {
-	struct holdcb *r = malloc(sizeof *r);
+	struct holdcb *r = pool_alloc(sizeof *r);
 	if (r) {
-		r->ctx = JS_DupContext(ctx);
+		/* the function pins its context, no need to hold it */
+		r->ctx = ctx;
 		r->thisobj = JS_DupValue(ctx, thisobj);
 		r->func = JS_DupValue(ctx, func);
+		r->reject = JS_UNDEFINED;
+		r->results = JS_UNDEFINED;
+		r->remaining = 0;
+		r->index = 0;
+		r->batch = 0;
+		r->vstats = 0;
+		r->start = 0;
+		r->holder = 0;
+		r->deadline = 0;
+		r->timeout = 0;
+		r->expired = 0;
+		r->lazy = 0;
+		r->size = 0;
+		r->queued = 0;
+		r->creds = 0;
+		r->sessionid = 0;
+		r->tokenid = 0;
+		r->projection = 0;
+	}
+	return r;
+}
+
+static struct holdcb *mkholdpromise(JSContext *ctx, JSValueConst thisobj, JSValue *promise)
+{
+	JSValue funcs[2];
+	struct holdcb *r;
+
+	*promise = JS_NewPromiseCapability(ctx, funcs);
+	if (JS_IsException(*promise))
+		return 0;
+	r = mkholdcb(ctx, thisobj, funcs[0]);
+	if (r)
+		r->reject = JS_DupValue(ctx, funcs[1]);
+	else {
+		JS_FreeValue(ctx, *promise);
+		*promise = JS_ThrowOutOfMemory(ctx);
 	}
+	JS_FreeValue(ctx, funcs[0]);
+	JS_FreeValue(ctx, funcs[1]);
 	return r;
 }
 
@@ -79,21 +686,122 @@ static void killholdcb(struct holdcb *h)
 {
 	JS_FreeValue(h->ctx, h->thisobj);
 	JS_FreeValue(h->ctx, h->func);
-	JS_FreeContext(h->ctx);
-	free(h);
+	JS_FreeValue(h->ctx, h->reject);
+	JS_FreeValue(h->ctx, h->results);
+	projection_destroy(JS_GetRuntime(h->ctx), h->projection);
+	h->projection = 0;
+	/* the closure of an expired call is released by its late reply */
+	if (!h->expired)
+		pool_free(h, sizeof *h);
+	else {
+		h->thisobj = h->func = h->reject = h->results = JS_UNDEFINED;
+		h->batch = 0;
+	}
 }
 
 static void holdcbcall(struct holdcb *h, int argc, JSValueConst *argv)
 {
-	JS_Call(h->ctx, h->func, h->thisobj, argc, argv);
+	JSValue ret = JS_Call(h->ctx, h->func, h->thisobj, argc, argv);
+	JS_FreeValue(h->ctx, ret);
 	killholdcb(h);
 }
 
+static void holdcbreject(struct holdcb *h, JSValueConst reason)
+{
+	JSValue ret = JS_Call(h->ctx, h->reject, JS_UNDEFINED, 1, &reason);
+	JS_FreeValue(h->ctx, ret);
+	killholdcb(h);
+}
+
+/* makes a batch delivering the array of results to func or to the promise if func is undefined */
+static struct holdcb *mkbatch(JSContext *ctx, JSValueConst thisobj, JSValueConst func, JSValue *promise)
+{
+	struct holdcb *r;
+
+	*promise = JS_UNDEFINED;
+	r = JS_IsUndefined(func) ? mkholdpromise(ctx, thisobj, promise) : mkholdcb(ctx, thisobj, func);
+	if (r) {
+		r->results = JS_NewArray(ctx);
+		/* held until all calls are sent */
+		r->remaining = 1;
+	}
+	return r;
+}
+
+static struct holdcb *mkbatchcall(struct holdcb *batch, uint32_t index)
+{
+	struct holdcb *r = pool_alloc(sizeof *r);
+	if (r) {
+		r->ctx = batch->ctx;
+		r->thisobj = JS_UNDEFINED;
+		r->func = JS_UNDEFINED;
+		r->reject = JS_UNDEFINED;
+		r->results = JS_UNDEFINED;
+		r->remaining = 0;
+		r->index = index;
+		r->batch = batch;
+		r->vstats = 0;
+		r->start = 0;
+		r->holder = 0;
+		r->deadline = 0;
+		r->timeout = 0;
+		r->expired = 0;
+		r->lazy = 0;
+		r->size = 0;
+		r->queued = 0;
+		r->creds = 0;
+		r->sessionid = 0;
+		r->tokenid = 0;
+		r->projection = 0;
+		batch->remaining++;
+	}
+	return r;
+}
+
+/* releases one pending call of the batch, delivers the results after the last */
+static void batch_release(struct holdcb *batch)
+{
+	if (!--batch->remaining)
+		holdcbcall(batch, 1, &batch->results);
+}
+
+/* records the result of index, takes ownership of the result */
+static void batch_set(struct holdcb *batch, uint32_t index, JSValue result)
+{
+	JS_SetPropertyUint32(batch->ctx, batch->results, index, result);
+	batch_release(batch);
+}
+
 /**************************************************************/
 
-static void msg_finalize(JSValue val)
+static void msg_release(void *closure)
+{
+	afb_wsapi_msg_unref(closure);
+}
+
+/* returns the data of the message, parsed or lazy */
+static JSValue msg_value(JSContext *ctx, struct stats *stats, int lazy, const struct afb_wsapi_msg *msg, const char *data, const char *name)
+{
+	size_t length = strlen(data);
+
+	stats_received(stats, length);
+	if (!lazy)
+		return json_parse(ctx, data, length, name);
+	afb_wsapi_msg_addref(msg);
+	return payload_make(ctx, payload_create(data, length, msg_release, (void*)msg));
+}
+
+/* returns the data of the message, parsed or lazy as set for the holder */
+static JSValue msg_data(JSContext *ctx, struct holder *holder, const struct afb_wsapi_msg *msg, const char *data, const char *name)
 {
-	struct afb_wsapi_msg *msg = JS_GetOpaque(val, afb_wsapi_msg_class_id);
+	return msg_value(ctx, holder->stats, holder->lazy, msg, data, name);
+}
+
+/**************************************************************/
+
+static void msg_finalize(JSValue val, JSClassID class_id)
+{
+	struct afb_wsapi_msg *msg = JS_GetOpaque(val, class_id);
 	JS_SetOpaque(val, 0);
 	if (msg)
 		afb_wsapi_msg_unref(msg);
@@ -103,7 +811,7 @@ static JSValue wsapi_msg_reply(JSContext *ctx, JSValueConst this_val, int argc,
 {
 	const struct afb_wsapi_msg *msg = JS_GetOpaque(this_val, afb_wsapi_msg_class_id);
 	const char *obj = NULL, *err = NULL, *info = NULL;
-	JSValue json, ret = JS_EXCEPTION;
+	JSValue ret = JS_EXCEPTION;
 	int s;
 
 	if (!msg) {
@@ -111,13 +819,9 @@ static JSValue wsapi_msg_reply(JSContext *ctx, JSValueConst this_val, int argc,
 		goto error;
 	}
 
-	json = JS_JSONStringify(ctx, argv[0], JS_UNDEFINED, JS_UNDEFINED);
-	if (!JS_IsString(json)) {
-		JS_FreeValue(ctx, json);
+	obj = json_stringify(ctx, argv[0], NULL, NULL);
+	if (!obj)
 		goto error;
-	}
-	obj = JS_ToCString(ctx, json);
-	JS_FreeValue(ctx, json);
 	if (argc >= 2 && !JS_IsUndefined(argv[1]) && !JS_IsNull(argv[1])) {
 		err = JS_ToCString(ctx, argv[1]);
 		if (!err)
@@ -131,13 +835,13 @@ static JSValue wsapi_msg_reply(JSContext *ctx, JSValueConst this_val, int argc,
 	s = afb_wsapi_msg_reply_s(msg, obj, err, info);
 	if (s >= 0) {
 		JS_SetOpaque(this_val, 0);
-		msg_finalize(this_val);
+		msg_finalize(this_val, afb_wsapi_msg_class_id);
 		ret = JS_UNDEFINED;
 	}
 
 error:
 	if (obj)
-		JS_FreeCString(ctx, obj);
+		json_release(NULL, obj);
 	if (err)
 		JS_FreeCString(ctx, err);
 	if (info)
@@ -167,30 +871,32 @@ static JSValue wsapi_msg_subunsub(JSContext *ctx, JSValueConst this_val, int arg
 
 static JSValue wsapi_msg_description(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
 {
-	const struct afb_wsapi_msg *msg = JS_GetOpaque(this_val, afb_wsapi_msg_class_id);
-	const char *obj = NULL, *err = NULL, *info = NULL;
-	JSValue json, ret = JS_EXCEPTION;
+	const struct afb_wsapi_msg *msg = JS_GetOpaque(this_val, afb_wsapi_desc_class_id);
+	const char *obj;
 	int s;
 
 	if (!msg)
 		return JS_ThrowInternalError(ctx, "disconnected");
 
-	json = JS_JSONStringify(ctx, argv[0], JS_UNDEFINED, JS_UNDEFINED);
-	if (!JS_IsString(json))
-		return JS_ThrowInternalError(ctx, "unexpected value");
-	obj = JS_ToCString(ctx, json);
-	JS_FreeValue(ctx, json);
+	obj = json_stringify(ctx, argv[0], NULL, NULL);
+	if (!obj)
+		return JS_EXCEPTION;
 	s = afb_wsapi_msg_description_s(msg, obj);
-	JS_FreeCString(ctx, obj);
+	json_release(NULL, obj);
 	if (s < 0)
 		return JS_ThrowInternalError(ctx, "failed with code %d", s);
-	msg_finalize(this_val);
+	msg_finalize(this_val, afb_wsapi_desc_class_id);
 	return JS_UNDEFINED;
 }
 
 static void AFBWSAPIMSG_finalizer(JSRuntime *rt, JSValue val)
 {
-	msg_finalize(val);
+	msg_finalize(val, afb_wsapi_msg_class_id);
+}
+
+static void AFBWSAPIDESC_finalizer(JSRuntime *rt, JSValue val)
+{
+	msg_finalize(val, afb_wsapi_desc_class_id);
 }
 
 static JSClassDef afb_wsapi_msg_class = {
@@ -198,6 +904,11 @@ static JSClassDef afb_wsapi_msg_class = {
 	.finalizer = AFBWSAPIMSG_finalizer,
 }; 
 
+static JSClassDef afb_wsapi_desc_class = {
+	.class_name = "AFBWSAPIDESC",
+	.finalizer = AFBWSAPIDESC_finalizer,
+}; 
+
 static const JSCFunctionListEntry afb_wsapi_msg_call_proto_funcs[] = {
 	JS_CFUNC_DEF("reply", 3, wsapi_msg_reply),
 	JS_CFUNC_MAGIC_DEF("subscribe", 1, wsapi_msg_subunsub, 1),
@@ -209,26 +920,61 @@ static const JSCFunctionListEntry afb_wsapi_msg_desc_proto_funcs[] = {
 };
 
 
-static JSValue wsapi_msg_make(JSContext *ctx, const struct afb_wsapi_msg *msg)
+/* get a wrapper of the call message, reusing a released one if any */
+static JSValue wsapi_msg_take(JSContext *ctx, struct holder *holder, const struct afb_wsapi_msg *msg)
 {
-	JSValue obj = JS_NewObjectClass(ctx, afb_wsapi_msg_class_id);
+	JSValue obj;
+
+	if (holder->nmsgs)
+		obj = holder->msgs[--holder->nmsgs];
+	else {
+		obj = JS_NewObjectClass(ctx, afb_wsapi_msg_class_id);
+		if (JS_IsException(obj))
+			return obj;
+	}
 	JS_SetOpaque(obj, (void*)msg);
+	return obj;
+}
 
-	switch (msg->type) {
-	case afb_wsapi_msg_type_call:
-		JS_SetPropertyFunctionList(ctx, obj, afb_wsapi_msg_call_proto_funcs, 3);
-		break;
-	case afb_wsapi_msg_type_describe:
-		JS_SetPropertyFunctionList(ctx, obj, afb_wsapi_msg_desc_proto_funcs, 1);
-		break;
-	default:
-		break;
+/* release the wrapper of the call message, replied by the handler it is
+ * kept for reuse, stripped of the properties the handler could add */
+static void wsapi_msg_give(JSContext *ctx, struct holder *holder, JSValue obj)
+{
+	JSPropertyEnum *tab;
+	uint32_t idx, count;
+	int keep;
+
+	keep = holder->ctx
+		&& holder->nmsgs < MSG_POOL
+		&& JS_IsObject(obj)
+		&& !JS_GetOpaque(obj, afb_wsapi_msg_class_id)
+		&& JS_IsExtensible(ctx, obj) > 0
+		&& JS_GetOwnPropertyNames(ctx, &tab, &count, obj, JS_GPN_STRING_MASK | JS_GPN_SYMBOL_MASK) >= 0;
+	if (keep) {
+		for (idx = 0 ; idx < count ; idx++) {
+			if (keep && JS_DeleteProperty(ctx, obj, tab[idx].atom, 0) <= 0)
+				keep = 0;
+			JS_FreeAtom(ctx, tab[idx].atom);
+		}
+		js_free(ctx, tab);
 	}
+	if (keep)
+		holder->msgs[holder->nmsgs++] = obj;
+	else
+		JS_FreeValue(ctx, obj);
+}
+
+static JSValue wsapi_desc_make(JSContext *ctx, const struct afb_wsapi_msg *msg)
+{
+	JSValue obj = JS_NewObjectClass(ctx, afb_wsapi_desc_class_id);
+	JS_SetOpaque(obj, (void*)msg);
 	return obj;
 }
 
 /**************************************************************/
 
+static void pending_fail_all(JSRuntime *rt, struct holder *holder, const char *error, const char *info);
+
 static void wsapi_on_hangup(void *closure)
 {
 	struct holder *holder = closure;
@@ -237,9 +983,14 @@ static void wsapi_on_hangup(void *closure)
 	if (ctx) {
 		JS_SetOpaque(holder->value, 0);
 		holder->ctx = 0;
+		if (holder->item)
+			loop_unref();
 		holder->item = 0;
-		call_prop(ctx, holder->value, "onHangup", 0, 0);
-		free(holder);
+		holder_leave_groups(holder);
+		pending_fail_all(JS_GetRuntime(ctx), holder, "disconnected", "hangup");
+		expired_release(holder);
+		call_handler(ctx, holder, H_onHangup, 0, 0);
+		holder_unref(JS_GetRuntime(ctx), holder);
 	}
 }
 
@@ -252,14 +1003,16 @@ static void wsapi_on_call(void *closure, const struct afb_wsapi_msg *msg)
 	if (!ctx)
 		afb_wsapi_msg_unref(msg);
 	else {
-		argv[0] = wsapi_msg_make(ctx, msg);
-		argv[1] = JS_NewString(ctx, msg->call.verb);
-		argv[2] = JS_ParseJSON(ctx, msg->call.data, strlen(msg->call.data), "<wsapi.on-call>");
+		holder->refcount++;
+		argv[0] = wsapi_msg_take(ctx, holder, msg);
+		argv[1] = holder_verb(ctx, holder, msg->call.verb);
+		argv[2] = json_parse(ctx, msg->call.data, strlen(msg->call.data), "<wsapi.on-call>");
 		argv[3] = JS_NewInt32(ctx, msg->call.sessionid);
 		argv[4] = JS_NewInt32(ctx, msg->call.tokenid);
 		argv[5] = msg->call.user_creds ? JS_NewString(ctx, msg->call.user_creds) : JS_NULL;
-		call_prop(ctx, holder->value, "onCall", 6, argv);
-		JS_FreeValue(ctx, argv[0]);
+		call_handler(ctx, holder, H_onCall, 6, argv);
+		wsapi_msg_give(ctx, holder, argv[0]);
+		holder_unref(JS_GetRuntime(ctx), holder);
 		JS_FreeValue(ctx, argv[1]);
 		JS_FreeValue(ctx, argv[2]);
 		JS_FreeValue(ctx, argv[3]);
@@ -268,17 +1021,309 @@ static void wsapi_on_call(void *closure, const struct afb_wsapi_msg *msg)
 	}
 }
 
+/* makes the result of a call of a batch, takes ownership of the values */
+static JSValue mkresult(JSContext *ctx, JSValue response, JSValue error, JSValue info)
+{
+	JSValue obj = JS_NewObject(ctx);
+	JS_SetProperty(ctx, obj, atom_response, response);
+	JS_SetProperty(ctx, obj, atom_error, error);
+	JS_SetProperty(ctx, obj, atom_info, info);
+	return obj;
+}
+
+/* records the reply of a call of a batch, takes ownership of the values */
+static void batch_reply(struct holdcb *call, JSValue response, JSValue error, JSValue info)
+{
+	struct holdcb *batch = call->batch;
+	uint32_t index = call->index;
+
+	killholdcb(call);
+	batch_set(batch, index, mkresult(batch->ctx, response, error, info));
+}
+
+/* records the failure of sending a call of a batch from the pending exception */
+static void batch_fail(struct holdcb *batch, uint32_t index)
+{
+	JSContext *ctx = batch->ctx;
+	JSValue exc = JS_GetException(ctx);
+
+	batch_set(batch, index, mkresult(ctx, JS_NULL, JS_NewString(ctx, "failed"), JS_ToString(ctx, exc)));
+	JS_FreeValue(ctx, exc);
+}
+
+/* delivers the reply argv: response, error, info to holdcb */
+static void holdcb_reply(struct holdcb *holdcb, JSValueConst *argv, int ok)
+{
+	JSContext *ctx = holdcb->ctx;
+	JSValue err;
+
+	if (holdcb->batch)
+		batch_reply(holdcb, JS_DupValue(ctx, argv[0]), JS_DupValue(ctx, argv[1]), JS_DupValue(ctx, argv[2]));
+	else if (JS_IsUndefined(holdcb->reject))
+		holdcbcall(holdcb, 3, argv);
+	else if (ok)
+		holdcbcall(holdcb, 1, argv);
+	else {
+		err = reply_error(ctx, JS_DupValue(ctx, argv[1]), JS_DupValue(ctx, argv[2]), JS_DupValue(ctx, argv[0]));
+		holdcbreject(holdcb, err);
+		JS_FreeValue(ctx, err);
+	}
+}
+
+/**************************************************************/
+
+static void pending_expired(void *closure);
+
+/* records the sent call in the table of pending calls, with its deadline */
+static void pending_add(struct holder *holder, struct holdcb *holdcb)
+{
+	holdcb->holder = holder;
+	holdcb->next = holder->calls;
+	holdcb->prev = &holder->calls;
+	if (holder->calls)
+		holder->calls->prev = &holdcb->next;
+	holder->calls = holdcb;
+	holder->inflight++;
+	holder->inflight_bytes += holdcb->size;
+	if (holdcb->timeout)
+		holdcb->deadline = deadline_create(holdcb->start + 1000 * (uint64_t)holdcb->timeout,
+						pending_expired, holdcb);
+}
+
+static void pending_remove(struct holdcb *holdcb)
+{
+	struct holder *holder = holdcb->holder;
+
+	*holdcb->prev = holdcb->next;
+	if (holdcb->next)
+		holdcb->next->prev = holdcb->prev;
+	holder->inflight--;
+	holder->inflight_bytes -= holdcb->size;
+	holdcb->holder = 0;
+	if (holdcb->deadline) {
+		deadline_cancel(holdcb->deadline);
+		holdcb->deadline = 0;
+	}
+}
+
+/* delivers the error to holdcb */
+static void holdcb_fail(struct holdcb *holdcb, const char *error, const char *info)
+{
+	JSContext *ctx = holdcb->ctx;
+	JSValue argv[3];
+
+	argv[0] = JS_NULL;
+	argv[1] = JS_NewString(ctx, error);
+	argv[2] = JS_NewString(ctx, info);
+	holdcb_reply(holdcb, argv, 0);
+	JS_FreeValue(ctx, argv[1]);
+	JS_FreeValue(ctx, argv[2]);
+}
+
+/* completes the pending call with the error, its late reply will be dropped */
+static void pending_fail(struct holdcb *holdcb, const char *error, const char *info)
+{
+	struct holder *holder = holdcb->holder;
+
+	stats_reply(holder->stats, holdcb->vstats, holdcb->start, 1);
+	pending_remove(holdcb);
+	holdcb->expired = 1;
+	holdcb->next = holder->expireds;
+	holdcb->prev = &holder->expireds;
+	if (holder->expireds)
+		holder->expireds->prev = &holdcb->next;
+	holder->expireds = holdcb;
+	holdcb_fail(holdcb, error, info);
+}
+
+/**************************************************************/
+
+/*
+ * Calls exceeding the window of calls in flight wait in a FIFO, sent as
+ * replies arrive. The connection is writable when the FIFO is empty.
+ */
+
+/* can a call of size bytes be sent now, at least one is always in flight */
+static int window_open(struct holder *holder, size_t size)
+{
+	return (!holder->window || holder->inflight < holder->window)
+		&& (!holder->window_bytes || !holder->inflight
+			|| holder->inflight_bytes + size <= holder->window_bytes);
+}
+
+/* sends the call and records it as pending */
+static int call_send(struct holder *holder, struct holdcb *holdcb, const char *verb, const char *data,
+			uint16_t sessionid, uint16_t tokenid, const char *creds)
+{
+	uint64_t start = stats_now();
+	int s;
+
+	/* the reply is given as set when sending */
+	holdcb->lazy = holder->lazy;
+	s = afb_wsapi_call_s(holder->item, verb, data, sessionid, tokenid, holdcb, creds);
+	if (s >= 0) {
+		holdcb->start = start;
+		holdcb->vstats = stats_call(holder->stats, NULL, verb, holdcb->size);
+		pending_add(holder, holdcb);
+	}
+	return s;
+}
+
+/* queues a copy of the call until the window opens */
+static int queue_add(struct holder *holder, struct holdcb *holdcb, const char *verb, const char *data,
+			uint16_t sessionid, uint16_t tokenid, const char *creds)
+{
+	size_t lverb = strlen(verb) + 1, ldata = holdcb->size + 1;
+	size_t lcreds = creds ? strlen(creds) + 1 : 0;
+	char *q = malloc(lverb + ldata + lcreds);
+
+	if (!q)
+		return -1;
+	memcpy(q, verb, lverb);
+	memcpy(q + lverb, data, ldata);
+	if (creds)
+		memcpy(q + lverb + ldata, creds, lcreds);
+	holdcb->queued = q;
+	holdcb->creds = creds ? q + lverb + ldata : 0;
+	holdcb->sessionid = sessionid;
+	holdcb->tokenid = tokenid;
+	holdcb->next = 0;
+	*holder->queue_tail = holdcb;
+	holder->queue_tail = &holdcb->next;
+	holder->nqueued++;
+	holder->queued_bytes += holdcb->size;
+	return 0;
+}
+
+static struct holdcb *queue_pop(struct holder *holder)
+{
+	struct holdcb *holdcb = holder->queue;
+
+	holder->queue = holdcb->next;
+	if (!holder->queue)
+		holder->queue_tail = &holder->queue;
+	holder->nqueued--;
+	holder->queued_bytes -= holdcb->size;
+	return holdcb;
+}
+
+/* calls the functions waiting the queue to be empty */
+static void drains_notify(struct holder *holder)
+{
+	struct holdcb *holdcb, *next = holder->drains;
+
+	holder->drains = 0;
+	while ((holdcb = next)) {
+		next = holdcb->next;
+		holdcbcall(holdcb, 0, 0);
+	}
+}
+
+/* sends the queued calls fitting in the window */
+static void queue_pump(struct holder *holder)
+{
+	struct holdcb *holdcb;
+	char info[32];
+	int s;
+
+	if (!holder->queue)
+		return;
+	while (holder->queue && holder->item && window_open(holder, holder->queue->size)) {
+		holdcb = queue_pop(holder);
+		s = call_send(holder, holdcb, holdcb->queued, holdcb->queued + strlen(holdcb->queued) + 1,
+				holdcb->sessionid, holdcb->tokenid, holdcb->creds);
+		free(holdcb->queued);
+		holdcb->queued = 0;
+		if (s < 0) {
+			snprintf(info, sizeof info, "failed with code %d", s);
+			holdcb_fail(holdcb, "failed", info);
+		}
+	}
+	if (!holder->queue)
+		drains_notify(holder);
+}
+
+/**************************************************************/
+
+static void pending_expired(void *closure)
+{
+	struct holdcb *holdcb = closure;
+	struct holder *holder = holdcb->holder;
+	JSRuntime *rt = JS_GetRuntime(holdcb->ctx);
+	char info[64];
+
+	/* released by the wheel */
+	holdcb->deadline = 0;
+	snprintf(info, sizeof info, "no reply after %u ms", (unsigned)holdcb->timeout);
+	holder->refcount++;
+	pending_fail(holdcb, "timeout", info);
+	queue_pump(holder);
+	holder_unref(rt, holder);
+}
+
+/* completes all the pending and queued calls of the holder with the error */
+static void pending_fail_all(JSRuntime *rt, struct holder *holder, const char *error, const char *info)
+{
+	struct holdcb *holdcb;
+
+	holder->refcount++;
+	while (holder->calls)
+		pending_fail(holder->calls, error, info);
+	while (holder->queue) {
+		holdcb = queue_pop(holder);
+		free(holdcb->queued);
+		holdcb->queued = 0;
+		holdcb_fail(holdcb, error, info);
+	}
+	drains_notify(holder);
+	holder_unref(rt, holder);
+}
+
+/* releases the failed calls whose reply will never come */
+static void expired_release(struct holder *holder)
+{
+	struct holdcb *holdcb;
+
+	while ((holdcb = holder->expireds)) {
+		holder->expireds = holdcb->next;
+		pool_free(holdcb, sizeof *holdcb);
+	}
+}
+
 static void wsapi_on_reply(void *closure, const struct afb_wsapi_msg *msg)
 {
 	struct holder *holder = closure;
 	struct holdcb *holdcb = msg->reply.closure;
 	JSContext *ctx = holdcb->ctx;
 	JSValue argv[3];
-
-	argv[0] = JS_ParseJSON(ctx, msg->reply.data, strlen(msg->reply.data), "<wsapi.on-reply>");
+	size_t length;
+	int ok;
+
+	/* dropped after the timeout or the disconnection */
+	if (holdcb->expired) {
+		*holdcb->prev = holdcb->next;
+		if (holdcb->next)
+			holdcb->next->prev = holdcb->prev;
+		pool_free(holdcb, sizeof *holdcb);
+		afb_wsapi_msg_unref(msg);
+		return;
+	}
+	ok = !msg->reply.error || !strcmp(msg->reply.error, "success");
+	stats_reply(holder->stats, holdcb->vstats, holdcb->start, !ok);
+	pending_remove(holdcb);
+	holder->refcount++;
+	queue_pump(holder);
+	if (!holdcb->projection)
+		argv[0] = msg_value(ctx, holder->stats, holdcb->lazy, msg, msg->reply.data, "<wsapi.on-reply>");
+	else {
+		length = strlen(msg->reply.data);
+		stats_received(holder->stats, length);
+		argv[0] = projection_apply(ctx, holdcb->projection, msg->reply.data, length);
+	}
 	argv[1] = msg->reply.error ? JS_NewString(ctx, msg->reply.error) : JS_NULL;
 	argv[2] = msg->reply.info ? JS_NewString(ctx, msg->reply.info) : JS_NULL;
-	holdcbcall(holdcb, 3, argv);
+	holder_unref(JS_GetRuntime(ctx), holder);
+	holdcb_reply(holdcb, argv, ok);
 	JS_FreeValue(ctx, argv[0]);
 	JS_FreeValue(ctx, argv[1]);
 	JS_FreeValue(ctx, argv[2]);
@@ -292,9 +1337,10 @@ static void wsapi_on_event_create(void *closure, const struct afb_wsapi_msg *msg
 	JSValue argv[2];
 
 	if (ctx) {
+		holder_event_create(ctx, holder, msg->event_create.eventid, msg->event_create.eventname);
 		argv[0] = JS_NewInt32(ctx, msg->event_create.eventid);
 		argv[1] = JS_NewString(ctx, msg->event_create.eventname);
-		call_prop(ctx, holder->value, "onEventCreate", 2, argv);
+		call_handler(ctx, holder, H_onEventCreate, 2, argv);
 		JS_FreeValue(ctx, argv[0]);
 		JS_FreeValue(ctx, argv[1]);
 	}
@@ -308,9 +1354,12 @@ static void wsapi_on_event_remove(void *closure, const struct afb_wsapi_msg *msg
 	JSValue argv[1];
 
 	if (ctx) {
+		holder->refcount++;
 		argv[0] = JS_NewInt32(ctx, msg->event_remove.eventid);
-		call_prop(ctx, holder->value, "onEventRemove", 1, argv);
+		call_handler(ctx, holder, H_onEventRemove, 1, argv);
 		JS_FreeValue(ctx, argv[0]);
+		holder_event_remove(JS_GetRuntime(ctx), holder, msg->event_remove.eventid);
+		holder_unref(JS_GetRuntime(ctx), holder);
 	}
 	afb_wsapi_msg_unref(msg);
 }
@@ -323,7 +1372,7 @@ static void wsapi_on_event_subscribe(void *closure, const struct afb_wsapi_msg *
 
 	if (ctx) {
 		argv[0] = JS_NewInt32(ctx, msg->event_subscribe.eventid);
-		call_prop(ctx, holder->value, "onEventSubscribe", 1, argv);
+		call_handler(ctx, holder, H_onEventSubscribe, 1, argv);
 		JS_FreeValue(ctx, argv[0]);
 	}
 	afb_wsapi_msg_unref(msg);
@@ -337,24 +1386,115 @@ static void wsapi_on_event_unsubscribe(void *closure, const struct afb_wsapi_msg
 
 	if (ctx) {
 		argv[0] = JS_NewInt32(ctx, msg->event_unsubscribe.eventid);
-		call_prop(ctx, holder->value, "onEventUnsubscribe", 1, argv);
+		call_handler(ctx, holder, H_onEventUnsubscribe, 1, argv);
 		JS_FreeValue(ctx, argv[0]);
 	}
 	afb_wsapi_msg_unref(msg);
 }
 
+/* delivers the coalesced pushes to onEventBatch([{id, name, values, dropped}...]) */
+static void event_deliver(JSContext *ctx, struct holder *holder)
+{
+	uint32_t i, j, n;
+	struct event *event;
+	const struct afb_wsapi_msg *msg;
+	JSValue batch, item, values;
+
+	batch = JS_NewArray(ctx);
+	for (i = n = 0 ; i < holder->npendings ; i++) {
+		event = &holder->events[holder->pendings[i]];
+		event->pending = 0;
+		if (!event->count)
+			continue;
+		values = JS_NewArray(ctx);
+		for (j = 0 ; event->count ; j++) {
+			msg = event->ring[event->head];
+			JS_SetPropertyUint32(ctx, values, j, msg_data(ctx, holder, msg, msg->event_push.data, "<wsapi.on-event-push>"));
+			afb_wsapi_msg_unref(msg);
+			event->head = (uint16_t)((event->head + 1) % event->depth);
+			event->count--;
+		}
+		item = JS_NewObject(ctx);
+		JS_SetPropertyStr(ctx, item, "id", JS_NewInt32(ctx, holder->pendings[i]));
+		JS_SetPropertyStr(ctx, item, "name", JS_DupValue(ctx, event->value));
+		JS_SetPropertyStr(ctx, item, "values", values);
+		JS_SetPropertyStr(ctx, item, "dropped", JS_NewUint32(ctx, event->dropped));
+		JS_SetPropertyUint32(ctx, batch, n++, item);
+		event->head = 0;
+		event->dropped = 0;
+	}
+	holder->npendings = 0;
+	if (n) {
+		holder->refcount++;
+		call_handler(ctx, holder, H_onEventBatch, 1, &batch);
+		holder_unref(JS_GetRuntime(ctx), holder);
+	}
+	JS_FreeValue(ctx, batch);
+}
+
+static void event_flush(void *closure)
+{
+	struct holder *holder = closure;
+
+	if (holder->ctx)
+		event_deliver(holder->ctx, holder);
+}
+
+/* queues the push for the coalesced event, keeping the message */
+static void event_queue(JSContext *ctx, struct holder *holder, struct event *event, uint16_t id, const struct afb_wsapi_msg *msg)
+{
+	if (event->count == event->depth) {
+		afb_wsapi_msg_unref(event->ring[event->head]);
+		event->head = (uint16_t)((event->head + 1) % event->depth);
+		event->count--;
+		event->dropped++;
+	}
+	event->ring[(event->head + event->count) % event->depth] = msg;
+	event->count++;
+	if (!event->pending) {
+		event->pending = 1;
+		holder->pendings[holder->npendings++] = id;
+	}
+	/* delivered once the pending events of the loop are dispatched */
+	if (!holder->flush)
+		holder->flush = idle_create(event_flush, holder);
+	if (holder->flush)
+		idle_schedule(holder->flush);
+}
+
+/* events routed by 'on' get (data, name, id), others go to onEventPush(id, data, name),
+ * unless coalesced for being given later to onEventBatch */
 static void wsapi_on_event_push(void *closure, const struct afb_wsapi_msg *msg)
 {
 	struct holder *holder = closure;
 	JSContext *ctx = holder->ctx;
-	JSValue argv[2];
+	uint16_t id = msg->event_push.eventid;
+	struct event *event;
+	JSValue argv[3], func;
 
 	if (ctx) {
-		argv[0] = JS_NewInt32(ctx, msg->event_push.eventid);
-		argv[1] = JS_ParseJSON(ctx, msg->event_push.data, strlen(msg->event_push.data), "<wsapi.on-event-push>");
-		call_prop(ctx, holder->value, "onEventPush", 2, argv);
+		event = id < holder->nevents ? &holder->events[id] : 0;
+		if (event && event->depth) {
+			event_queue(ctx, holder, event, id, msg);
+			return;
+		}
+		if (event && JS_IsFunction(ctx, event->handler)) {
+			func = JS_DupValue(ctx, event->handler);
+			argv[0] = msg_data(ctx, holder, msg, msg->event_push.data, "<wsapi.on-event-push>");
+			argv[1] = JS_DupValue(ctx, event->value);
+			argv[2] = JS_NewInt32(ctx, id);
+			JS_FreeValue(ctx, JS_Call(ctx, func, holder->value, 3, argv));
+			JS_FreeValue(ctx, func);
+		}
+		else {
+			argv[0] = JS_NewInt32(ctx, id);
+			argv[1] = msg_data(ctx, holder, msg, msg->event_push.data, "<wsapi.on-event-push>");
+			argv[2] = event ? JS_DupValue(ctx, event->value) : JS_UNDEFINED;
+			call_handler(ctx, holder, H_onEventPush, 3, argv);
+		}
 		JS_FreeValue(ctx, argv[0]);
 		JS_FreeValue(ctx, argv[1]);
+		JS_FreeValue(ctx, argv[2]);
 	}
 	afb_wsapi_msg_unref(msg);
 }
@@ -367,14 +1507,14 @@ static void wsapi_on_event_broadcast(void *closure, const struct afb_wsapi_msg *
 
 	if (ctx) {
 		argv[0] = JS_NewString(ctx, msg->event_broadcast.name);
-		argv[1] = JS_ParseJSON(ctx, msg->event_broadcast.data, strlen(msg->event_broadcast.data), "<wsapi.on-event-push>");
+		argv[1] = msg_data(ctx, holder, msg, msg->event_broadcast.data, "<wsapi.on-event-push>");
 		argv[2] = JS_NewInt32(ctx, msg->event_broadcast.hop);
 /* TODO but not very urgent
 		duk_push_buffer_object(ctx, -1, 0, (int)sizeof(afb_wsapi_uuid_t), DUK_BUFOBJ_UINT8ARRAY);
 		memcpy(duk_get_buffer_data(ctx, -1, NULL), msg->event_broadcast.uuid, sizeof(afb_wsapi_uuid_t));
-		call_prop(ctx, holder->value, "onEventBroadcast", 4);
+		call_handler(ctx, holder, H_onEventBroadcast, 4);
 */
-		call_prop(ctx, holder->value, "onEventBroadcast", 3, argv);
+		call_handler(ctx, holder, H_onEventBroadcast, 3, argv);
 		JS_FreeValue(ctx, argv[0]);
 		JS_FreeValue(ctx, argv[1]);
 		JS_FreeValue(ctx, argv[2]);
@@ -390,7 +1530,7 @@ static void wsapi_on_event_unexpected(void *closure, const struct afb_wsapi_msg
 
 	if (ctx) {
 		argv[0] = JS_NewInt32(ctx, msg->event_unexpected.eventid);
-		call_prop(ctx, holder->value, "onEventUnexpected", 1, argv);
+		call_handler(ctx, holder, H_onEventUnexpected, 1, argv);
 		JS_FreeValue(ctx, argv[0]);
 	}
 	afb_wsapi_msg_unref(msg);
@@ -405,7 +1545,7 @@ static void wsapi_on_session_create(void *closure, const struct afb_wsapi_msg *m
 	if (ctx) {
 		argv[0] = JS_NewInt32(ctx, msg->session_create.sessionid);
 		argv[1] = JS_NewString(ctx, msg->session_create.sessionname);
-		call_prop(ctx, holder->value, "onSessionCreate", 2, argv);
+		call_handler(ctx, holder, H_onSessionCreate, 2, argv);
 		JS_FreeValue(ctx, argv[0]);
 		JS_FreeValue(ctx, argv[1]);
 	}
@@ -420,7 +1560,7 @@ static void wsapi_on_session_remove(void *closure, const struct afb_wsapi_msg *m
 
 	if (ctx) {
 		argv[0] = JS_NewInt32(ctx, msg->session_remove.sessionid);
-		call_prop(ctx, holder->value, "onSessionRemove", 1, argv);
+		call_handler(ctx, holder, H_onSessionRemove, 1, argv);
 		JS_FreeValue(ctx, argv[0]);
 	}
 	afb_wsapi_msg_unref(msg);
@@ -435,7 +1575,7 @@ static void wsapi_on_token_create(void *closure, const struct afb_wsapi_msg *msg
 	if (ctx) {
 		argv[0] = JS_NewInt32(ctx, msg->token_create.tokenid);
 		argv[1] = JS_NewString(ctx, msg->token_create.tokenname);
-		call_prop(ctx, holder->value, "onTokenCreate", 2, argv);
+		call_handler(ctx, holder, H_onTokenCreate, 2, argv);
 		JS_FreeValue(ctx, argv[0]);
 		JS_FreeValue(ctx, argv[1]);
 	}
@@ -450,7 +1590,7 @@ static void wsapi_on_token_remove(void *closure, const struct afb_wsapi_msg *msg
 
 	if (ctx) {
 		argv[0] = JS_NewInt32(ctx, msg->token_remove.tokenid);
-		call_prop(ctx, holder->value, "onTokenRemove", 1, argv);
+		call_handler(ctx, holder, H_onTokenRemove, 1, argv);
 		JS_FreeValue(ctx, argv[0]);
 	}
 	afb_wsapi_msg_unref(msg);
@@ -465,8 +1605,8 @@ static void wsapi_on_describe(void *closure, const struct afb_wsapi_msg *msg)
 	if (!ctx)
 		afb_wsapi_msg_unref(msg);
 	else {
-		argv[0] = wsapi_msg_make(ctx, msg);
-		call_prop(ctx, holder->value, "onCall", 1, argv);
+		argv[0] = wsapi_desc_make(ctx, msg);
+		call_handler(ctx, holder, H_onCall, 1, argv);
 		JS_FreeValue(ctx, argv[0]);
 	}
 }
@@ -476,95 +1616,226 @@ static void wsapi_on_description(void *closure, const struct afb_wsapi_msg *msg)
 	struct holder *holder = closure;
 	struct holdcb *holdcb = msg->description.closure;
 	JSContext *ctx = holdcb->ctx;
-	JSValue obj = JS_ParseJSON(ctx, msg->description.data, strlen(msg->description.data), "<wsapi.on-description>");
+	JSValue obj = json_parse(ctx, msg->description.data, strlen(msg->description.data), "<wsapi.on-description>");
 	holdcbcall(holdcb, 1, &obj);
 	JS_FreeValue(ctx, obj);
 	afb_wsapi_msg_unref(msg);
 }
 
-/**************************************************************/
+/**************************************************************/
+
+/* sends the call of args: verb, object, sessionid, tokenid, user_creds, timeout, projection */
+static JSValue wsapi_send_call(JSContext *ctx, struct holder *holder, JSValueConst *args, struct holdcb *holdcb)
+{
+	int s;
+	int32_t sessionid = 0, tokenid = 0, timeout = (int32_t)holder->timeout;
+	size_t length;
+	const char *verb = 0, *obj = 0, *user_creds = 0;
+	JSValue ret = JS_EXCEPTION;
+
+	verb = JS_ToCString(ctx, args[0]);
+	if (!verb)  {
+		ret = JS_ThrowTypeError(ctx, "verb string expected");
+		goto end;
+	}
+
+	obj = json_stringify(ctx, args[1], holder->json, &length);
+	if (!obj)
+		goto end;
+	if (!holder->item) {
+		/* disconnected by a toJSON */
+		ret = JS_ThrowInternalError(ctx, "disconnected");
+		goto end;
+	}
+
+	if (!JS_IsUndefined(args[2])) {
+		if (JS_ToInt32(ctx, &sessionid, args[2])
+		 || sessionid < 0 || sessionid > UINT16_MAX) {
+			ret = JS_ThrowTypeError(ctx, "invalid sessionid");
+			goto end;
+		}
+	}
+
+	if (!JS_IsUndefined(args[3])) {
+		if (JS_ToInt32(ctx, &tokenid, args[3])
+		 || tokenid < 0 || tokenid > UINT16_MAX) {
+			ret = JS_ThrowTypeError(ctx, "invalid tokenid");
+			goto end;
+		}
+	}
+
+	if (!JS_IsUndefined(args[4])) {
+		user_creds = JS_ToCString(ctx, args[4]);
+		if (!user_creds) {
+			ret = JS_ThrowTypeError(ctx, "invalid user creds");
+			goto end;
+		}
+	}
+
+	if (!JS_IsUndefined(args[5])) {
+		if (JS_ToInt32(ctx, &timeout, args[5]) || timeout < 0) {
+			ret = JS_ThrowTypeError(ctx, "invalid timeout");
+			goto end;
+		}
+	}
+
+	if (!JS_IsUndefined(args[6]) && !JS_IsNull(args[6])) {
+		holdcb->projection = projection_create(ctx, args[6]);
+		if (!holdcb->projection)
+			goto end;
+	}
+
+	/* sent at once or queued behind the calls waiting the window */
+	holdcb->size = length;
+	holdcb->timeout = (uint32_t)timeout;
+	if (!holder->queue && window_open(holder, length)) {
+		s = call_send(holder, holdcb, verb, obj, (uint16_t)sessionid, (uint16_t)tokenid, user_creds);
+		ret = s < 0 ? JS_ThrowInternalError(ctx, "failed with code %d", s) : JS_UNDEFINED;
+	}
+	else if (queue_add(holder, holdcb, verb, obj, (uint16_t)sessionid, (uint16_t)tokenid, user_creds) < 0)
+		ret = JS_ThrowOutOfMemory(ctx);
+	else
+		ret = JS_UNDEFINED;
+end:
+	if (user_creds)
+		JS_FreeCString(ctx, user_creds);
+	if (obj)
+		json_release(holder->json, obj);
+	if (verb)
+		JS_FreeCString(ctx, verb);
+	return ret;
+}
+
+static JSValue wsapi_call(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+{
+	struct holder *holder = JS_GetOpaque(this_val, afb_wsapi_class_id);
+	struct afb_wsapi *wsapi = holder ? holder->item : 0;
+	JSValueConst args[7];
+	struct holdcb *holdcb;
+	JSValue ret;
+
+	if (!wsapi)
+		return JS_ThrowInternalError(ctx, "disconnected");
+
+	if (!JS_IsFunction(ctx, argv[2]))
+		return JS_ThrowTypeError(ctx, "function expected");
+
+	holdcb = mkholdcb(ctx, this_val, argv[2]);
+	if (!holdcb)
+		return JS_ThrowOutOfMemory(ctx);
+
+	args[0] = argv[0];
+	args[1] = argv[1];
+	args[2] = argv[3];
+	args[3] = argv[4];
+	args[4] = argv[5];
+	args[5] = argv[6];
+	args[6] = argv[7];
+	ret = wsapi_send_call(ctx, holder, args, holdcb);
+	if (JS_IsException(ret))
+		killholdcb(holdcb);
+	return ret;
+}
 
-static JSValue wsapi_call(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+static JSValue wsapi_call_async(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
 {
 	struct holder *holder = JS_GetOpaque(this_val, afb_wsapi_class_id);
 	struct afb_wsapi *wsapi = holder ? holder->item : 0;
+	struct holdcb *holdcb;
+	JSValue promise, ret;
 
-	int s;
-	int32_t sessionid = 0, tokenid = 0;
-	const char *verb = 0, *obj = 0, *user_creds = 0;
-	JSValue json = JS_UNDEFINED, ret = JS_EXCEPTION;
-	struct holdcb *holdcb = 0;
+	if (!wsapi)
+		return JS_ThrowInternalError(ctx, "disconnected");
 
-	if (!wsapi) {
-		ret = JS_ThrowInternalError(ctx, "disconnected");
-		goto end;
-	}
+	holdcb = mkholdpromise(ctx, this_val, &promise);
+	if (!holdcb)
+		return promise;
 
-	if (!JS_IsFunction(ctx, argv[2])) {
-		ret = JS_ThrowTypeError(ctx, "function expected");
-		goto end;
-	}
-	holdcb = mkholdcb(ctx, this_val, argv[2]);
-	if (!holdcb) {
-		ret = JS_ThrowOutOfMemory(ctx);
-		goto end;
+	ret = wsapi_send_call(ctx, holder, argv, holdcb);
+	if (JS_IsException(ret)) {
+		killholdcb(holdcb);
+		JS_FreeValue(ctx, promise);
+		return ret;
 	}
+	return promise;
+}
 
-	verb = JS_ToCString(ctx, argv[0]);
-	if (!verb)  {
-		ret = JS_ThrowTypeError(ctx, "verb string expected");
-		goto end;
-	}
+/* sends the requests {verb, args, session, token, timeout} of the array argv[0],
+ * the array of results {response, error, info} is given to the function
+ * argv[1] or to the returned promise if no function is given */
+static JSValue wsapi_call_batch(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+{
+	struct holder *holder = JS_GetOpaque(this_val, afb_wsapi_class_id);
+	struct afb_wsapi *wsapi = holder ? holder->item : 0;
+	struct holdcb *batch, *call;
+	JSValue promise, req, ret, *reqs;
+	int64_t length;
+	uint32_t i, n;
 
-	json = JS_JSONStringify(ctx, argv[1], JS_UNDEFINED, JS_UNDEFINED);
-	obj = JS_ToCString(ctx, json);
-	JS_FreeValue(ctx, json);
-	if (!obj) {
-		ret = JS_ThrowTypeError(ctx, "object expected");
-		goto end;
+	if (!wsapi)
+		return JS_ThrowInternalError(ctx, "disconnected");
+	if (!JS_IsArray(ctx, argv[0]))
+		return JS_ThrowTypeError(ctx, "array expected");
+	if (!JS_IsUndefined(argv[1]) && !JS_IsFunction(ctx, argv[1]))
+		return JS_ThrowTypeError(ctx, "function expected");
+	ret = JS_GetPropertyStr(ctx, argv[0], "length");
+	if (JS_ToInt64(ctx, &length, ret)) {
+		JS_FreeValue(ctx, ret);
+		return JS_EXCEPTION;
 	}
-
-	if (!JS_IsUndefined(argv[3])) {
-		if (JS_ToInt32(ctx, &sessionid, argv[3])
-		 || sessionid < 0 || sessionid > UINT16_MAX) {
-			ret = JS_ThrowTypeError(ctx, "invalid sessionid");
+	JS_FreeValue(ctx, ret);
+	if (length < 0 || length > UINT32_MAX / 7)
+		return JS_ThrowRangeError(ctx, "too many requests");
+
+	/* get and check the requests: verb, args, session, token, (no creds), timeout, projection */
+	n = (uint32_t)length;
+	reqs = js_malloc(ctx, (n ? n : 1) * 7 * sizeof *reqs);
+	if (!reqs)
+		return JS_EXCEPTION;
+	for (i = 0 ; i < n ; i++) {
+		req = JS_GetPropertyUint32(ctx, argv[0], i);
+		reqs[7 * i] = JS_GetProperty(ctx, req, atom_verb);
+		reqs[7 * i + 1] = JS_GetProperty(ctx, req, atom_args);
+		reqs[7 * i + 2] = JS_GetProperty(ctx, req, atom_session);
+		reqs[7 * i + 3] = JS_GetProperty(ctx, req, atom_token);
+		reqs[7 * i + 4] = JS_UNDEFINED;
+		reqs[7 * i + 5] = JS_GetProperty(ctx, req, atom_timeout);
+		reqs[7 * i + 6] = JS_GetProperty(ctx, req, atom_projection);
+		JS_FreeValue(ctx, req);
+		if (!JS_IsString(reqs[7 * i])) {
+			n = i + 1;
+			ret = JS_ThrowTypeError(ctx, "verb string expected at index %u", (unsigned)i);
 			goto end;
 		}
 	}
 
-	if (!JS_IsUndefined(argv[4])) {
-		if (JS_ToInt32(ctx, &tokenid, argv[4])
-		 || tokenid < 0 || tokenid > UINT16_MAX) {
-			ret = JS_ThrowTypeError(ctx, "invalid tokenid");
-			goto end;
-		}
+	batch = mkbatch(ctx, this_val, argv[1], &promise);
+	if (!batch) {
+		ret = JS_IsException(promise) ? promise : JS_ThrowOutOfMemory(ctx);
+		goto end;
 	}
 
-	if (!JS_IsUndefined(argv[5])) {
-		user_creds = JS_ToCString(ctx, argv[5]);
-		if (!user_creds) {
-			ret = JS_ThrowTypeError(ctx, "invalid user creds");
-			goto end;
+	/* send the calls, failures are reported as results */
+	holder->refcount++;
+	for (i = 0 ; i < n ; i++) {
+		call = mkbatchcall(batch, i);
+		if (!call) {
+			batch->remaining++;
+			JS_ThrowOutOfMemory(ctx);
+			batch_fail(batch, i);
+		}
+		else if (JS_IsException(wsapi_send_call(ctx, holder, &reqs[7 * i], call))) {
+			killholdcb(call);
+			batch_fail(batch, i);
 		}
 	}
-
-	s = afb_wsapi_call_s(wsapi, verb, obj, sessionid, tokenid, holdcb, user_creds);
-
-	if (s < 0)
-		ret = JS_ThrowInternalError(ctx, "failed with code %d", s);
-	else {
-		ret = JS_UNDEFINED;
-		holdcb = 0;
-	}
+	holder_unref(JS_GetRuntime(ctx), holder);
+	ret = promise;
+	batch_release(batch);
 end:
-	if (user_creds)
-		JS_FreeCString(ctx, user_creds);
-	if (obj)
-		JS_FreeCString(ctx, obj);
-	if (verb)
-		JS_FreeCString(ctx, verb);
-	if (holdcb)
-		killholdcb(holdcb);
+	for (i = 0 ; i < 7 * n ; i++)
+		JS_FreeValue(ctx, reqs[i]);
+	js_free(ctx, reqs);
 	return ret;
 }
 
@@ -648,10 +1919,26 @@ static JSValue wsapi_event_remove(JSContext *ctx, JSValueConst this_val, int arg
 
 static JSValue wsapi_event_push(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
 {
-	JSValue json = JS_JSONStringify(ctx, argv[1], JS_UNDEFINED, JS_UNDEFINED);
-	JSValue ret = wsapi_any_u16_str_vals(ctx, this_val, argv[0], json, afb_wsapi_event_push_s);
-	JS_FreeValue(ctx, json);
-	return ret;
+	int s;
+	int32_t i32;
+	const char *obj;
+	struct holder *holder = JS_GetOpaque(this_val, afb_wsapi_class_id);
+	struct afb_wsapi *wsapi = holder ? holder->item : 0;
+
+	if (!wsapi)
+		return JS_ThrowInternalError(ctx, "disconnected");
+	if (JS_ToInt32(ctx, &i32, argv[0]))
+		return JS_ThrowTypeError(ctx, "number expected");
+	if (i32 < 0 || i32 > UINT16_MAX)
+		return JS_ThrowRangeError(ctx, "out of range");
+	obj = json_stringify(ctx, argv[1], holder->json, NULL);
+	if (!obj)
+		return JS_EXCEPTION;
+	s = afb_wsapi_event_push_s(wsapi, (uint16_t)i32, obj);
+	json_release(holder->json, obj);
+	if (s < 0)
+		return JS_ThrowInternalError(ctx, "failed with code %d", s);
+	return JS_UNDEFINED;
 }
 
 static JSValue wsapi_event_unexpected(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
@@ -667,7 +1954,7 @@ static JSValue wsapi_event_broadcast(JSContext *ctx, JSValueConst this_val, int
 	int s;
 	int32_t hop = 0;
 	const char *event = 0, *obj = 0;
-	JSValue json = JS_UNDEFINED, ret = JS_EXCEPTION;
+	JSValue ret = JS_EXCEPTION;
 	afb_wsapi_uuid_t uuid;
 
 	if (!wsapi) {
@@ -681,13 +1968,9 @@ static JSValue wsapi_event_broadcast(JSContext *ctx, JSValueConst this_val, int
 		goto end;
 	}
 
-	json = JS_JSONStringify(ctx, argv[1], JS_UNDEFINED, JS_UNDEFINED);
-	obj = JS_ToCString(ctx, json);
-	JS_FreeValue(ctx, json);
-	if (!obj) {
-		ret = JS_ThrowTypeError(ctx, "object expected");
+	obj = json_stringify(ctx, argv[1], holder->json, NULL);
+	if (!obj)
 		goto end;
-	}
 
 	if (!JS_IsUndefined(argv[2])) {
 		if (JS_ToInt32(ctx, &hop, argv[2])
@@ -701,14 +1984,248 @@ static JSValue wsapi_event_broadcast(JSContext *ctx, JSValueConst this_val, int
 	s = afb_wsapi_event_broadcast_s(wsapi, event, obj, uuid, (uint8_t)hop);
 	if (s < 0)
 		ret = JS_ThrowInternalError(ctx, "failed with code %d", s);
+	else
+		ret = JS_UNDEFINED;
 end:
 	if (obj)
-		JS_FreeCString(ctx, obj);
+		json_release(holder->json, obj);
 	if (event)
 		JS_FreeCString(ctx, event);
 	return ret;
 }
 
+/**************************************************************/
+
+/*
+ * Groups of subscribers: pairs of connection and event id that receive
+ * the same pushes. The object is serialized once for all the members.
+ * Members leave their groups when their connection hangs up.
+ */
+
+struct member
+{
+	struct member *next, **prev;    /* in the group */
+	struct member *hnext, **hprev;  /* in the groups of the holder */
+	struct group *group;
+	struct holder *holder;          /* NULL when removed during a push */
+	uint16_t eventid;
+};
+
+struct group
+{
+	struct member *members;
+	uint32_t count;
+	int pushing;
+	int dead;                       /* members removed during a push */
+	struct jsonbuf *json;
+};
+
+static void member_unlink(struct member *m)
+{
+	*m->prev = m->next;
+	if (m->next)
+		m->next->prev = m->prev;
+	pool_free(m, sizeof *m);
+}
+
+/* removes the member, its removal from the group is delayed during a push */
+static void member_remove(struct member *m)
+{
+	struct group *group = m->group;
+
+	*m->hprev = m->hnext;
+	if (m->hnext)
+		m->hnext->hprev = m->hprev;
+	m->holder = 0;
+	group->count--;
+	if (group->pushing)
+		group->dead = 1;
+	else
+		member_unlink(m);
+}
+
+static void holder_leave_groups(struct holder *holder)
+{
+	while (holder->members)
+		member_remove(holder->members);
+}
+
+static void group_sweep(struct group *group)
+{
+	struct member *m, *next;
+
+	group->dead = 0;
+	for (m = group->members ; m ; m = next) {
+		next = m->next;
+		if (!m->holder)
+			member_unlink(m);
+	}
+}
+
+static JSValue AFBWSAPIGroup_constructor(JSContext *ctx, JSValueConst new_target, int argc, JSValueConst *argv)
+{
+	struct group *group;
+	JSValue obj, proto;
+
+	proto = JS_GetPropertyStr(ctx, new_target, "prototype");
+	if (JS_IsException(proto))
+		return proto;
+	obj = JS_NewObjectProtoClass(ctx, proto, afb_wsapi_group_class_id);
+	JS_FreeValue(ctx, proto);
+	if (JS_IsException(obj))
+		return obj;
+	group = pool_alloc(sizeof *group);
+	if (!group) {
+		JS_FreeValue(ctx, obj);
+		return JS_ThrowOutOfMemory(ctx);
+	}
+	group->members = 0;
+	group->count = 0;
+	group->pushing = 0;
+	group->dead = 0;
+	group->json = jsonbuf_create();
+	JS_SetOpaque(obj, group);
+	return obj;
+}
+
+static void AFBWSAPIGroup_finalizer(JSRuntime *rt, JSValue val)
+{
+	struct group *group = JS_GetOpaque(val, afb_wsapi_group_class_id);
+
+	if (group) {
+		while (group->members)
+			member_remove(group->members);
+		jsonbuf_destroy(group->json);
+		pool_free(group, sizeof *group);
+	}
+}
+
+/* adds the event argv[1] of the connection argv[0], false if already in */
+static JSValue group_add(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+{
+	struct group *group = JS_GetOpaque(this_val, afb_wsapi_group_class_id);
+	struct holder *holder = JS_GetOpaque(argv[0], afb_wsapi_class_id);
+	struct member *m;
+	int32_t i32;
+
+	if (!group)
+		return JS_ThrowTypeError(ctx, "group expected");
+	if (!holder || !holder->item)
+		return JS_ThrowInternalError(ctx, "disconnected");
+	if (JS_ToInt32(ctx, &i32, argv[1]))
+		return JS_ThrowTypeError(ctx, "number expected");
+	if (i32 < 0 || i32 > UINT16_MAX)
+		return JS_ThrowRangeError(ctx, "out of range");
+
+	for (m = holder->members ; m ; m = m->hnext)
+		if (m->group == group && m->eventid == (uint16_t)i32)
+			return JS_FALSE;
+	m = pool_alloc(sizeof *m);
+	if (!m)
+		return JS_ThrowOutOfMemory(ctx);
+	m->group = group;
+	m->holder = holder;
+	m->eventid = (uint16_t)i32;
+	m->next = group->members;
+	m->prev = &group->members;
+	if (m->next)
+		m->next->prev = &m->next;
+	group->members = m;
+	m->hnext = holder->members;
+	m->hprev = &holder->members;
+	if (m->hnext)
+		m->hnext->hprev = &m->hnext;
+	holder->members = m;
+	group->count++;
+	return JS_TRUE;
+}
+
+/* removes the connection argv[0] for the event argv[1] or for all its events
+ * if undefined, returns the count of removed members */
+static JSValue group_remove(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+{
+	struct group *group = JS_GetOpaque(this_val, afb_wsapi_group_class_id);
+	struct holder *holder = JS_GetOpaque(argv[0], afb_wsapi_class_id);
+	struct member *m, *next;
+	int32_t i32 = -1, n = 0;
+
+	if (!group)
+		return JS_ThrowTypeError(ctx, "group expected");
+	if (!JS_IsUndefined(argv[1]) && JS_ToInt32(ctx, &i32, argv[1]))
+		return JS_ThrowTypeError(ctx, "number expected");
+	if (holder)
+		for (m = holder->members ; m ; m = next) {
+			next = m->hnext;
+			if (m->group == group && (i32 < 0 || m->eventid == i32)) {
+				member_remove(m);
+				n++;
+			}
+		}
+	return JS_NewInt32(ctx, n);
+}
+
+/* pushes argv[0] to all the members, returns the count of pushes done */
+static JSValue group_push(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+{
+	struct group *group = JS_GetOpaque(this_val, afb_wsapi_group_class_id);
+	struct member *m;
+	const char *obj;
+	uint32_t n = 0;
+
+	if (!group)
+		return JS_ThrowTypeError(ctx, "group expected");
+	if (!group->members)
+		return JS_NewUint32(ctx, 0);
+	obj = json_stringify(ctx, argv[0], group->json, NULL);
+	if (!obj)
+		return JS_EXCEPTION;
+
+	/* a failed write can hang up a member during the loop */
+	group->pushing++;
+	for (m = group->members ; m ; m = m->next)
+		if (m->holder && m->holder->item
+		 && afb_wsapi_event_push_s(m->holder->item, m->eventid, obj) >= 0)
+			n++;
+	if (!--group->pushing && group->dead)
+		group_sweep(group);
+	json_release(group->json, obj);
+	return JS_NewUint32(ctx, n);
+}
+
+static JSValue group_count(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+{
+	struct group *group = JS_GetOpaque(this_val, afb_wsapi_group_class_id);
+	return JS_NewUint32(ctx, group ? group->count : 0);
+}
+
+static JSValue group_clear(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+{
+	struct group *group = JS_GetOpaque(this_val, afb_wsapi_group_class_id);
+	struct member *m, *next;
+
+	if (group)
+		for (m = group->members ; m ; m = next) {
+			next = m->next;
+			if (m->holder)
+				member_remove(m);
+		}
+	return JS_UNDEFINED;
+}
+
+static JSClassDef afb_wsapi_group_class = {
+	.class_name = "AFBWSAPIGroup",
+	.finalizer = AFBWSAPIGroup_finalizer,
+};
+
+static const JSCFunctionListEntry afb_wsapi_group_proto_funcs[] = {
+	JS_CFUNC_DEF("add_", 2, group_add),
+	JS_CFUNC_DEF("remove_", 2, group_remove),
+	JS_CFUNC_DEF("push_", 1, group_push),
+	JS_CFUNC_DEF("count_", 0, group_count),
+	JS_CFUNC_DEF("clear_", 0, group_clear),
+};
+
+/**************************************************************/
 
 static JSValue wsapi_describe(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
 {
@@ -742,10 +2259,124 @@ static JSValue wsapi_disconnect(JSContext *ctx, JSValueConst this_val, int argc,
 	if (!wsapi)
 		return JS_FALSE;
 	holder->item = 0;
+	holder_leave_groups(holder);
+	pending_fail_all(JS_GetRuntime(ctx), holder, "disconnected", "disconnect");
 	afb_wsapi_unref(wsapi);
+	loop_unref();
 	return JS_TRUE;
 }
 
+/* routes the events of the name to the handler, or removes the route if handler is null */
+static JSValue wsapi_on(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+{
+	struct holder *holder = JS_GetOpaque(this_val, afb_wsapi_class_id);
+	struct route *route, **prv;
+	const char *name;
+	size_t length;
+
+	if (!holder)
+		return JS_ThrowInternalError(ctx, "disconnected");
+	if (!JS_IsFunction(ctx, argv[1]) && !JS_IsUndefined(argv[1]) && !JS_IsNull(argv[1]))
+		return JS_ThrowTypeError(ctx, "function or null expected");
+	name = JS_ToCStringLen(ctx, &length, argv[0]);
+	if (!name)
+		return JS_EXCEPTION;
+	/* names of events are C strings, the length of the route is the one of its name */
+	if (strlen(name) != length) {
+		JS_FreeCString(ctx, name);
+		return JS_ThrowTypeError(ctx, "invalid event name");
+	}
+
+	for (prv = &holder->routes ; (route = *prv) && strcmp(route->name, name) ; prv = &route->next);
+	if (!JS_IsFunction(ctx, argv[1])) {
+		if (route) {
+			JS_FreeValue(ctx, route->handler);
+			route->handler = JS_UNDEFINED;
+			holder_event_bind(ctx, holder, name, JS_UNDEFINED);
+			/* kept while it tells the coalescing */
+			if (!route->depth) {
+				*prv = route->next;
+				pool_free(route, sizeof *route + 1 + length);
+			}
+		}
+	}
+	else {
+		if (!route) {
+			route = route_create(holder, name, length);
+			if (!route) {
+				JS_FreeCString(ctx, name);
+				return JS_ThrowOutOfMemory(ctx);
+			}
+		}
+		JS_FreeValue(ctx, route->handler);
+		route->handler = JS_DupValue(ctx, argv[1]);
+		holder_event_bind(ctx, holder, name, argv[1]);
+	}
+	JS_FreeCString(ctx, name);
+	return JS_UNDEFINED;
+}
+
+/* sets coalescing of the pushes of the event id: 0 for none, 1 for latest value, n for a ring of n,
+ * the setting is kept for the events of the same name created later by the peer */
+static JSValue wsapi_coalesce(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+{
+	struct holder *holder = JS_GetOpaque(this_val, afb_wsapi_class_id);
+	struct event *event;
+	struct route *route, **prv;
+	int32_t id, depth;
+
+	if (!holder)
+		return JS_ThrowInternalError(ctx, "disconnected");
+	if (JS_ToInt32(ctx, &id, argv[0]) || JS_ToInt32(ctx, &depth, argv[1]))
+		return JS_EXCEPTION;
+	if (id < 0 || id > UINT16_MAX || depth < 0 || depth > COALESCE_MAX)
+		return JS_ThrowRangeError(ctx, "out of range");
+	event = holder_event(holder, (uint16_t)id);
+	if (!event || event_coalesce(event, (uint16_t)depth) < 0)
+		return JS_ThrowOutOfMemory(ctx);
+	if (event->name) {
+		for (prv = &holder->routes ; (route = *prv) && strcmp(route->name, event->name) ; prv = &route->next);
+		if (!route && depth)
+			route = route_create(holder, event->name, strlen(event->name));
+		if (route) {
+			route->depth = (uint16_t)depth;
+			if (!depth && JS_IsUndefined(route->handler)) {
+				*prv = route->next;
+				pool_free(route, sizeof *route + 1 + strlen(route->name));
+			}
+		}
+	}
+	return JS_UNDEFINED;
+}
+
+/* returns the name of the event of id created by the peer */
+static JSValue wsapi_event_name(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+{
+	struct holder *holder = JS_GetOpaque(this_val, afb_wsapi_class_id);
+	int32_t id;
+
+	if (!holder)
+		return JS_ThrowInternalError(ctx, "disconnected");
+	if (JS_ToInt32(ctx, &id, argv[0]))
+		return JS_EXCEPTION;
+	if (id < 0 || (uint32_t)id >= holder->nevents)
+		return JS_UNDEFINED;
+	return JS_DupValue(ctx, holder->events[id].value);
+}
+
+static JSValue wsapi_set_lazy(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+{
+	struct holder *holder = JS_GetOpaque(this_val, afb_wsapi_class_id);
+	int lazy = JS_ToBool(ctx, argv[0]);
+
+	if (!holder)
+		return JS_ThrowInternalError(ctx, "disconnected");
+	if (lazy < 0)
+		return JS_EXCEPTION;
+	holder->lazy = lazy;
+	return JS_UNDEFINED;
+}
+
 static JSValue wsapi_is_connected(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
 {
 	struct holder *holder = JS_GetOpaque(this_val, afb_wsapi_class_id);
@@ -753,6 +2384,122 @@ static JSValue wsapi_is_connected(JSContext *ctx, JSValueConst this_val, int arg
 	return JS_NewBool(ctx, !!wsapi);
 }
 
+static JSValue wsapi_inflight(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+{
+	struct holder *holder = JS_GetOpaque(this_val, afb_wsapi_class_id);
+	return JS_NewUint32(ctx, holder ? holder->inflight : 0);
+}
+
+/* the pending calls as an array of {verb, elapsed, timeout}, in ms */
+static JSValue wsapi_pending(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+{
+	struct holder *holder = JS_GetOpaque(this_val, afb_wsapi_class_id);
+	struct holdcb *holdcb;
+	JSValue arr, obj;
+	uint64_t now = stats_now();
+	uint32_t i = 0;
+
+	arr = JS_NewArray(ctx);
+	for (holdcb = holder ? holder->calls : 0 ; holdcb ; holdcb = holdcb->next) {
+		obj = JS_NewObject(ctx);
+		JS_SetPropertyStr(ctx, obj, "verb", JS_NewString(ctx, holdcb->vstats ? stats_name(holdcb->vstats) : "?"));
+		JS_SetPropertyStr(ctx, obj, "elapsed", JS_NewFloat64(ctx, (double)(now - holdcb->start) / 1000));
+		JS_SetPropertyStr(ctx, obj, "timeout", holdcb->timeout ? JS_NewUint32(ctx, holdcb->timeout) : JS_NULL);
+		JS_SetPropertyUint32(ctx, arr, i++, obj);
+	}
+	return arr;
+}
+
+/* sets the default timeout in ms of the calls, 0 for none */
+static JSValue wsapi_set_timeout(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+{
+	struct holder *holder = JS_GetOpaque(this_val, afb_wsapi_class_id);
+	int32_t timeout;
+
+	if (!holder)
+		return JS_ThrowInternalError(ctx, "disconnected");
+	if (JS_ToInt32(ctx, &timeout, argv[0]) || timeout < 0)
+		return JS_ThrowTypeError(ctx, "invalid timeout");
+	holder->timeout = (uint32_t)timeout;
+	return JS_UNDEFINED;
+}
+
+/* sets the window of calls in flight: argv[0] calls and argv[1] bytes, 0 for no limit */
+static JSValue wsapi_set_window(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+{
+	struct holder *holder = JS_GetOpaque(this_val, afb_wsapi_class_id);
+	int64_t calls = 0, bytes = 0;
+
+	if (!holder)
+		return JS_ThrowInternalError(ctx, "disconnected");
+	if ((!JS_IsUndefined(argv[0]) && JS_ToInt64(ctx, &calls, argv[0]))
+	 || (!JS_IsUndefined(argv[1]) && JS_ToInt64(ctx, &bytes, argv[1]))
+	 || calls < 0 || calls > UINT32_MAX || bytes < 0)
+		return JS_ThrowRangeError(ctx, "invalid window");
+	holder->window = (uint32_t)calls;
+	holder->window_bytes = (size_t)bytes;
+	holder->refcount++;
+	queue_pump(holder);
+	holder_unref(JS_GetRuntime(ctx), holder);
+	return JS_UNDEFINED;
+}
+
+/* is the queue of calls waiting the window empty */
+static JSValue wsapi_writable(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+{
+	struct holder *holder = JS_GetOpaque(this_val, afb_wsapi_class_id);
+	return JS_NewBool(ctx, !holder || !holder->queue);
+}
+
+/* the calls waiting the window as {calls, bytes} */
+static JSValue wsapi_queued(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+{
+	struct holder *holder = JS_GetOpaque(this_val, afb_wsapi_class_id);
+	JSValue obj = JS_NewObject(ctx);
+
+	JS_SetPropertyStr(ctx, obj, "calls", JS_NewUint32(ctx, holder ? holder->nqueued : 0));
+	JS_SetPropertyStr(ctx, obj, "bytes", JS_NewInt64(ctx, holder ? (int64_t)holder->queued_bytes : 0));
+	return obj;
+}
+
+/* calls argv[0] or resolves the returned promise when the connection is writable */
+static JSValue wsapi_drain(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+{
+	struct holder *holder = JS_GetOpaque(this_val, afb_wsapi_class_id);
+	struct holdcb *holdcb;
+	JSValue promise = JS_UNDEFINED;
+
+	if (!JS_IsUndefined(argv[0]) && !JS_IsFunction(ctx, argv[0]))
+		return JS_ThrowTypeError(ctx, "function expected");
+	holdcb = JS_IsUndefined(argv[0]) ? mkholdpromise(ctx, this_val, &promise)
+					 : mkholdcb(ctx, this_val, argv[0]);
+	if (!holdcb)
+		return JS_IsException(promise) ? promise : JS_ThrowOutOfMemory(ctx);
+	if (!holder || !holder->queue)
+		holdcbcall(holdcb, 0, 0);
+	else {
+		holdcb->next = holder->drains;
+		holder->drains = holdcb;
+	}
+	return promise;
+}
+
+/* statistics of the calls, with the buckets of the histograms if argv[0] is true */
+static JSValue wsapi_stats(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+{
+	struct holder *holder = JS_GetOpaque(this_val, afb_wsapi_class_id);
+	return holder ? stats_get(ctx, holder->stats, holder->inflight, JS_ToBool(ctx, argv[0]))
+		: JS_NewObject(ctx);
+}
+
+static JSValue wsapi_reset_stats(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+{
+	struct holder *holder = JS_GetOpaque(this_val, afb_wsapi_class_id);
+	if (holder)
+		stats_reset(holder->stats);
+	return JS_UNDEFINED;
+}
+
 struct afb_wsapi_itf itf_wsapi =
 {
 	.on_hangup = wsapi_on_hangup,
@@ -778,10 +2525,14 @@ static int mkAFBWSAPI(JSContext *ctx, JSValue target, const char *uri, int fd)
 	struct afb_wsapi *wsapi;
 	/* get the callback function */
 
-	struct holder *holder = malloc(sizeof *holder);
+	struct holder *holder = pool_alloc(sizeof *holder);
 	if (holder) {
 		holder->ctx = ctx;
 		holder->value = target;
+		holder->lazy = 0;
+		holder->json = jsonbuf_create();
+		holder->stats = stats_create();
+		holder_init(holder);
 		if (fd < 0)
 			holder->item = client_wsapi(uri, &itf_wsapi, holder);
 		else if (afb_wsapi_create((struct afb_wsapi **)&holder->item, fd, &itf_wsapi, holder) < 0)
@@ -789,9 +2540,12 @@ static int mkAFBWSAPI(JSContext *ctx, JSValue target, const char *uri, int fd)
 		if (holder->item) {
 			JS_SetOpaque(target, holder);
 			JS_SetPropertyStr(ctx, target, "uri", JS_NewString(ctx, uri));
+			loop_ref();
 			return 1;
 		}
-		free(holder);
+		jsonbuf_destroy(holder->json);
+		stats_destroy(holder->stats);
+		pool_free(holder, sizeof *holder);
 	}
 	return 0;
 }
@@ -801,13 +2555,14 @@ struct server
 	struct server *next, *previous;
 	int fd;
 	int used;
+	struct prefork *prefork;
 	JSContext *ctx;
 	JSValue thisobj;
 	JSValue func;
 	char uri[];
 };
 
-static struct server *servers;
+static __thread struct server *servers;
 
 int wsapi_onclient(void *closure, int fd)
 {
@@ -830,12 +2585,29 @@ int wsapi_onclient(void *closure, int fd)
 	return s;
 }
 
+/* serves uri, calling argv[1] with the AFBWSAPI of each client, or stops
+ * serving it if argv[1] is null. The options argv[2] can be
+ * {workers: count, supervise: bool} for serving on pre-forked processes */
 static JSValue wsapi_serve(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
 {
-	int s;
+	int s, workers = 0, supervise = 0;
 	struct closure *holder;
 	const char *uri;
 	struct server *srv;
+	JSValue opt;
+
+	if (JS_IsObject(argv[2])) {
+		opt = JS_GetPropertyStr(ctx, argv[2], "workers");
+		s = JS_ToInt32(ctx, &workers, opt);
+		JS_FreeValue(ctx, opt);
+		if (s < 0)
+			return JS_EXCEPTION;
+		opt = JS_GetPropertyStr(ctx, argv[2], "supervise");
+		supervise = JS_ToBool(ctx, opt);
+		JS_FreeValue(ctx, opt);
+		if (supervise < 0)
+			return JS_EXCEPTION;
+	}
 
 	uri = JS_ToCString(ctx, argv[0]);
 	if (!uri)
@@ -852,12 +2624,15 @@ static JSValue wsapi_serve(JSContext *ctx, JSValueConst this_val, int argc, JSVa
 				srv->previous->next = srv->next;
 			else
 				servers = srv->next;
-			if (srv->fd > 0) /* for older libafbcli! */
+			if (srv->prefork)
+				prefork_stop(srv->prefork);
+			else if (srv->fd > 0) /* for older libafbcli! */
 				close(srv->fd);
 			JS_FreeValue(srv->ctx, srv->thisobj);
 			JS_FreeValue(srv->ctx, srv->func);
 			JS_FreeContext(srv->ctx);
-			free(srv);
+			pool_free(srv, sizeof *srv + 1 + strlen(srv->uri));
+			loop_unref();
 		}
 		return JS_UNDEFINED;
 	}
@@ -875,7 +2650,7 @@ static JSValue wsapi_serve(JSContext *ctx, JSValueConst this_val, int argc, JSVa
 		srv->ctx = JS_DupContext(ctx);
 	}
 	else {
-		srv = malloc(sizeof*srv + 1 + strlen(uri));
+		srv = pool_alloc(sizeof *srv + 1 + strlen(uri));
 		if (!srv) {
 			JS_FreeCString(ctx, uri);
 			return JS_ThrowOutOfMemory(ctx);
@@ -883,9 +2658,15 @@ static JSValue wsapi_serve(JSContext *ctx, JSValueConst this_val, int argc, JSVa
 		strcpy(srv->uri, uri);
 		JS_FreeCString(ctx, uri);
 		srv->used = 0;
-		s = client_serve(srv->uri, wsapi_onclient, srv);
+		srv->prefork = 0;
+		if (workers <= 0)
+			s = client_serve(srv->uri, wsapi_onclient, srv);
+		else
+			s = prefork_serve(srv->uri, workers, supervise, wsapi_onclient, srv, &srv->prefork);
 		if (s < 0) {
-			free(srv);
+			pool_free(srv, sizeof *srv + 1 + strlen(srv->uri));
+			if (s == -EBUSY)
+				return JS_ThrowInternalError(ctx, "workers already spawned, serve with workers before running the loop");
 			return JS_ThrowInternalError(ctx, "failed with code %d", s);
 		}
 		srv->ctx = JS_DupContext(ctx);
@@ -896,6 +2677,7 @@ static JSValue wsapi_serve(JSContext *ctx, JSValueConst this_val, int argc, JSVa
 		srv->previous = 0;
 		srv->next = servers;
 		servers = srv;
+		loop_ref();
 	}
 	return JS_UNDEFINED;
 }
@@ -946,19 +2728,46 @@ static void AFBWSAPI_finalizer(JSRuntime *rt, JSValue val)
 		if (wsapi) {
 			afb_wsapi_hangup(wsapi);
 			afb_wsapi_unref(wsapi);
+			loop_unref();
 		}
+		/* the reference of the connection, dispatches hold their own */
+		holder_clear(rt, holder);
+		holder_unref(rt, holder);
 	}
 }
 
+static void AFBWSAPI_mark(JSRuntime *rt, JSValueConst val, JS_MarkFunc *mark_func)
+{
+	struct holder *holder = JS_GetOpaque(val, afb_wsapi_class_id);
+	if (holder)
+		holder_mark(rt, holder, mark_func);
+}
+
 static JSClassDef afb_wsapi_class = {
 	.class_name = "AFBWSAPI",
 	.finalizer = AFBWSAPI_finalizer,
+	.gc_mark = AFBWSAPI_mark,
 }; 
 
 static const JSCFunctionListEntry afb_wsapi_proto_funcs[] = {
 	JS_CFUNC_DEF("isConnected_", 0, wsapi_is_connected),
+	JS_CFUNC_DEF("inflight_", 0, wsapi_inflight),
+	JS_CFUNC_DEF("pending_", 0, wsapi_pending),
+	JS_CFUNC_DEF("setTimeout_", 1, wsapi_set_timeout),
+	JS_CFUNC_DEF("setWindow_", 2, wsapi_set_window),
+	JS_CFUNC_DEF("writable_", 0, wsapi_writable),
+	JS_CFUNC_DEF("queued_", 0, wsapi_queued),
+	JS_CFUNC_DEF("drain_", 1, wsapi_drain),
+	JS_CFUNC_DEF("stats_", 1, wsapi_stats),
+	JS_CFUNC_DEF("resetStats_", 0, wsapi_reset_stats),
 	JS_CFUNC_DEF("disconnect_", 0, wsapi_disconnect),
-	JS_CFUNC_DEF("call_", 6, wsapi_call),
+	JS_CFUNC_DEF("setLazy_", 1, wsapi_set_lazy),
+	JS_CFUNC_DEF("on_", 2, wsapi_on),
+	JS_CFUNC_DEF("eventName_", 1, wsapi_event_name),
+	JS_CFUNC_DEF("coalesce_", 2, wsapi_coalesce),
+	JS_CFUNC_DEF("call_", 8, wsapi_call),
+	JS_CFUNC_DEF("callAsync_", 7, wsapi_call_async),
+	JS_CFUNC_DEF("callBatch_", 2, wsapi_call_batch),
 	JS_CFUNC_DEF("sessionCreate_", 2, wsapi_session_create),
 	JS_CFUNC_DEF("sessionRemove_", 1, wsapi_session_remove),
 	JS_CFUNC_DEF("tokenCreate_", 2, wsapi_token_create),
@@ -971,7 +2780,7 @@ static const JSCFunctionListEntry afb_wsapi_proto_funcs[] = {
 	JS_CFUNC_DEF("describe_", 1, wsapi_describe),
 };
 static const JSCFunctionListEntry afb_wsapi_funcs[] = {
-	JS_CFUNC_DEF("serve_", 2, wsapi_serve),
+	JS_CFUNC_DEF("serve_", 3, wsapi_serve),
 };
 
 int AFBWSAPI_init(JSContext *ctx, JSModuleDef *m)
@@ -979,13 +2788,32 @@ int AFBWSAPI_init(JSContext *ctx, JSModuleDef *m)
 	JSValue proto, afbwsapi;
 
 	/* create the class */
-	JS_NewClassID(&afb_wsapi_class_id);
+	class_id_init(&afb_wsapi_class_id);
 	JS_NewClass(JS_GetRuntime(ctx), afb_wsapi_class_id, &afb_wsapi_class);
-	JS_NewClassID(&afb_wsapi_msg_class_id);
+	class_id_init(&afb_wsapi_msg_class_id);
 	JS_NewClass(JS_GetRuntime(ctx), afb_wsapi_msg_class_id, &afb_wsapi_msg_class);
+	class_id_init(&afb_wsapi_desc_class_id);
+	JS_NewClass(JS_GetRuntime(ctx), afb_wsapi_desc_class_id, &afb_wsapi_desc_class);
+
+	proto = JS_NewObject(ctx);
+	JS_SetPropertyFunctionList(ctx, proto, afb_wsapi_msg_call_proto_funcs, countof(afb_wsapi_msg_call_proto_funcs));
+	JS_SetClassProto(ctx, afb_wsapi_msg_class_id, proto);
+	proto = JS_NewObject(ctx);
+	JS_SetPropertyFunctionList(ctx, proto, afb_wsapi_msg_desc_proto_funcs, countof(afb_wsapi_msg_desc_proto_funcs));
+	JS_SetClassProto(ctx, afb_wsapi_desc_class_id, proto);
 
 	proto = JS_NewObject(ctx);
 	JS_SetPropertyFunctionList(ctx, proto, afb_wsapi_proto_funcs, countof(afb_wsapi_proto_funcs));
+	define_handlers(ctx, proto);
+	atom_verb = JS_NewAtom(ctx, "verb");
+	atom_args = JS_NewAtom(ctx, "args");
+	atom_session = JS_NewAtom(ctx, "session");
+	atom_token = JS_NewAtom(ctx, "token");
+	atom_timeout = JS_NewAtom(ctx, "timeout");
+	atom_projection = JS_NewAtom(ctx, "projection");
+	atom_response = JS_NewAtom(ctx, "response");
+	atom_error = JS_NewAtom(ctx, "error");
+	atom_info = JS_NewAtom(ctx, "info");
 
 	afbwsapi = JS_NewCFunction2(ctx, AFBWSAPI_constructor, "AFBWSAPI", 1, JS_CFUNC_constructor, 0);
 	/* set proto.constructor and ctor.prototype */
@@ -994,11 +2822,22 @@ int AFBWSAPI_init(JSContext *ctx, JSModuleDef *m)
 	JS_SetPropertyFunctionList(ctx, afbwsapi, afb_wsapi_funcs, 1);
 			
 	JS_SetModuleExport(ctx, m, "AFBWSAPI", afbwsapi);
+
+	/* groups of subscribers */
+	class_id_init(&afb_wsapi_group_class_id);
+	JS_NewClass(JS_GetRuntime(ctx), afb_wsapi_group_class_id, &afb_wsapi_group_class);
+	proto = JS_NewObject(ctx);
+	JS_SetPropertyFunctionList(ctx, proto, afb_wsapi_group_proto_funcs, countof(afb_wsapi_group_proto_funcs));
+	afbwsapi = JS_NewCFunction2(ctx, AFBWSAPIGroup_constructor, "AFBWSAPIGroup", 0, JS_CFUNC_constructor, 0);
+	JS_SetConstructor(ctx, afbwsapi, proto);
+	JS_SetClassProto(ctx, afb_wsapi_group_class_id, proto);
+	JS_SetModuleExport(ctx, m, "AFBWSAPIGroup", afbwsapi);
 	return 0;
 }
 
 int AFBWSAPI_preinit(JSContext *ctx, JSModuleDef *m)
 {
 	JS_AddModuleExport(ctx, m, "AFBWSAPI");
+	JS_AddModuleExport(ctx, m, "AFBWSAPIGroup");
 	return 0;
 }
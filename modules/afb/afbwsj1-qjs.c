@@ -23,77 +23,582 @@
  */
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
 #include <quickjs/quickjs.h>
 #include <libafbcli/afb-wsj1.h>
 
 #define countof(x) (sizeof(x) / sizeof(*(x)))
 
 static JSClassID afb_wsj1_class_id;
+static JSClassID afb_wsj1_msg_class_id;
 
 extern struct afb_wsj1 *client_wsj1(const char *uri, struct afb_wsj1_itf *itf, void *closure);
+extern struct afb_wsj1 *server_wsj1(int fd, struct afb_wsj1_itf *itf, void *closure);
+extern int client_serve(const char *uri, int (*onclient)(void*,int), void *closure);
+extern int ws_upgrade(int fd, const char *protocol, void (*onupgrade)(void *closure, int fd), void *closure);
+struct prefork;
+extern int prefork_serve(const char *uri, int count, int supervise, int (*onclient)(void*,int), void *closure, struct prefork **result);
+extern void prefork_stop(struct prefork *pf);
+extern void loop_ref();
+extern void loop_unref();
+extern JSValue reply_error(JSContext *ctx, JSValue error, JSValue info, JSValue response);
+extern void class_id_init(JSClassID *class_id);
+
+struct payload;
+extern struct payload *payload_create(const char *data, size_t length, void (*release)(void*), void *closure);
+extern JSValue payload_make(JSContext *ctx, struct payload *payload);
+
+extern void *pool_alloc(size_t size);
+extern void pool_free(void *ptr, size_t size);
+
+struct jsonbuf;
+extern struct jsonbuf *jsonbuf_create();
+extern void jsonbuf_destroy(struct jsonbuf *buf);
+extern const char *json_stringify(JSContext *ctx, JSValueConst value, struct jsonbuf *buf, size_t *length);
+extern void json_release(struct jsonbuf *buf, const char *text);
+
+struct projection;
+extern struct projection *projection_create(JSContext *ctx, JSValueConst list);
+extern void projection_destroy(JSRuntime *rt, struct projection *proj);
+extern JSValue projection_apply(JSContext *ctx, struct projection *proj, const char *json, size_t length);
+extern JSValue json_parse(JSContext *ctx, const char *text, size_t length, const char *name);
+
+struct stats;
+struct verbstats;
+extern struct stats *stats_create();
+extern void stats_destroy(struct stats *stats);
+extern void stats_reset(struct stats *stats);
+extern uint64_t stats_now();
+extern struct verbstats *stats_call(struct stats *stats, const char *api, const char *verb, size_t sent);
+extern void stats_reply(struct stats *stats, struct verbstats *vs, uint64_t start, int error);
+extern void stats_received(struct stats *stats, size_t received);
+extern JSValue stats_get(JSContext *ctx, struct stats *stats, uint32_t inflight, int buckets);
+extern const char *stats_name(struct verbstats *vs);
+
+struct deadline;
+extern struct deadline *deadline_create(uint64_t expire, void (*expired)(void*), void *closure);
+extern void deadline_cancel(struct deadline *d);
 
 /**************************************************************/
 
+/* the handlers called on incoming messages */
+enum handler
+{
+	H_onEvent,
+	H_onCall,
+	H_count
+};
+
+static const char *handler_names[H_count] =
+{
+	[H_onEvent] = "onEvent",
+	[H_onCall] = "onCall",
+};
+
+/* names of handlers interned at init */
+static __thread JSAtom handler_atoms[H_count];
+
+/* names of the fields of batched requests interned at init */
+static __thread JSAtom atom_api, atom_verb, atom_args, atom_timeout, atom_projection;
+
+/*
+ * Incremented on any assignment of a handler, invalidates the caches.
+ * Handlers must be changed by assignment: their accessors on prototypes
+ * are not configurable so that redefining or deleting them throws, and
+ * properties defined on instances or changes of the prototype of an
+ * instance are not seen once its handlers are cached.
+ */
+static __thread unsigned handler_generation = 0;
+
 struct holder
 {
 	JSContext *ctx;
 	JSValue    value;
 	void      *item;
+	int        lazy;
+	struct jsonbuf *json;
+	struct stats *stats;
+	uint32_t   inflight;          /* count of calls waiting their reply */
+	struct holdcb *calls;         /* the calls waiting their reply */
+	struct holdcb *expireds;      /* the failed calls still waiting their reply */
+	uint32_t   timeout;           /* default timeout of calls in ms, 0 for none */
+	uint32_t   window;            /* max count of calls in flight, 0 for none */
+	size_t     window_bytes;      /* max bytes of calls in flight, 0 for none */
+	size_t     inflight_bytes;    /* bytes of the calls in flight */
+	struct holdcb *queue;         /* calls waiting room in the window */
+	struct holdcb **queue_tail;
+	uint32_t   nqueued;
+	size_t     queued_bytes;
+	struct holdcb *drains;        /* waiting the queue to be empty */
+	unsigned   generation;
+	int        pinned;            /* value referenced while connected */
+	JSValue    handlers[H_count]; /* assigned to the instance */
+	JSValue    cache[H_count];    /* resolved for the generation */
 };
 
+static void holder_flush_cache(JSRuntime *rt, struct holder *holder)
+{
+	int i;
+
+	holder->generation = handler_generation;
+	for (i = 0 ; i < H_count ; i++) {
+		JS_FreeValueRT(rt, holder->cache[i]);
+		holder->cache[i] = JS_UNINITIALIZED;
+	}
+}
+
 static struct holder *mkholder(JSContext *ctx, JSValueConst value)
 {
-	struct holder *r = malloc(sizeof *r);
+	int i;
+	struct holder *r = pool_alloc(sizeof *r);
 	if (r) {
 		r->ctx = ctx;
 		r->value = value;
 		r->item = 0;
+		r->lazy = 0;
+		r->json = jsonbuf_create();
+		r->stats = stats_create();
+		r->inflight = 0;
+		r->calls = 0;
+		r->expireds = 0;
+		r->timeout = 0;
+		r->window = 0;
+		r->window_bytes = 0;
+		r->inflight_bytes = 0;
+		r->queue = 0;
+		r->queue_tail = &r->queue;
+		r->nqueued = 0;
+		r->queued_bytes = 0;
+		r->drains = 0;
+		r->generation = handler_generation;
+		r->pinned = 0;
+		for (i = 0 ; i < H_count ; i++) {
+			r->handlers[i] = JS_UNDEFINED;
+			r->cache[i] = JS_UNINITIALIZED;
+		}
 	}
 	return r;
 }
 
-static void killholder(struct holder *h)
+static void expired_release(struct holder *holder);
+
+static void killholder(JSRuntime *rt, struct holder *h)
 {
-	free(h);
+	int i;
+
+	expired_release(h);
+	for (i = 0 ; i < H_count ; i++)
+		JS_FreeValueRT(rt, h->handlers[i]);
+	holder_flush_cache(rt, h);
+	jsonbuf_destroy(h->json);
+	stats_destroy(h->stats);
+	pool_free(h, sizeof *h);
 }
 
 /**************************************************************/
 
+/* get the handler, resolved through the prototype chain once per generation */
+static JSValueConst holder_handler(JSContext *ctx, struct holder *holder, enum handler h)
+{
+	if (!JS_IsUndefined(holder->handlers[h]))
+		return holder->handlers[h];
+	if (holder->generation != handler_generation)
+		holder_flush_cache(JS_GetRuntime(ctx), holder);
+	if (JS_VALUE_GET_TAG(holder->cache[h]) == JS_TAG_UNINITIALIZED) {
+		holder->cache[h] = JS_GetProperty(ctx, holder->value, handler_atoms[h]);
+		if (JS_IsException(holder->cache[h]))
+			holder->cache[h] = JS_UNDEFINED;
+	}
+	return holder->cache[h];
+}
+
+static void call_handler(JSContext *ctx, struct holder *holder, enum handler h, int argc, JSValueConst *argv)
+{
+	/* hold the function, the handler may be replaced during the call */
+	JSValue func = JS_DupValue(ctx, holder_handler(ctx, holder, h));
+	if (JS_IsFunction(ctx, func))
+		JS_FreeValue(ctx, JS_Call(ctx, func, holder->value, argc, argv));
+	JS_FreeValue(ctx, func);
+}
+
+/* getter of handlers, the data is the object of defaults */
+static JSValue handler_get(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv, int magic, JSValue *data)
+{
+	struct holder *holder = JS_GetOpaque(this_val, afb_wsj1_class_id);
+
+	if (holder && !JS_IsUndefined(holder->handlers[magic]))
+		return JS_DupValue(ctx, holder->handlers[magic]);
+	return JS_GetProperty(ctx, data[0], handler_atoms[magic]);
+}
+
+static int define_handler(JSContext *ctx, JSValueConst obj, int i, JSValueConst defaults);
+
+/* setter of handlers, records on instances, as default on the prototype owning
+ * the accessor, the data are the object of defaults and that prototype */
+static JSValue handler_set(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv, int magic, JSValue *data)
+{
+	struct holder *holder = JS_GetOpaque(this_val, afb_wsj1_class_id);
+	JSValue defaults;
+	int rc;
+
+	handler_generation++;
+	if (holder) {
+		JS_FreeValue(ctx, holder->handlers[magic]);
+		holder->handlers[magic] = JS_DupValue(ctx, argv[0]);
+		return JS_UNDEFINED;
+	}
+	if (JS_VALUE_GET_PTR(data[1]) == JS_VALUE_GET_PTR(this_val))
+		rc = JS_SetProperty(ctx, data[0], handler_atoms[magic], JS_DupValue(ctx, argv[0]));
+	else {
+		/* prototypes of subclasses and disconnected objects get their accessor */
+		defaults = JS_NewObject(ctx);
+		if (JS_IsException(defaults))
+			return defaults;
+		rc = JS_SetProperty(ctx, defaults, handler_atoms[magic], JS_DupValue(ctx, argv[0]));
+		if (rc >= 0)
+			rc = define_handler(ctx, this_val, magic, defaults);
+		JS_FreeValue(ctx, defaults);
+	}
+	return rc < 0 ? JS_EXCEPTION : JS_UNDEFINED;
+}
+
+/* define on obj the accessor of the handler i, not configurable */
+static int define_handler(JSContext *ctx, JSValueConst obj, int i, JSValueConst defaults)
+{
+	JSValueConst data[2] = { defaults, obj };
+	JSValue get, set;
+
+	get = JS_NewCFunctionData(ctx, handler_get, 0, i, 2, data);
+	set = JS_NewCFunctionData(ctx, handler_set, 1, i, 2, data);
+	return JS_DefinePropertyGetSet(ctx, obj, handler_atoms[i], get, set, JS_PROP_THROW);
+}
+
+static void define_handlers(JSContext *ctx, JSValueConst proto)
+{
+	JSValue defaults = JS_NewObject(ctx);
+	int i;
+
+	for (i = 0 ; i < H_count ; i++) {
+		handler_atoms[i] = JS_NewAtom(ctx, handler_names[i]);
+		define_handler(ctx, proto, i, defaults);
+	}
+	JS_FreeValue(ctx, defaults);
+}
+
+/**************************************************************/
+
+/* callback of a pending call, reject is undefined except for promises */
+struct holdcb
+{
+	JSContext *ctx;
+	JSValue    thisobj;
+	JSValue    func;
+	JSValue    reject;
+	JSValue    results;       /* for batches, the array of results */
+	uint32_t   remaining;     /* for batches, count of pending calls */
+	uint32_t   index;         /* for calls of batches, index of the result */
+	struct holdcb *batch;     /* for calls of batches, the batch */
+	struct verbstats *vstats; /* for calls, statistics of the verb */
+	uint64_t   start;         /* for calls, time of the sending */
+	struct holder *holder;    /* for calls, the connection while pending */
+	struct holdcb *next, **prev; /* for calls, links of the pending ones */
+	struct deadline *deadline; /* for calls, the deadline if any */
+	uint32_t   timeout;       /* for calls, the timeout in ms or 0 */
+	int        expired;       /* completed without reply, kept until it */
+	size_t     size;          /* for calls, length of the data */
+	char      *queued;        /* for queued calls, api, verb and data */
+	struct projection *projection; /* for calls, the paths extracted from the reply */
+};
+
+static struct holdcb *mkholdcb(JSContext *ctx, JSValueConst thisobj, JSValueConst func)
+{
+	struct holdcb *r = pool_alloc(sizeof *r);
+	if (r) {
+		/* the function pins its context, no need to hold it */
+		r->ctx = ctx;
+		r->thisobj = JS_DupValue(ctx, thisobj);
+		r->func = JS_DupValue(ctx, func);
+		r->reject = JS_UNDEFINED;
+		r->results = JS_UNDEFINED;
+		r->remaining = 0;
+		r->index = 0;
+		r->batch = 0;
+		r->vstats = 0;
+		r->start = 0;
+		r->holder = 0;
+		r->deadline = 0;
+		r->timeout = 0;
+		r->expired = 0;
+		r->size = 0;
+		r->queued = 0;
+		r->projection = 0;
+	}
+	return r;
+}
+
+static struct holdcb *mkholdpromise(JSContext *ctx, JSValueConst thisobj, JSValue *promise)
+{
+	JSValue funcs[2];
+	struct holdcb *r;
+
+	*promise = JS_NewPromiseCapability(ctx, funcs);
+	if (JS_IsException(*promise))
+		return 0;
+	r = mkholdcb(ctx, thisobj, funcs[0]);
+	if (r)
+		r->reject = JS_DupValue(ctx, funcs[1]);
+	else {
+		JS_FreeValue(ctx, *promise);
+		*promise = JS_ThrowOutOfMemory(ctx);
+	}
+	JS_FreeValue(ctx, funcs[0]);
+	JS_FreeValue(ctx, funcs[1]);
+	return r;
+}
+
+static void killholdcb(struct holdcb *h)
+{
+	JS_FreeValue(h->ctx, h->thisobj);
+	JS_FreeValue(h->ctx, h->func);
+	JS_FreeValue(h->ctx, h->reject);
+	JS_FreeValue(h->ctx, h->results);
+	projection_destroy(JS_GetRuntime(h->ctx), h->projection);
+	h->projection = 0;
+	/* the closure of an expired call is released by its late reply */
+	if (!h->expired)
+		pool_free(h, sizeof *h);
+	else {
+		h->thisobj = h->func = h->reject = h->results = JS_UNDEFINED;
+		h->batch = 0;
+	}
+}
+
+static void holdcbcall(struct holdcb *h, int argc, JSValueConst *argv)
+{
+	JSValue ret = JS_Call(h->ctx, h->func, h->thisobj, argc, argv);
+	JS_FreeValue(h->ctx, ret);
+	killholdcb(h);
+}
+
+/* makes a batch delivering the array of results to func or to the promise if func is undefined */
+static struct holdcb *mkbatch(JSContext *ctx, JSValueConst thisobj, JSValueConst func, JSValue *promise)
+{
+	struct holdcb *r;
+
+	*promise = JS_UNDEFINED;
+	r = JS_IsUndefined(func) ? mkholdpromise(ctx, thisobj, promise) : mkholdcb(ctx, thisobj, func);
+	if (r) {
+		r->results = JS_NewArray(ctx);
+		/* held until all calls are sent */
+		r->remaining = 1;
+	}
+	return r;
+}
+
+static struct holdcb *mkbatchcall(struct holdcb *batch, uint32_t index)
+{
+	struct holdcb *r = pool_alloc(sizeof *r);
+	if (r) {
+		r->ctx = batch->ctx;
+		r->thisobj = JS_UNDEFINED;
+		r->func = JS_UNDEFINED;
+		r->reject = JS_UNDEFINED;
+		r->results = JS_UNDEFINED;
+		r->remaining = 0;
+		r->index = index;
+		r->batch = batch;
+		r->vstats = 0;
+		r->start = 0;
+		r->holder = 0;
+		r->deadline = 0;
+		r->timeout = 0;
+		r->expired = 0;
+		r->size = 0;
+		r->queued = 0;
+		r->projection = 0;
+		batch->remaining++;
+	}
+	return r;
+}
+
+/* releases one pending call of the batch, delivers the results after the last */
+static void batch_release(struct holdcb *batch)
+{
+	if (!--batch->remaining)
+		holdcbcall(batch, 1, &batch->results);
+}
+
+/* records the result of index, takes ownership of the result */
+static void batch_set(struct holdcb *batch, uint32_t index, JSValue result)
+{
+	JS_SetPropertyUint32(batch->ctx, batch->results, index, result);
+	batch_release(batch);
+}
+
+/**************************************************************/
+
+static void msg_release(void *closure)
+{
+	afb_wsj1_msg_unref(closure);
+}
+
+/* returns the object of the message, parsed or lazy as set for the holder */
+static JSValue msg_data(JSContext *ctx, struct holder *holder, struct afb_wsj1_msg *msg, const char *name)
+{
+	size_t jlen;
+	const char *json = afb_wsj1_msg_object_s(msg, &jlen);
+
+	if (!holder || !holder->lazy)
+		return json_parse(ctx, json, jlen, name);
+	afb_wsj1_msg_addref(msg);
+	return payload_make(ctx, payload_create(json, jlen, msg_release, msg));
+}
+
+/**************************************************************/
+
+/* message of an incoming call, given to onCall for replying it */
+
+static void AFBWSJ1MSG_finalizer(JSRuntime *rt, JSValue val)
+{
+	struct afb_wsj1_msg *msg = JS_GetOpaque(val, afb_wsj1_msg_class_id);
+	if (msg)
+		afb_wsj1_msg_unref(msg);
+}
+
+/* replies argv[0], as an error if argv[1] is true, with the token argv[2] */
+static JSValue wsj1_msg_reply(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+{
+	struct afb_wsj1_msg *msg = JS_GetOpaque(this_val, afb_wsj1_msg_class_id);
+	const char *obj, *token = NULL;
+	int s;
+
+	if (!msg)
+		return JS_ThrowInternalError(ctx, "already replied");
+	if (!JS_IsUndefined(argv[2]) && !JS_IsNull(argv[2])) {
+		token = JS_ToCString(ctx, argv[2]);
+		if (!token)
+			return JS_EXCEPTION;
+	}
+	obj = json_stringify(ctx, argv[0], NULL, NULL);
+	if (!obj) {
+		JS_FreeCString(ctx, token);
+		return JS_EXCEPTION;
+	}
+	s = afb_wsj1_reply_s(msg, obj, token, JS_ToBool(ctx, argv[1]));
+	json_release(NULL, obj);
+	JS_FreeCString(ctx, token);
+	if (s < 0)
+		return JS_ThrowInternalError(ctx, "failed with code %d", s);
+	JS_SetOpaque(this_val, 0);
+	afb_wsj1_msg_unref(msg);
+	return JS_UNDEFINED;
+}
+
+static JSClassDef afb_wsj1_msg_class = {
+	.class_name = "AFBWSJ1MSG",
+	.finalizer = AFBWSJ1MSG_finalizer,
+};
+
+static const JSCFunctionListEntry afb_wsj1_msg_proto_funcs[] = {
+	JS_CFUNC_DEF("reply", 3, wsj1_msg_reply),
+};
+
+/**************************************************************/
+
+/* releases the reference held on served clients until they disconnect */
+static void holder_unpin(struct holder *holder)
+{
+	if (holder->pinned) {
+		holder->pinned = 0;
+		JS_FreeValue(holder->ctx, holder->value);
+	}
+}
+
+static void pending_fail_all(struct holder *holder, const char *status, const char *info);
+
 void on_wsj1_hangup(void *closure, struct afb_wsj1 *_wsj1_)
 {
 	struct holder *holder = closure;
 	struct afb_wsj1 *wsj1 = holder ? holder->item : 0;
+	JSValue self;
 	if (wsj1) {
+		/* failing the calls can release the last reference */
+		self = JS_DupValue(holder->ctx, holder->value);
 		holder->item = 0;
+		pending_fail_all(holder, "disconnected", "hangup");
+		expired_release(holder);
 		afb_wsj1_unref(wsj1);
-		JSValue func = JS_GetPropertyStr(holder->ctx, holder->value, "onEvent");
-		if (JS_IsFunction(holder->ctx, func)) {
-			JS_Call(holder->ctx, func, holder->value, 0, 0);
-		}
+		loop_unref();
+		call_handler(holder->ctx, holder, H_onEvent, 0, 0);
+		holder_unpin(holder);
+		JS_FreeValue(holder->ctx, self);
 	}
 }
 
+static const char unhandled[] = "{\"response\":null,\"request\":{\"status\":\"unhandled\"}}";
+
+/* calls onCall(msg, api, verb, data), the message being replied through msg */
 void on_wsj1_call(void *closure, const char *api, const char *verb, struct afb_wsj1_msg *msg)
 {
-	afb_wsj1_reply_s(msg, "{\"response\":null,\"request\":{\"status\":\"unhandled\"}}", NULL, 1);
-	afb_wsj1_msg_unref(msg);
+	JSValue argv[4], func, ret;
+	struct holder *holder = closure;
+	JSContext *ctx = holder->ctx;
+	size_t jlen;
+
+	afb_wsj1_msg_object_s(msg, &jlen);
+	stats_received(holder->stats, jlen);
+	func = JS_DupValue(ctx, holder_handler(ctx, holder, H_onCall));
+	argv[0] = JS_IsFunction(ctx, func) ? JS_NewObjectClass(ctx, afb_wsj1_msg_class_id) : JS_UNDEFINED;
+	if (!JS_IsObject(argv[0])) {
+		afb_wsj1_reply_s(msg, unhandled, NULL, 1);
+		afb_wsj1_msg_unref(msg);
+	}
+	else {
+		JS_SetOpaque(argv[0], msg);
+		argv[1] = JS_NewString(ctx, api);
+		argv[2] = JS_NewString(ctx, verb);
+		argv[3] = msg_data(ctx, holder, msg, "<wsj1.call>");
+		ret = JS_Call(ctx, func, holder->value, 4, argv);
+		if (JS_IsException(ret) && JS_GetOpaque(argv[0], afb_wsj1_msg_class_id)) {
+			/* the handler failed before replying */
+			JS_SetOpaque(argv[0], 0);
+			afb_wsj1_reply_s(msg, unhandled, NULL, 1);
+			afb_wsj1_msg_unref(msg);
+		}
+		JS_FreeValue(ctx, ret);
+		JS_FreeValue(ctx, argv[1]);
+		JS_FreeValue(ctx, argv[2]);
+		JS_FreeValue(ctx, argv[3]);
+	}
+	JS_FreeValue(ctx, argv[0]);
+	JS_FreeValue(ctx, func);
 }
 
 void on_wsj1_event(void *closure, const char *event, struct afb_wsj1_msg *msg)
 {
-	const char *json;
-	size_t jlen;
-	JSValue argv[2];
+	JSValue argv[2], func, ret;
 	struct holder *holder = closure;
-	JSValue func = JS_GetPropertyStr(holder->ctx, holder->value, "onEvent");
-	if (JS_IsFunction(holder->ctx, func)) {
-		argv[0] = JS_NewString(holder->ctx, event);
-		json = afb_wsj1_msg_object_s(msg, &jlen);
-		argv[1] = JS_ParseJSON(holder->ctx, json, jlen, "<wsj1.event>");
-		JS_Call(holder->ctx, func, holder->value, 2, argv);
-		JS_FreeValue(holder->ctx, argv[0]);
-		JS_FreeValue(holder->ctx, argv[1]);
+	JSContext *ctx = holder->ctx;
+
+	size_t jlen;
+
+	afb_wsj1_msg_object_s(msg, &jlen);
+	stats_received(holder->stats, jlen);
+	func = JS_DupValue(ctx, holder_handler(ctx, holder, H_onEvent));
+	if (JS_IsFunction(ctx, func)) {
+		argv[0] = JS_NewString(ctx, event);
+		argv[1] = msg_data(ctx, holder, msg, "<wsj1.event>");
+		ret = JS_Call(ctx, func, holder->value, 2, argv);
+		JS_FreeValue(ctx, ret);
+		JS_FreeValue(ctx, argv[0]);
+		JS_FreeValue(ctx, argv[1]);
 	}
+	JS_FreeValue(ctx, func);
+	afb_wsj1_msg_unref(msg);
 }
 
 struct afb_wsj1_itf itf_wsj1 = {
@@ -102,71 +607,492 @@ struct afb_wsj1_itf itf_wsj1 = {
 	.on_event = on_wsj1_event,
 };
 
+/* makes the reply {request: {status, info}, response: null}, takes ownership of info */
+static JSValue mkfailure(JSContext *ctx, const char *status, JSValue info)
+{
+	JSValue request = JS_NewObject(ctx);
+	JSValue obj = JS_NewObject(ctx);
+
+	JS_SetPropertyStr(ctx, request, "status", JS_NewString(ctx, status));
+	JS_SetPropertyStr(ctx, request, "info", info);
+	JS_SetPropertyStr(ctx, obj, "request", request);
+	JS_SetPropertyStr(ctx, obj, "response", JS_NULL);
+	return obj;
+}
+
+/* records the failure of sending a call of a batch from the pending exception */
+static void batch_fail(struct holdcb *batch, uint32_t index)
+{
+	JSContext *ctx = batch->ctx;
+	JSValue exc = JS_GetException(ctx);
+
+	batch_set(batch, index, mkfailure(ctx, "failed", JS_ToString(ctx, exc)));
+	JS_FreeValue(ctx, exc);
+}
+
+/**************************************************************/
+
+static void pending_expired(void *closure);
+
+/* records the sent call in the table of pending calls, with its deadline */
+static void pending_add(struct holder *holder, struct holdcb *holdcb)
+{
+	holdcb->holder = holder;
+	holdcb->next = holder->calls;
+	holdcb->prev = &holder->calls;
+	if (holder->calls)
+		holder->calls->prev = &holdcb->next;
+	holder->calls = holdcb;
+	holder->inflight++;
+	holder->inflight_bytes += holdcb->size;
+	if (holdcb->timeout)
+		holdcb->deadline = deadline_create(holdcb->start + 1000 * (uint64_t)holdcb->timeout,
+						pending_expired, holdcb);
+}
+
+static void pending_remove(struct holdcb *holdcb)
+{
+	struct holder *holder = holdcb->holder;
+
+	*holdcb->prev = holdcb->next;
+	if (holdcb->next)
+		holdcb->next->prev = holdcb->prev;
+	holder->inflight--;
+	holder->inflight_bytes -= holdcb->size;
+	holdcb->holder = 0;
+	if (holdcb->deadline) {
+		deadline_cancel(holdcb->deadline);
+		holdcb->deadline = 0;
+	}
+}
+
+/* delivers the failure with status to holdcb */
+static void holdcb_fail(struct holdcb *holdcb, const char *status, const char *info)
+{
+	JSContext *ctx = holdcb->ctx;
+	struct holdcb *batch = holdcb->batch;
+	JSValue obj, err, ret;
+
+	if (batch) {
+		obj = mkfailure(ctx, status, JS_NewString(ctx, info));
+		batch_set(batch, holdcb->index, obj);
+		killholdcb(holdcb);
+		return;
+	}
+	if (JS_IsUndefined(holdcb->reject)) {
+		obj = mkfailure(ctx, status, JS_NewString(ctx, info));
+		ret = JS_Call(ctx, holdcb->func, holdcb->thisobj, 1, &obj);
+		JS_FreeValue(ctx, obj);
+	}
+	else {
+		err = reply_error(ctx, JS_NewString(ctx, status), JS_NewString(ctx, info), JS_NULL);
+		ret = JS_Call(ctx, holdcb->reject, JS_UNDEFINED, 1, &err);
+		JS_FreeValue(ctx, err);
+	}
+	JS_FreeValue(ctx, ret);
+	killholdcb(holdcb);
+}
+
+/* completes the pending call with the status, its late reply will be dropped */
+static void pending_fail(struct holdcb *holdcb, const char *status, const char *info)
+{
+	struct holder *holder = holdcb->holder;
+
+	stats_reply(holder->stats, holdcb->vstats, holdcb->start, 1);
+	pending_remove(holdcb);
+	holdcb->expired = 1;
+	holdcb->next = holder->expireds;
+	holdcb->prev = &holder->expireds;
+	if (holder->expireds)
+		holder->expireds->prev = &holdcb->next;
+	holder->expireds = holdcb;
+	holdcb_fail(holdcb, status, info);
+}
+
+/**************************************************************/
+
+/*
+ * Calls exceeding the window of calls in flight wait in a FIFO, sent as
+ * replies arrive. The connection is writable when the FIFO is empty.
+ */
+
+void wsj1_onreply(void *closure, struct afb_wsj1_msg *msg);
+
+/* can a call of size bytes be sent now, at least one is always in flight */
+static int window_open(struct holder *holder, size_t size)
+{
+	return (!holder->window || holder->inflight < holder->window)
+		&& (!holder->window_bytes || !holder->inflight
+			|| holder->inflight_bytes + size <= holder->window_bytes);
+}
+
+/* sends the call and records it as pending */
+static int call_send(struct holder *holder, struct holdcb *holdcb, const char *api, const char *verb, const char *data)
+{
+	uint64_t start = stats_now();
+	int s = afb_wsj1_call_s(holder->item, api, verb, data, wsj1_onreply, holdcb);
+	if (s >= 0) {
+		holdcb->start = start;
+		holdcb->vstats = stats_call(holder->stats, api, verb, holdcb->size);
+		pending_add(holder, holdcb);
+	}
+	return s;
+}
+
+/* queues a copy of the call until the window opens */
+static int queue_add(struct holder *holder, struct holdcb *holdcb, const char *api, const char *verb, const char *data)
+{
+	size_t lapi = strlen(api) + 1, lverb = strlen(verb) + 1;
+	char *q = malloc(lapi + lverb + holdcb->size + 1);
+
+	if (!q)
+		return -1;
+	memcpy(q, api, lapi);
+	memcpy(q + lapi, verb, lverb);
+	memcpy(q + lapi + lverb, data, holdcb->size + 1);
+	holdcb->queued = q;
+	holdcb->next = 0;
+	*holder->queue_tail = holdcb;
+	holder->queue_tail = &holdcb->next;
+	holder->nqueued++;
+	holder->queued_bytes += holdcb->size;
+	return 0;
+}
+
+static struct holdcb *queue_pop(struct holder *holder)
+{
+	struct holdcb *holdcb = holder->queue;
+
+	holder->queue = holdcb->next;
+	if (!holder->queue)
+		holder->queue_tail = &holder->queue;
+	holder->nqueued--;
+	holder->queued_bytes -= holdcb->size;
+	return holdcb;
+}
+
+/* calls the functions waiting the queue to be empty */
+static void drains_notify(struct holder *holder)
+{
+	struct holdcb *holdcb, *next = holder->drains;
+
+	holder->drains = 0;
+	while ((holdcb = next)) {
+		next = holdcb->next;
+		holdcbcall(holdcb, 0, 0);
+	}
+}
+
+/* sends the queued calls fitting in the window */
+static void queue_pump(struct holder *holder)
+{
+	struct holdcb *holdcb;
+	const char *verb, *data;
+	char info[32];
+	JSValue self;
+	int s;
+
+	if (!holder->queue)
+		return;
+	/* the instance is held because failures call handlers */
+	self = JS_DupValue(holder->ctx, holder->value);
+	while (holder->queue && holder->item && window_open(holder, holder->queue->size)) {
+		holdcb = queue_pop(holder);
+		verb = holdcb->queued + strlen(holdcb->queued) + 1;
+		data = verb + strlen(verb) + 1;
+		s = call_send(holder, holdcb, holdcb->queued, verb, data);
+		free(holdcb->queued);
+		holdcb->queued = 0;
+		if (s < 0) {
+			snprintf(info, sizeof info, "failed with code %d", s);
+			holdcb_fail(holdcb, "failed", info);
+		}
+	}
+	if (!holder->queue)
+		drains_notify(holder);
+	JS_FreeValue(holder->ctx, self);
+}
+
+/**************************************************************/
+
+static void pending_expired(void *closure)
+{
+	struct holdcb *holdcb = closure;
+	struct holder *holder = holdcb->holder;
+	JSContext *ctx = holdcb->ctx;
+	JSValue self = JS_DupValue(ctx, holder->value);
+	char info[64];
+
+	/* released by the wheel */
+	holdcb->deadline = 0;
+	snprintf(info, sizeof info, "no reply after %u ms", (unsigned)holdcb->timeout);
+	pending_fail(holdcb, "timeout", info);
+	queue_pump(holder);
+	JS_FreeValue(ctx, self);
+}
+
+/* completes all the pending and queued calls of the holder with the status */
+static void pending_fail_all(struct holder *holder, const char *status, const char *info)
+{
+	struct holdcb *holdcb;
+	JSValue self = JS_DupValue(holder->ctx, holder->value);
+
+	while (holder->calls)
+		pending_fail(holder->calls, status, info);
+	while (holder->queue) {
+		holdcb = queue_pop(holder);
+		free(holdcb->queued);
+		holdcb->queued = 0;
+		holdcb_fail(holdcb, status, info);
+	}
+	drains_notify(holder);
+	JS_FreeValue(holder->ctx, self);
+}
+
+/* releases the failed calls whose reply will never come */
+static void expired_release(struct holder *holder)
+{
+	struct holdcb *holdcb;
+
+	while ((holdcb = holder->expireds)) {
+		holder->expireds = holdcb->next;
+		pool_free(holdcb, sizeof *holdcb);
+	}
+}
+
 void wsj1_onreply(void *closure, struct afb_wsj1_msg *msg)
 {
+	JSValue obj, request, err, ret;
+	struct holdcb *holdcb = closure;
+	struct holdcb *batch = holdcb->batch;
+	JSContext *ctx = holdcb->ctx;
+	uint32_t index = holdcb->index;
+	struct holder *holder = holdcb->holder;
 	const char *json;
 	size_t jlen;
-	JSValue argv[1];
-	struct holder *holder = closure;
-	struct holder *this_holder = holder->item;
 
+	/* dropped after the timeout or the disconnection */
+	if (holdcb->expired) {
+		*holdcb->prev = holdcb->next;
+		if (holdcb->next)
+			holdcb->next->prev = holdcb->prev;
+		pool_free(holdcb, sizeof *holdcb);
+		afb_wsj1_msg_unref(msg);
+		return;
+	}
 	json = afb_wsj1_msg_object_s(msg, &jlen);
-	argv[0] = JS_ParseJSON(holder->ctx, json, jlen, "<wsj1.event>");
-	JS_Call(holder->ctx, holder->value, this_holder->value, 1, argv);
-	JS_FreeValue(holder->ctx, argv[0]);
-	JS_FreeValue(holder->ctx, holder->value);
-	killholder(holder);
-	JS_FreeValue(this_holder->ctx, this_holder->value);
+	stats_received(holder->stats, jlen);
+	stats_reply(holder->stats, holdcb->vstats, holdcb->start, !afb_wsj1_msg_is_reply_ok(msg));
+	pending_remove(holdcb);
+	queue_pump(holder);
+	if (batch) {
+		obj = holdcb->projection ? projection_apply(ctx, holdcb->projection, json, jlen)
+				: msg_data(ctx, holder, msg, "<wsj1.reply>");
+		killholdcb(holdcb);
+		batch_set(batch, index, obj);
+		afb_wsj1_msg_unref(msg);
+		return;
+	}
+	if (JS_IsUndefined(holdcb->reject) || afb_wsj1_msg_is_reply_ok(msg)) {
+		obj = holdcb->projection ? projection_apply(ctx, holdcb->projection, json, jlen)
+				: msg_data(ctx, holder, msg, "<wsj1.reply>");
+		ret = JS_Call(ctx, holdcb->func, holdcb->thisobj, 1, &obj);
+	}
+	else {
+		obj = msg_data(ctx, NULL, msg, "<wsj1.reply>");
+		request = JS_GetPropertyStr(ctx, obj, "request");
+		err = reply_error(ctx,
+			JS_GetPropertyStr(ctx, request, "status"),
+			JS_GetPropertyStr(ctx, request, "info"),
+			JS_GetPropertyStr(ctx, obj, "response"));
+		ret = JS_Call(ctx, holdcb->reject, JS_UNDEFINED, 1, &err);
+		JS_FreeValue(ctx, err);
+		JS_FreeValue(ctx, request);
+	}
+	JS_FreeValue(ctx, ret);
+	JS_FreeValue(ctx, obj);
+	killholdcb(holdcb);
+	afb_wsj1_msg_unref(msg);
 }
 
-static JSValue wsj1_call(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+/* sends the call of args: api, verb, object, timeout, projection */
+static JSValue wsj1_send_call(JSContext *ctx, struct holder *holder, JSValueConst *args, struct holdcb *holdcb)
 {
 	int s;
-	const char *api, *verb, *json;
-	JSValue obj;
-	struct holder *funholder;
+	int32_t timeout = (int32_t)holder->timeout;
+	size_t length;
+	const char *api = 0, *verb = 0, *json = 0;
+	JSValue ret = JS_EXCEPTION;
+
+	api = JS_ToCString(ctx, args[0]);
+	if (!api)
+		goto end;
+	verb = JS_ToCString(ctx, args[1]);
+	if (!verb)
+		goto end;
+	if (!JS_IsUndefined(args[3])) {
+		if (JS_ToInt32(ctx, &timeout, args[3]) || timeout < 0) {
+			ret = JS_ThrowTypeError(ctx, "invalid timeout");
+			goto end;
+		}
+	}
+	if (!JS_IsUndefined(args[4]) && !JS_IsNull(args[4])) {
+		holdcb->projection = projection_create(ctx, args[4]);
+		if (!holdcb->projection)
+			goto end;
+	}
+	json = json_stringify(ctx, args[2], holder->json, &length);
+	if (!json)
+		goto end;
+	if (!holder->item) {
+		/* disconnected by a toJSON */
+		ret = JS_ThrowInternalError(ctx, "disconnected");
+		goto end;
+	}
+
+	/* sent at once or queued behind the calls waiting the window */
+	holdcb->size = length;
+	holdcb->timeout = (uint32_t)timeout;
+	if (!holder->queue && window_open(holder, length)) {
+		s = call_send(holder, holdcb, api, verb, json);
+		ret = s < 0 ? JS_ThrowInternalError(ctx, "failed with code %d", s) : JS_UNDEFINED;
+	}
+	else if (queue_add(holder, holdcb, api, verb, json) < 0)
+		ret = JS_ThrowOutOfMemory(ctx);
+	else
+		ret = JS_UNDEFINED;
+end:
+	if (json)
+		json_release(holder->json, json);
+	if (verb)
+		JS_FreeCString(ctx, verb);
+	if (api)
+		JS_FreeCString(ctx, api);
+	return ret;
+}
+
+static JSValue wsj1_call(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+{
+	struct holdcb *holdcb;
 	struct holder *holder = JS_GetOpaque(this_val, afb_wsj1_class_id);
 	struct afb_wsj1 *wsj1 = holder ? holder->item : 0;
+	JSValueConst args[5];
+	JSValue ret;
 
 	if (!wsj1 || argc < 4 || !JS_IsFunction(ctx, argv[3]))
-		goto error;
+		return JS_EXCEPTION;
 
-	api = JS_ToCString(ctx, argv[0]);
-	if (!api)
-		goto error;
-	verb = JS_ToCString(ctx, argv[1]);
-	if (!verb)
-		goto error2;
-	obj = JS_JSONStringify(ctx, argv[2], JS_UNDEFINED, JS_UNDEFINED);
-	json = JS_ToCString(ctx, obj);
-	JS_FreeValue(ctx, obj);
-	if (!json)
-		goto error3;
+	holdcb = mkholdcb(ctx, this_val, argv[3]);
+	if (!holdcb)
+		return JS_ThrowOutOfMemory(ctx);
 
-	obj = JS_DupValue(ctx, argv[3]);
-	funholder = mkholder(ctx, obj);
-	if (!funholder)
-		goto error4;
+	args[0] = argv[0];
+	args[1] = argv[1];
+	args[2] = argv[2];
+	args[3] = argv[4];
+	args[4] = argv[5];
+	ret = wsj1_send_call(ctx, holder, args, holdcb);
+	if (JS_IsException(ret))
+		killholdcb(holdcb);
+	return ret;
+}
 
-	funholder->item = holder;
-	s = afb_wsj1_call_s(wsj1, api, verb, json, wsj1_onreply, funholder);
-	JS_FreeCString(ctx, json);
-	if (s < 0)
-		goto error5;
-	JS_DupValue(ctx, this_val);
-	return JS_UNDEFINED;
+static JSValue wsj1_call_async(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+{
+	struct holdcb *holdcb;
+	struct holder *holder = JS_GetOpaque(this_val, afb_wsj1_class_id);
+	struct afb_wsj1 *wsj1 = holder ? holder->item : 0;
+	JSValue promise, ret;
 
-error5:
-	killholder(holder);
-error4:
-	JS_FreeValue(ctx, obj);
-	JS_FreeCString(ctx, json);
-error3:
-	JS_FreeCString(ctx, verb);
-error2:
-	JS_FreeCString(ctx, api);
-error:
-	return JS_EXCEPTION;
+	if (!wsj1)
+		return JS_ThrowInternalError(ctx, "disconnected");
+
+	holdcb = mkholdpromise(ctx, this_val, &promise);
+	if (!holdcb)
+		return promise;
+
+	ret = wsj1_send_call(ctx, holder, argv, holdcb);
+	if (JS_IsException(ret)) {
+		killholdcb(holdcb);
+		JS_FreeValue(ctx, promise);
+		return ret;
+	}
+	return promise;
+}
+
+/* sends the requests {api, verb, args, timeout} of the array argv[0],
+ * the array of replies is given to the function argv[1] or
+ * to the returned promise if no function is given */
+static JSValue wsj1_call_batch(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+{
+	struct holder *holder = JS_GetOpaque(this_val, afb_wsj1_class_id);
+	struct afb_wsj1 *wsj1 = holder ? holder->item : 0;
+	struct holdcb *batch, *call;
+	JSValue promise, req, ret, *reqs;
+	int64_t length;
+	uint32_t i, n;
+
+	if (!wsj1)
+		return JS_ThrowInternalError(ctx, "disconnected");
+	if (!JS_IsArray(ctx, argv[0]))
+		return JS_ThrowTypeError(ctx, "array expected");
+	if (!JS_IsUndefined(argv[1]) && !JS_IsFunction(ctx, argv[1]))
+		return JS_ThrowTypeError(ctx, "function expected");
+	ret = JS_GetPropertyStr(ctx, argv[0], "length");
+	if (JS_ToInt64(ctx, &length, ret)) {
+		JS_FreeValue(ctx, ret);
+		return JS_EXCEPTION;
+	}
+	JS_FreeValue(ctx, ret);
+	if (length < 0 || length > UINT32_MAX / 5)
+		return JS_ThrowRangeError(ctx, "too many requests");
+
+	/* get and check the requests: api, verb, args, timeout, projection */
+	n = (uint32_t)length;
+	reqs = js_malloc(ctx, (n ? n : 1) * 5 * sizeof *reqs);
+	if (!reqs)
+		return JS_EXCEPTION;
+	for (i = 0 ; i < n ; i++) {
+		req = JS_GetPropertyUint32(ctx, argv[0], i);
+		reqs[5 * i] = JS_GetProperty(ctx, req, atom_api);
+		reqs[5 * i + 1] = JS_GetProperty(ctx, req, atom_verb);
+		reqs[5 * i + 2] = JS_GetProperty(ctx, req, atom_args);
+		reqs[5 * i + 3] = JS_GetProperty(ctx, req, atom_timeout);
+		reqs[5 * i + 4] = JS_GetProperty(ctx, req, atom_projection);
+		JS_FreeValue(ctx, req);
+		if (!JS_IsString(reqs[5 * i]) || !JS_IsString(reqs[5 * i + 1])) {
+			n = i + 1;
+			ret = JS_ThrowTypeError(ctx, "api and verb strings expected at index %u", (unsigned)i);
+			goto end;
+		}
+	}
+
+	batch = mkbatch(ctx, this_val, argv[1], &promise);
+	if (!batch) {
+		ret = JS_IsException(promise) ? promise : JS_ThrowOutOfMemory(ctx);
+		goto end;
+	}
+
+	/* send the calls, failures are reported as results */
+	for (i = 0 ; i < n ; i++) {
+		call = mkbatchcall(batch, i);
+		if (!call) {
+			batch->remaining++;
+			JS_ThrowOutOfMemory(ctx);
+			batch_fail(batch, i);
+		}
+		else if (JS_IsException(wsj1_send_call(ctx, holder, &reqs[5 * i], call))) {
+			killholdcb(call);
+			batch_fail(batch, i);
+		}
+	}
+	ret = promise;
+	batch_release(batch);
+end:
+	for (i = 0 ; i < 5 * n ; i++)
+		JS_FreeValue(ctx, reqs[i]);
+	js_free(ctx, reqs);
+	return ret;
 }
 
 static JSValue wsj1_disconnect(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
@@ -176,10 +1102,26 @@ static JSValue wsj1_disconnect(JSContext *ctx, JSValueConst this_val, int argc,
 	if (!wsj1)
 		return JS_FALSE;
 	holder->item = 0;
+	pending_fail_all(holder, "disconnected", "disconnect");
 	afb_wsj1_unref(wsj1);
+	loop_unref();
+	holder_unpin(holder);
 	return JS_TRUE;
 }
 
+static JSValue wsj1_set_lazy(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+{
+	struct holder *holder = JS_GetOpaque(this_val, afb_wsj1_class_id);
+	int lazy = JS_ToBool(ctx, argv[0]);
+
+	if (!holder)
+		return JS_ThrowInternalError(ctx, "disconnected");
+	if (lazy < 0)
+		return JS_EXCEPTION;
+	holder->lazy = lazy;
+	return JS_UNDEFINED;
+}
+
 static JSValue wsj1_is_connected(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
 {
 	struct holder *holder = JS_GetOpaque(this_val, afb_wsj1_class_id);
@@ -187,6 +1129,282 @@ static JSValue wsj1_is_connected(JSContext *ctx, JSValueConst this_val, int argc
 	return JS_NewBool(ctx, !!wsj1);
 }
 
+/* the pending calls as an array of {verb, elapsed, timeout}, in ms */
+static JSValue wsj1_pending(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+{
+	struct holder *holder = JS_GetOpaque(this_val, afb_wsj1_class_id);
+	struct holdcb *holdcb;
+	JSValue arr, obj;
+	uint64_t now = stats_now();
+	uint32_t i = 0;
+
+	arr = JS_NewArray(ctx);
+	for (holdcb = holder ? holder->calls : 0 ; holdcb ; holdcb = holdcb->next) {
+		obj = JS_NewObject(ctx);
+		JS_SetPropertyStr(ctx, obj, "verb", JS_NewString(ctx, holdcb->vstats ? stats_name(holdcb->vstats) : "?"));
+		JS_SetPropertyStr(ctx, obj, "elapsed", JS_NewFloat64(ctx, (double)(now - holdcb->start) / 1000));
+		JS_SetPropertyStr(ctx, obj, "timeout", holdcb->timeout ? JS_NewUint32(ctx, holdcb->timeout) : JS_NULL);
+		JS_SetPropertyUint32(ctx, arr, i++, obj);
+	}
+	return arr;
+}
+
+/* sets the default timeout in ms of the calls, 0 for none */
+static JSValue wsj1_set_timeout(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+{
+	struct holder *holder = JS_GetOpaque(this_val, afb_wsj1_class_id);
+	int32_t timeout;
+
+	if (!holder)
+		return JS_ThrowInternalError(ctx, "disconnected");
+	if (JS_ToInt32(ctx, &timeout, argv[0]) || timeout < 0)
+		return JS_ThrowTypeError(ctx, "invalid timeout");
+	holder->timeout = (uint32_t)timeout;
+	return JS_UNDEFINED;
+}
+
+/* sets the window of calls in flight: argv[0] calls and argv[1] bytes, 0 for no limit */
+static JSValue wsj1_set_window(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+{
+	struct holder *holder = JS_GetOpaque(this_val, afb_wsj1_class_id);
+	int64_t calls = 0, bytes = 0;
+
+	if (!holder)
+		return JS_ThrowInternalError(ctx, "disconnected");
+	if ((!JS_IsUndefined(argv[0]) && JS_ToInt64(ctx, &calls, argv[0]))
+	 || (!JS_IsUndefined(argv[1]) && JS_ToInt64(ctx, &bytes, argv[1]))
+	 || calls < 0 || calls > UINT32_MAX || bytes < 0)
+		return JS_ThrowRangeError(ctx, "invalid window");
+	holder->window = (uint32_t)calls;
+	holder->window_bytes = (size_t)bytes;
+	queue_pump(holder);
+	return JS_UNDEFINED;
+}
+
+/* is the queue of calls waiting the window empty */
+static JSValue wsj1_writable(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+{
+	struct holder *holder = JS_GetOpaque(this_val, afb_wsj1_class_id);
+	return JS_NewBool(ctx, !holder || !holder->queue);
+}
+
+/* the calls waiting the window as {calls, bytes} */
+static JSValue wsj1_queued(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+{
+	struct holder *holder = JS_GetOpaque(this_val, afb_wsj1_class_id);
+	JSValue obj = JS_NewObject(ctx);
+
+	JS_SetPropertyStr(ctx, obj, "calls", JS_NewUint32(ctx, holder ? holder->nqueued : 0));
+	JS_SetPropertyStr(ctx, obj, "bytes", JS_NewInt64(ctx, holder ? (int64_t)holder->queued_bytes : 0));
+	return obj;
+}
+
+/* calls argv[0] or resolves the returned promise when the connection is writable */
+static JSValue wsj1_drain(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+{
+	struct holder *holder = JS_GetOpaque(this_val, afb_wsj1_class_id);
+	struct holdcb *holdcb;
+	JSValue promise = JS_UNDEFINED;
+
+	if (!JS_IsUndefined(argv[0]) && !JS_IsFunction(ctx, argv[0]))
+		return JS_ThrowTypeError(ctx, "function expected");
+	holdcb = JS_IsUndefined(argv[0]) ? mkholdpromise(ctx, this_val, &promise)
+					 : mkholdcb(ctx, this_val, argv[0]);
+	if (!holdcb)
+		return JS_IsException(promise) ? promise : JS_ThrowOutOfMemory(ctx);
+	if (!holder || !holder->queue)
+		holdcbcall(holdcb, 0, 0);
+	else {
+		holdcb->next = holder->drains;
+		holder->drains = holdcb;
+	}
+	return promise;
+}
+
+/* statistics of the calls, with the buckets of the histograms if argv[0] is true */
+static JSValue wsj1_stats(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+{
+	struct holder *holder = JS_GetOpaque(this_val, afb_wsj1_class_id);
+	return holder ? stats_get(ctx, holder->stats, holder->inflight, JS_ToBool(ctx, argv[0]))
+		: JS_NewObject(ctx);
+}
+
+static JSValue wsj1_reset_stats(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+{
+	struct holder *holder = JS_GetOpaque(this_val, afb_wsj1_class_id);
+	if (holder)
+		stats_reset(holder->stats);
+	return JS_UNDEFINED;
+}
+
+/**************************************************************/
+
+/* servers of websocket clients, referenced by their pending upgrades */
+struct server
+{
+	struct server *next, *previous;
+	int fd;
+	int used;
+	int refcount;
+	struct prefork *prefork;
+	JSContext *ctx;
+	JSValue thisobj;
+	JSValue func;
+	char uri[];
+};
+
+static __thread struct server *servers;
+
+static void server_unref(struct server *srv)
+{
+	if (!--srv->refcount) {
+		JS_FreeValue(srv->ctx, srv->thisobj);
+		JS_FreeValue(srv->ctx, srv->func);
+		JS_FreeContext(srv->ctx);
+		pool_free(srv, sizeof *srv + 1 + strlen(srv->uri));
+	}
+}
+
+/* creates an AFBWSJ1 for the upgraded client and gives it to the function */
+static void wsj1_onupgrade(void *closure, int fd)
+{
+	struct server *srv = closure;
+	JSContext *ctx = srv->ctx;
+	struct holder *holder = 0;
+	JSValue obj;
+
+	if (fd >= 0 && srv->used) {
+		obj = JS_NewObjectClass(ctx, afb_wsj1_class_id);
+		holder = JS_IsObject(obj) ? mkholder(ctx, obj) : 0;
+		if (holder) {
+			holder->item = server_wsj1(fd, &itf_wsj1, holder);
+			if (!holder->item) {
+				killholder(JS_GetRuntime(ctx), holder);
+				holder = 0;
+			}
+			else {
+				/* the client lives until it disconnects */
+				JS_SetOpaque(obj, holder);
+				holder->pinned = 1;
+				JS_DupValue(ctx, obj);
+				JS_SetPropertyStr(ctx, obj, "uri", JS_NewString(ctx, srv->uri));
+				loop_ref();
+				JS_FreeValue(ctx, JS_Call(ctx, srv->func, srv->thisobj, 1, &obj));
+			}
+		}
+		JS_FreeValue(ctx, obj);
+	}
+	if (fd >= 0 && !holder)
+		close(fd);
+	server_unref(srv);
+}
+
+static int wsj1_onclient(void *closure, int fd)
+{
+	struct server *srv = closure;
+
+	if (srv->used) {
+		srv->refcount++;
+		if (ws_upgrade(fd, "x-afb-ws-json1", wsj1_onupgrade, srv) < 0)
+			server_unref(srv);
+	}
+	return -1;
+}
+
+/* serves uri, calling argv[1] with the AFBWSJ1 of each client, or stops
+ * serving it if argv[1] is null. The options argv[2] can be
+ * {workers: count, supervise: bool} for serving on pre-forked processes */
+static JSValue wsj1_serve(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+{
+	int s, workers = 0, supervise = 0;
+	const char *uri;
+	struct server *srv;
+	JSValue opt;
+
+	if (JS_IsObject(argv[2])) {
+		opt = JS_GetPropertyStr(ctx, argv[2], "workers");
+		s = JS_ToInt32(ctx, &workers, opt);
+		JS_FreeValue(ctx, opt);
+		if (s < 0)
+			return JS_EXCEPTION;
+		opt = JS_GetPropertyStr(ctx, argv[2], "supervise");
+		supervise = JS_ToBool(ctx, opt);
+		JS_FreeValue(ctx, opt);
+		if (supervise < 0)
+			return JS_EXCEPTION;
+	}
+
+	uri = JS_ToCString(ctx, argv[0]);
+	if (!uri)
+		return JS_ThrowTypeError(ctx, "string expected");
+	for (srv = servers ; srv && strcmp(srv->uri, uri) ; srv = srv->next);
+	if (JS_IsUndefined(argv[1]) || JS_IsNull(argv[1])) {
+		JS_FreeCString(ctx, uri);
+		if (srv) {
+			/* close the current server */
+			srv->used = 0;
+			if (srv->next)
+				srv->next->previous = srv->previous;
+			if (srv->previous)
+				srv->previous->next = srv->next;
+			else
+				servers = srv->next;
+			if (srv->prefork)
+				prefork_stop(srv->prefork);
+			else if (srv->fd > 0)
+				close(srv->fd);
+			server_unref(srv);
+			loop_unref();
+		}
+		return JS_UNDEFINED;
+	}
+	if (!JS_IsFunction(ctx, argv[1])) {
+		JS_FreeCString(ctx, uri);
+		return JS_ThrowTypeError(ctx, "function or null expected");
+	}
+	if (srv) {
+		JS_FreeCString(ctx, uri);
+		JS_FreeValue(srv->ctx, srv->thisobj);
+		JS_FreeValue(srv->ctx, srv->func);
+		JS_FreeContext(srv->ctx);
+		srv->thisobj = JS_DupValue(ctx, this_val);
+		srv->func = JS_DupValue(ctx, argv[1]);
+		srv->ctx = JS_DupContext(ctx);
+	}
+	else {
+		srv = pool_alloc(sizeof *srv + 1 + strlen(uri));
+		if (!srv) {
+			JS_FreeCString(ctx, uri);
+			return JS_ThrowOutOfMemory(ctx);
+		}
+		strcpy(srv->uri, uri);
+		JS_FreeCString(ctx, uri);
+		srv->used = 0;
+		srv->prefork = 0;
+		if (workers <= 0)
+			s = client_serve(srv->uri, wsj1_onclient, srv);
+		else
+			s = prefork_serve(srv->uri, workers, supervise, wsj1_onclient, srv, &srv->prefork);
+		if (s < 0) {
+			pool_free(srv, sizeof *srv + 1 + strlen(srv->uri));
+			if (s == -EBUSY)
+				return JS_ThrowInternalError(ctx, "workers already spawned, serve with workers before running the loop");
+			return JS_ThrowInternalError(ctx, "failed with code %d", s);
+		}
+		srv->ctx = JS_DupContext(ctx);
+		srv->func = JS_DupValue(ctx, argv[1]);
+		srv->thisobj = JS_DupValue(ctx, this_val);
+		srv->fd = s;
+		srv->used = 1;
+		srv->refcount = 1;
+		srv->previous = 0;
+		srv->next = servers;
+		servers = srv;
+		loop_ref();
+	}
+	return JS_UNDEFINED;
+}
+
 static JSValue AFBWSJ1_constructor(JSContext *ctx, JSValueConst new_target, int argc, JSValueConst *argv)
 {
 	const char *uri;
@@ -221,10 +1439,11 @@ static JSValue AFBWSJ1_constructor(JSContext *ctx, JSValueConst new_target, int
 
 	JS_SetOpaque(obj, holder);
 	JS_FreeCString(ctx, uri);
+	loop_ref();
 	return obj;
 
 error4:
-	killholder(holder);
+	killholder(JS_GetRuntime(ctx), holder);
 error3:
 	JS_FreeValue(ctx, obj);
 error2:
@@ -239,21 +1458,51 @@ static void AFBWSJ1_finalizer(JSRuntime *rt, JSValue val)
 	if (holder) {
 		struct afb_wsj1 *wsj1 = holder ? holder->item : 0;
 		holder->item = 0;
-		if (wsj1)
+		if (wsj1) {
 			afb_wsj1_unref(wsj1);
-		killholder(holder);
+			loop_unref();
+		}
+		killholder(rt, holder);
 	}
 }
 
+static void AFBWSJ1_mark(JSRuntime *rt, JSValueConst val, JS_MarkFunc *mark_func)
+{
+	struct holder *holder = JS_GetOpaque(val, afb_wsj1_class_id);
+	int i;
+
+	if (holder)
+		for (i = 0 ; i < H_count ; i++) {
+			JS_MarkValue(rt, holder->handlers[i], mark_func);
+			JS_MarkValue(rt, holder->cache[i], mark_func);
+		}
+}
+
 static JSClassDef afb_wsj1_class = {
 	.class_name = "AFBWSJ1",
 	.finalizer = AFBWSJ1_finalizer,
+	.gc_mark = AFBWSJ1_mark,
 }; 
 
 static const JSCFunctionListEntry afb_wsj1_proto_funcs[] = {
 	JS_CFUNC_DEF("isConnected_", 0, wsj1_is_connected),
 	JS_CFUNC_DEF("disconnect_", 0, wsj1_disconnect),
-	JS_CFUNC_DEF("call_", 4, wsj1_call),
+	JS_CFUNC_DEF("setLazy_", 1, wsj1_set_lazy),
+	JS_CFUNC_DEF("call_", 6, wsj1_call),
+	JS_CFUNC_DEF("callAsync_", 5, wsj1_call_async),
+	JS_CFUNC_DEF("callBatch_", 2, wsj1_call_batch),
+	JS_CFUNC_DEF("pending_", 0, wsj1_pending),
+	JS_CFUNC_DEF("setTimeout_", 1, wsj1_set_timeout),
+	JS_CFUNC_DEF("setWindow_", 2, wsj1_set_window),
+	JS_CFUNC_DEF("writable_", 0, wsj1_writable),
+	JS_CFUNC_DEF("queued_", 0, wsj1_queued),
+	JS_CFUNC_DEF("drain_", 1, wsj1_drain),
+	JS_CFUNC_DEF("stats_", 1, wsj1_stats),
+	JS_CFUNC_DEF("resetStats_", 0, wsj1_reset_stats),
+};
+
+static const JSCFunctionListEntry afb_wsj1_funcs[] = {
+	JS_CFUNC_DEF("serve_", 3, wsj1_serve),
 };
 
 int AFBWSJ1_init(JSContext *ctx, JSModuleDef *m)
@@ -261,16 +1510,30 @@ int AFBWSJ1_init(JSContext *ctx, JSModuleDef *m)
 	JSValue proto, afbwsj1;
 
 	/* create the class */
-	JS_NewClassID(&afb_wsj1_class_id);
+	class_id_init(&afb_wsj1_class_id);
 	JS_NewClass(JS_GetRuntime(ctx), afb_wsj1_class_id, &afb_wsj1_class);
 
 	proto = JS_NewObject(ctx);
 	JS_SetPropertyFunctionList(ctx, proto, afb_wsj1_proto_funcs, countof(afb_wsj1_proto_funcs));
+	define_handlers(ctx, proto);
+	atom_api = JS_NewAtom(ctx, "api");
+	atom_verb = JS_NewAtom(ctx, "verb");
+	atom_args = JS_NewAtom(ctx, "args");
+	atom_timeout = JS_NewAtom(ctx, "timeout");
+	atom_projection = JS_NewAtom(ctx, "projection");
 
 	afbwsj1 = JS_NewCFunction2(ctx, AFBWSJ1_constructor, "AFBWSJ1", 1, JS_CFUNC_constructor, 0);
 	/* set proto.constructor and ctor.prototype */
 	JS_SetConstructor(ctx, afbwsj1, proto);
 	JS_SetClassProto(ctx, afb_wsj1_class_id, proto);
+	JS_SetPropertyFunctionList(ctx, afbwsj1, afb_wsj1_funcs, countof(afb_wsj1_funcs));
+
+	/* create the class of incoming calls */
+	class_id_init(&afb_wsj1_msg_class_id);
+	JS_NewClass(JS_GetRuntime(ctx), afb_wsj1_msg_class_id, &afb_wsj1_msg_class);
+	proto = JS_NewObject(ctx);
+	JS_SetPropertyFunctionList(ctx, proto, afb_wsj1_msg_proto_funcs, countof(afb_wsj1_msg_proto_funcs));
+	JS_SetClassProto(ctx, afb_wsj1_msg_class_id, proto);
 			
 	JS_SetModuleExport(ctx, m, "AFBWSJ1", afbwsj1);
 	return 0;
@@ -3,8 +3,32 @@ import * as os from 'os';
 
 export var AFBWSJ1 = afbqjs.AFBWSJ1;
 export var AFBWSAPI = afbqjs.AFBWSAPI;
+export var AFBWSAPIGroup = afbqjs.AFBWSAPIGroup;
 export var afb_loop = afbqjs.afb_loop; /* TODO remove ? */
 export var afb_break = afbqjs.afb_break; /* TODO remove ? */
+export var afb_pool_stats = afbqjs.afb_pool_stats;
+export var afb_now = afbqjs.afb_now;
+/* name of the kernel parsing received JSON: avx2, sse4.2, neon, scalar or quickjs */
+export var afb_json_kernel = afbqjs.afb_json_kernel;
+/* parses a string or an ArrayBuffer of UTF-8 as received JSON is, with the same results as JSON.parse */
+export var afb_json_parse = afbqjs.afb_json_parse;
+/* payloads are JSON serialized once: new Payload(obj) is sent as is by calls, replies and events */
+export var Payload = afbqjs.Payload;
+/* payloads go to workers by id: post afb_payload_export(p), import it once with afb_payload_import(id)
+ * within a minute, exports not imported in time are released */
+export var afb_payload_export = afbqjs.afb_payload_export;
+export var afb_payload_import = afbqjs.afb_payload_import;
+
+/**************************************************************************************
+ * This section integrates the AFB event loop in the main loop of QuickJS
+ *
+ * While connections or servers exist, the file descriptor of the AFB loop
+ * is watched by the QuickJS loop that dispatches its events and the pending
+ * jobs. So timers, handlers, promises and AFB traffic are mixed freely.
+ */
+afbqjs.afb_watch(function(active) {
+	os.setReadHandler(afbqjs.afb_fd(), active ? afbqjs.afb_dispatch : null);
+});
 
 /**************************************************************************************
  * This section events to wait
@@ -59,7 +83,6 @@ function enter_call() {
 
 function leave_call() {
 	pending_calls--;
-	afb_break();
 }
 
 export function expect_event() {
@@ -69,15 +92,18 @@ export function expect_event() {
 function got_event() {
 	if (expected_events)
 		expected_events--;
-	afb_break();
 }
 
 
 /**************************************************************************************
  * This section defines AFBWSJ1 calls
+ *
+ * Calls can give a projection, a list of paths like "response.values[3]":
+ * the reply {request, response} is then the object of the values of the
+ * paths, keyed by path, extracted without parsing the rest.
  */
  
-AFBWSJ1.prototype.call = function(api, verb, obj, fun) {
+AFBWSJ1.prototype.call = function(api, verb, obj, fun, timeout, projection) {
 	enter_call();
 	this.call_(api, verb, obj, function(r) {
 		try {
@@ -86,11 +112,36 @@ AFBWSJ1.prototype.call = function(api, verb, obj, fun) {
 		finally {
 			leave_call();
 		}
+	}, timeout, projection);
+};
+
+AFBWSJ1.prototype.callBatch = function(reqs, fun) {
+	if (!fun)
+		return this.callBatch_(reqs);
+	enter_call();
+	this.callBatch_(reqs, function(r) {
+		try {
+			fun(r);
+		}
+		finally {
+			leave_call();
+		}
 	});
 };
 
+AFBWSJ1.prototype.callAsync = AFBWSJ1.prototype.callAsync_;
 AFBWSJ1.prototype.isConnected = AFBWSJ1.prototype.isConnected_;
 AFBWSJ1.prototype.disconnect = AFBWSJ1.prototype.disconnect_;
+AFBWSJ1.prototype.setLazy = AFBWSJ1.prototype.setLazy_;
+AFBWSJ1.prototype.pending = AFBWSJ1.prototype.pending_;
+AFBWSJ1.prototype.setTimeout = AFBWSJ1.prototype.setTimeout_;
+AFBWSJ1.prototype.setWindow = AFBWSJ1.prototype.setWindow_;
+AFBWSJ1.prototype.writable = AFBWSJ1.prototype.writable_;
+AFBWSJ1.prototype.queued = AFBWSJ1.prototype.queued_;
+AFBWSJ1.prototype.drain = AFBWSJ1.prototype.drain_;
+AFBWSJ1.prototype.stats = AFBWSJ1.prototype.stats_;
+AFBWSJ1.prototype.resetStats = AFBWSJ1.prototype.resetStats_;
+AFBWSJ1.serve = AFBWSJ1.serve_;
 
 AFBWSJ1.prototype.onEvent = function (e, o) {
 	print("received event " + e + ": " + JSON.stringify(o) + "\n");
@@ -104,9 +155,12 @@ AFBWSJ1.prototype.onCall = function (msg, api, verb, data) {
 
 /**************************************************************************************
  * This section defines AFBWSAPI calls
+ *
+ * As for AFBWSJ1, calls can give a projection but its paths start at
+ * the response, like "values[3]".
  */
 
-AFBWSAPI.prototype.call = function(verb, obj, fun) {
+AFBWSAPI.prototype.call = function(verb, obj, fun, timeout, projection) {
 	enter_call();
 	this.call_(verb, obj, function(res,err,info) {
 		try {
@@ -115,7 +169,7 @@ AFBWSAPI.prototype.call = function(verb, obj, fun) {
 		finally {
 			leave_call();
 		}
-	});
+	}, undefined, undefined, undefined, timeout, projection);
 };
 
 AFBWSAPI.prototype.describe = function(fun) {
@@ -126,8 +180,36 @@ AFBWSAPI.prototype.describe = function(fun) {
 	});
 };
 
+AFBWSAPI.prototype.callBatch = function(reqs, fun) {
+	if (!fun)
+		return this.callBatch_(reqs);
+	enter_call();
+	this.callBatch_(reqs, function(r) {
+		try {
+			fun(r);
+		}
+		finally {
+			leave_call();
+		}
+	});
+};
+
+AFBWSAPI.prototype.callAsync = AFBWSAPI.prototype.callAsync_;
 AFBWSAPI.prototype.isConnected = AFBWSAPI.prototype.isConnected_;
+AFBWSAPI.prototype.inflight = AFBWSAPI.prototype.inflight_;
+AFBWSAPI.prototype.pending = AFBWSAPI.prototype.pending_;
+AFBWSAPI.prototype.setTimeout = AFBWSAPI.prototype.setTimeout_;
+AFBWSAPI.prototype.setWindow = AFBWSAPI.prototype.setWindow_;
+AFBWSAPI.prototype.writable = AFBWSAPI.prototype.writable_;
+AFBWSAPI.prototype.queued = AFBWSAPI.prototype.queued_;
+AFBWSAPI.prototype.drain = AFBWSAPI.prototype.drain_;
+AFBWSAPI.prototype.stats = AFBWSAPI.prototype.stats_;
+AFBWSAPI.prototype.resetStats = AFBWSAPI.prototype.resetStats_;
 AFBWSAPI.prototype.disconnect = AFBWSAPI.prototype.disconnect_;
+AFBWSAPI.prototype.setLazy = AFBWSAPI.prototype.setLazy_;
+AFBWSAPI.prototype.on = AFBWSAPI.prototype.on_;
+AFBWSAPI.prototype.eventName = AFBWSAPI.prototype.eventName_;
+AFBWSAPI.prototype.coalesce = AFBWSAPI.prototype.coalesce_;
 AFBWSAPI.prototype.serve = AFBWSAPI.prototype.serve_;
 AFBWSAPI.prototype.sessionCreate = AFBWSAPI.prototype.sessionCreate_;
 AFBWSAPI.prototype.sessionRemove = AFBWSAPI.prototype.sessionRemove_;
@@ -165,7 +247,7 @@ AFBWSAPI.prototype.onEventUnsubscribe = function () {
 	print("onEventUnsubscribe(" + id + ")\n");
 };
 
-AFBWSAPI.prototype.onEventPush = function (id, obj) {
+AFBWSAPI.prototype.onEventPush = function (id, obj, name) {
 	print("onEventPush(" + id + ") " + JSON.stringify(obj) + "\n");
 	got_event();
 	if (this.unexpected) {
@@ -174,6 +256,17 @@ AFBWSAPI.prototype.onEventPush = function (id, obj) {
 	}
 };
 
+AFBWSAPI.prototype.onEventBatch = function (batch) {
+	var ws = this;
+	batch.forEach(function(item) {
+		if (item.dropped)
+			print("onEventBatch(" + item.id + ") dropped " + item.dropped + "\n");
+		item.values.forEach(function(obj) {
+			ws.onEventPush(item.id, obj, item.name);
+		});
+	});
+};
+
 AFBWSAPI.prototype.onEventBroadcast = function (name,obj,hops,uuid) {
 	print("onEventBroadcast(" + name + ") " + JSON.stringify(obj) + "\n");
 	got_event();
@@ -202,3 +295,174 @@ AFBWSAPI.prototype.onTokenRemove = function (id) {
 AFBWSAPI.prototype.onDescribe = function (hndl) {
 	print("onDescribe\n");
 };
+
+/**************************************************************************************
+ * This section defines AFBWSAPIGroup, subscribers pushed together
+ *
+ * add(ws, eventid) makes the event eventid of the connection ws a member,
+ * push(obj) pushes obj to all the members and returns the count of pushes.
+ * Members leave the group when their connection hangs up.
+ */
+AFBWSAPIGroup.prototype.add = AFBWSAPIGroup.prototype.add_;
+AFBWSAPIGroup.prototype.remove = AFBWSAPIGroup.prototype.remove_;
+AFBWSAPIGroup.prototype.push = AFBWSAPIGroup.prototype.push_;
+AFBWSAPIGroup.prototype.count = AFBWSAPIGroup.prototype.count_;
+AFBWSAPIGroup.prototype.clear = AFBWSAPIGroup.prototype.clear_;
+
+/**************************************************************************************
+ * This section defines AFBWSAPIPool, calls spread over several connections
+ *
+ * Each call goes to the connected member having the fewest calls in flight
+ * or queued.
+ * Sessions and tokens are created on every member, members that hung up are
+ * reconnected (at most once per second) and get them again, as well as the
+ * timeout, the window and the lazy flag.
+ */
+
+export function AFBWSAPIPool(uri, n) {
+	this.uri = uri;
+	this.members = [];
+	this.retries = [];
+	this.sessions = new Map();
+	this.tokens = new Map();
+	this.timeout = 0;
+	this.window = [0, 0];
+	this.lazy = false;
+	this.closed = false;
+	for (var i = 0 ; i < (n || 1) ; i++) {
+		this.members.push(new AFBWSAPI(uri));
+		this.retries.push(0);
+	}
+}
+
+AFBWSAPIPool.prototype.reconnect_ = function(i) {
+	var now = Date.now();
+	if (this.closed || now < this.retries[i])
+		return null;
+	this.retries[i] = now + 1000;
+	try {
+		var m = new AFBWSAPI(this.uri);
+	}
+	catch (e) {
+		return null;
+	}
+	this.sessions.forEach(function(name, id) { m.sessionCreate(id, name); });
+	this.tokens.forEach(function(name, id) { m.tokenCreate(id, name); });
+	m.setTimeout(this.timeout);
+	m.setWindow(this.window[0], this.window[1]);
+	m.setLazy(this.lazy);
+	this.members[i] = m;
+	return m;
+};
+
+AFBWSAPIPool.prototype.pick = function() {
+	var best = null, min = Infinity;
+	for (var i = 0 ; i < this.members.length && min ; i++) {
+		var m = this.members[i];
+		if (!m.isConnected() && !(m = this.reconnect_(i)))
+			continue;
+		var n = m.inflight() + m.queued().calls;
+		if (n < min) {
+			best = m;
+			min = n;
+		}
+	}
+	if (!best)
+		throw new Error("disconnected");
+	return best;
+};
+
+AFBWSAPIPool.prototype.forEach_ = function(fun) {
+	this.members.forEach(function(m) {
+		if (m.isConnected())
+			fun(m);
+	});
+};
+
+AFBWSAPIPool.prototype.call = function(verb, obj, fun, timeout, projection) {
+	return this.pick().call(verb, obj, fun, timeout, projection);
+};
+
+AFBWSAPIPool.prototype.callAsync = function(verb, obj, session, token, creds, timeout, projection) {
+	return this.pick().callAsync(verb, obj, session, token, creds, timeout, projection);
+};
+
+AFBWSAPIPool.prototype.callBatch = function(reqs, fun) {
+	return this.pick().callBatch(reqs, fun);
+};
+
+AFBWSAPIPool.prototype.describe = function(fun) {
+	return this.pick().describe(fun);
+};
+
+AFBWSAPIPool.prototype.sessionCreate = function(id, name) {
+	this.sessions.set(id, name);
+	this.forEach_(function(m) { m.sessionCreate(id, name); });
+};
+
+AFBWSAPIPool.prototype.sessionRemove = function(id) {
+	this.sessions.delete(id);
+	this.forEach_(function(m) { m.sessionRemove(id); });
+};
+
+AFBWSAPIPool.prototype.tokenCreate = function(id, name) {
+	this.tokens.set(id, name);
+	this.forEach_(function(m) { m.tokenCreate(id, name); });
+};
+
+AFBWSAPIPool.prototype.tokenRemove = function(id) {
+	this.tokens.delete(id);
+	this.forEach_(function(m) { m.tokenRemove(id); });
+};
+
+AFBWSAPIPool.prototype.inflight = function() {
+	var n = 0;
+	this.forEach_(function(m) { n += m.inflight(); });
+	return n;
+};
+
+AFBWSAPIPool.prototype.pending = function() {
+	var r = [];
+	this.forEach_(function(m) { r = r.concat(m.pending()); });
+	return r;
+};
+
+AFBWSAPIPool.prototype.setTimeout = function(timeout) {
+	this.timeout = timeout;
+	this.forEach_(function(m) { m.setTimeout(timeout); });
+};
+
+/* sets the window of each member */
+AFBWSAPIPool.prototype.setWindow = function(calls, bytes) {
+	this.window = [calls, bytes];
+	this.forEach_(function(m) { m.setWindow(calls, bytes); });
+};
+
+AFBWSAPIPool.prototype.writable = function() {
+	return this.members.some(function(m) { return m.isConnected() && m.writable(); });
+};
+
+/* the statistics of the connected members */
+AFBWSAPIPool.prototype.stats = function(buckets) {
+	var r = [];
+	this.forEach_(function(m) { r.push(m.stats(buckets)); });
+	return r;
+};
+
+AFBWSAPIPool.prototype.resetStats = function() {
+	this.forEach_(function(m) { m.resetStats(); });
+};
+
+AFBWSAPIPool.prototype.isConnected = function() {
+	return this.members.some(function(m) { return m.isConnected(); });
+};
+
+AFBWSAPIPool.prototype.setLazy = function(lazy) {
+	this.lazy = lazy;
+	this.forEach_(function(m) { m.setLazy(lazy); });
+};
+
+AFBWSAPIPool.prototype.disconnect = function() {
+	this.closed = true;
+	this.forEach_(function(m) { m.disconnect(); });
+};
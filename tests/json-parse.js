@@ -0,0 +1,153 @@
+/**************************************************************************************
+ * test of the parsing of received JSON
+ *
+ * usage: AFB_JSON_KERNEL=KERNEL afb-jscli json-parse.js
+ *
+ * The results of afb_json_parse, using the kernel of AFB_JSON_KERNEL (avx2,
+ * sse4.2, neon or scalar), are compared with the ones of JSON.parse of QuickJS
+ * for texts having escapes across the blocks of 64 bytes, runs of backslashes,
+ * numbers at the limits, duplicate and numeric keys and invalid UTF-8.
+ * Exits with 77 when the kernel is not supported by the CPU.
+ */
+import * as AFB from 'afb';
+import * as std from 'std';
+
+var asked = std.getenv("AFB_JSON_KERNEL");
+var kernel = AFB.afb_json_kernel();
+if (asked && asked != kernel) {
+	print("kernel " + asked + " not supported, skipped");
+	std.exit(77);
+}
+
+var count = 0;
+var failures = 0;
+
+/* deep equality, telling -0 from 0 and the order of keys */
+function same(a, b) {
+	var ka, kb, i;
+
+	if (typeof a != typeof b)
+		return false;
+	if (typeof a == "number")
+		return Object.is(a, b);
+	if (a === null || b === null || typeof a != "object")
+		return a === b;
+	if (Array.isArray(a) != Array.isArray(b))
+		return false;
+	ka = Object.keys(a);
+	kb = Object.keys(b);
+	if (ka.length != kb.length)
+		return false;
+	for (i = 0 ; i < ka.length ; i++)
+		if (ka[i] !== kb[i] || !same(a[ka[i]], b[kb[i]]))
+			return false;
+	return true;
+}
+
+function outcome(parse, text) {
+	try {
+		return { value: parse(text) };
+	}
+	catch (e) {
+		return { error: e.name };
+	}
+}
+
+function report(text, got, expected) {
+	failures++;
+	if (failures <= 20)
+		print("FAIL " + JSON.stringify(String(text).substring(0, 200))
+			+ "\n  got      " + JSON.stringify(got)
+			+ "\n  expected " + JSON.stringify(expected));
+}
+
+/* the text parsed by the kernel and by QuickJS */
+function check(text) {
+	var got = outcome(AFB.afb_json_parse, text);
+	var expected = outcome(JSON.parse, text);
+
+	count++;
+	if (got.error !== expected.error || !same(got.value, expected.value))
+		report(text, got, expected);
+}
+
+/* the bytes parsed by the kernel, expected is the text they encode or undefined if invalid */
+function check_bytes(bytes, expected) {
+	var got = outcome(AFB.afb_json_parse, new Uint8Array(bytes).buffer);
+	var exp = expected === undefined ? { error: "SyntaxError" } : outcome(JSON.parse, expected);
+
+	count++;
+	if (got.error !== exp.error || !same(got.value, exp.value))
+		report(bytes, got, exp);
+}
+
+var escapes = [ '\\"', '\\\\', '\\/', '\\b', '\\n', '\\t', '\\u0041', '\\u00e9', '\\u20ac', '\\ud83d\\ude00',
+		'\\ud800', '\\udc00', '\\u12', '\\x', '\\' ];
+var i, j, n, pad, text;
+
+/* escapes across the boundaries of blocks, in values and in keys */
+for (pad = 50 ; pad <= 72 ; pad++)
+	for (i = 0 ; i < escapes.length ; i++) {
+		text = "a".repeat(pad) + escapes[i] + "b";
+		check('"' + text + '"');
+		check('["' + text + '",{"' + text + '":"' + text + '"}]');
+		check('{"k":"' + escapes[i].repeat(pad) + '"}');
+	}
+
+/* runs of backslashes ending strings or not, at any alignment */
+for (n = 0 ; n <= 70 ; n++)
+	for (pad = 0 ; pad < 64 ; pad += 7) {
+		check('["' + "x".repeat(pad) + "\\".repeat(n) + '"]');
+		check('["' + "x".repeat(pad) + "\\".repeat(n) + '",' + ' '.repeat(pad) + '"\\\\"]');
+		check('{"' + "\\".repeat(n) + '":' + "\\".repeat(n) + '"}');
+	}
+
+/* quotes and structural characters in strings across blocks */
+for (pad = 0 ; pad < 130 ; pad++) {
+	check(' '.repeat(pad) + '{"a":"[{,:}]","b":["\\"",",","\\\\"]}');
+	check('["' + '{'.repeat(pad) + '",' + '"' + ']'.repeat(pad) + '"]');
+}
+
+/* numbers at the limits */
+[ "0", "-0", "0.0", "-0.0", "-0e0", "1", "-1", "10", "999999999999999", "-999999999999999",
+  "123456789012345", "1234567890123456", "-1234567890123456", "9007199254740991",
+  "9007199254740992", "9007199254740993", "18446744073709551615", "18446744073709551616",
+  "123456789012345678901234567890", "1" + "0".repeat(400), "0." + "1".repeat(100),
+  "1e308", "1.7976931348623157e308", "1.7976931348623159e308", "1e309", "-1e309",
+  "5e-324", "2e-324", "1e-400", "-1e-400", "1E2", "1e+2", "1e-2", "1.5E-2", "0.1", "0.30000000000000004",
+  "00", "01", "-01", "1.", ".5", "-", "+1", "1e", "1e+", "1.e5", "0x10", "Infinity", "NaN", "1_000",
+  "-a", "2.5e", " 7 ", "[1,2.5,-0,1e3]" ].forEach(function(t) {
+	check(t);
+	check("[" + t + "]");
+	check('{"n":' + t + "}");
+});
+
+/* keys: duplicates keep the last value, numeric keys come first in ascending order */
+[ '{"a":1,"a":2}', '{"a":1,"b":2,"a":3}', '{"a":{"x":1},"a":{"y":2}}', '{"2":"b","1":"a","x":0,"0":"z"}',
+  '{"10":1,"9":2,"-1":3,"01":4,"1.5":5,"4294967294":6,"4294967295":7,"4294967296":8}',
+  '{"":1,"":2}', '{"__proto__":1}', '{"__proto__":{"a":1}}', '{"\\u0061":1,"a":2}',
+  '{"a":1,}', '{"a"}', '{,}', '{"a":1 "b":2}', '[1,]', '[,1]', '[1 2]', '{"a":[}', '[{]' ].forEach(check);
+
+/* literals, spaces and nesting */
+[ "", " ", "true", "false", "null", "nul", "truex", "true false", " \t\n\r[ \t\n\r1 \t\n\r] \t\n\r",
+  '"\t"', '"\u0001"', '"abc', '"\\"', "[" .repeat(511) + "]".repeat(511), "[".repeat(600) + "]".repeat(600),
+  "[".repeat(600) + "]".repeat(599) ].forEach(check);
+
+/* UTF-8: valid sequences, invalid ones being errors for QuickJS */
+check_bytes([0x22, 0xc3, 0xa9, 0x22], '"é"');
+check_bytes([0x22, 0xe2, 0x82, 0xac, 0x22], '"€"');
+check_bytes([0x22, 0xf0, 0x9f, 0x98, 0x80, 0x22], '"😀"');
+check_bytes([0x7b, 0x22, 0xc3, 0xa9, 0x22, 0x3a, 0x31, 0x7d], '{"é":1}');
+[ [0x80], [0xbf], [0xc3], [0xc0, 0x80], [0xc1, 0xbf], [0xe2, 0x82], [0xe0, 0x80, 0x80], [0xf0, 0x80, 0x80, 0x80],
+  [0xf4, 0x90, 0x80, 0x80], [0xf5, 0x80, 0x80, 0x80], [0xff], [0xfe], [0xc3, 0x41] ].forEach(function(seq) {
+	for (pad = 0 ; pad < 70 ; pad += pad < 60 ? 20 : 1) {
+		var bytes = [0x22];
+		for (j = 0 ; j < pad ; j++)
+			bytes.push(0x61);
+		check_bytes(bytes.concat(seq, [0x22]));
+		check_bytes([0x7b, 0x22].concat(seq, [0x22, 0x3a, 0x31, 0x7d]));
+	}
+});
+
+print("kernel " + kernel + ": " + count + " texts, " + failures + " failures");
+std.exit(failures ? 1 : 0);